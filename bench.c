@@ -0,0 +1,528 @@
+/*
+ * libwss -- WebSocket Server Library
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the Mozilla Public License Version 2.
+ */
+
+/*! \file
+ *
+ * \brief WebSocket library benchmarks
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "wss.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*! \brief Print results as CSV, rather than for humans */
+static int machine = 0;
+
+/*!
+ * \brief Report a single result
+ * \param bench Name of benchmark
+ * \param variant What was measured within the benchmark
+ * \param size Payload size
+ * \param conns Number of connections (0 if not applicable)
+ * \param metric Name of metric, including the unit
+ * \param value
+ */
+static void report(const char *bench, const char *variant, size_t size, int conns, const char *metric, double value)
+{
+	if (machine) {
+		printf("%s,%s,%lu,%d,%s,%.3f\n", bench, variant, size, conns, metric, value);
+	} else if (conns) {
+		printf("%-7s %-14s %8lu bytes %3d conns: %-12s %12.2f\n", bench, variant, size, conns, metric, value);
+	} else {
+		printf("%-7s %-14s %8lu bytes:           %-12s %12.2f\n", bench, variant, size, metric, value);
+	}
+}
+
+/*! \brief Byte-at-a-time masking, as a baseline */
+static void mask_naive(char *dst, const char *src, size_t len, const char key[4], size_t offset)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		dst[i] = src[i] ^ key[(offset + i) % 4];
+	}
+}
+
+static void bench_mask(size_t len, size_t total)
+{
+	const char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	char *buf = malloc(len);
+	size_t i, iterations = total / len;
+	double start, naive, fast;
+
+	assert(buf != NULL);
+	memset(buf, 'A', len);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		mask_naive(buf, buf, len, key, i);
+	}
+	naive = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		wss_mask(buf, buf, len, key, i);
+	}
+	fast = now() - start;
+
+	report("mask", "naive", len, 0, "MB/s", (double) (iterations * len) / naive / 1e6);
+	report("mask", "wss_mask", len, 0, "MB/s", (double) (iterations * len) / fast / 1e6);
+	free(buf);
+}
+
+static void bench_utf8(size_t len, size_t total)
+{
+	char *buf = malloc(len);
+	size_t i, iterations = total / len;
+	double start, elapsed;
+
+	assert(buf != NULL);
+	for (i = 0; i + 2 <= len; i += 2) {
+		/* Mostly ASCII, with the odd multibyte character */
+		memcpy(buf + i, i % 64 ? "ab" : "\xc3\xa9", 2);
+	}
+	memset(buf + i, 'a', len - i);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		assert(wss_utf8_valid(buf, len));
+	}
+	elapsed = now() - start;
+
+	report("utf8", "wss_utf8_valid", len, 0, "MB/s", (double) (iterations * len) / elapsed / 1e6);
+	free(buf);
+}
+
+/*! \brief An in-memory stream of frames, which repeats indefinitely when read */
+struct memstream {
+	char *buf;
+	size_t len;
+	size_t pos;
+	size_t size;
+};
+
+static ssize_t mem_read(void *data, char *buf, size_t len)
+{
+	struct memstream *ms = data;
+
+	if (ms->pos == ms->len) {
+		ms->pos = 0; /* Back to the start, which is a frame boundary */
+	}
+	if (len > ms->len - ms->pos) {
+		len = ms->len - ms->pos;
+	}
+	memcpy(buf, ms->buf + ms->pos, len);
+	ms->pos += len;
+	return (ssize_t) len;
+}
+
+static ssize_t mem_write(void *data, const char *buf, size_t len)
+{
+	struct memstream *ms = data;
+
+	if (ms->len + len > ms->size) {
+		ms->size = (ms->len + len) * 2;
+		ms->buf = realloc(ms->buf, ms->size);
+		assert(ms->buf != NULL);
+	}
+	memcpy(ms->buf + ms->len, buf, len);
+	ms->len += len;
+	return (ssize_t) len;
+}
+
+/*! \brief Encode enough frames of a given size to fill a stream, as a server would send them */
+static void memstream_fill(struct memstream *ms, size_t len)
+{
+	struct wss_client *writer = wss_client_new(ms, -1, -1);
+	char *payload = calloc(1, len ? len : 1);
+	size_t i, count = len > 65536 ? 4 : 256 * 1024 / (len + 14) + 1;
+
+	assert(writer && payload);
+	memset(ms, 0, sizeof(*ms));
+	wss_set_io_callbacks(writer, NULL, mem_write);
+	for (i = 0; i < count; i++) {
+		assert(!wss_write(writer, WS_OPCODE_BINARY, payload, len));
+	}
+	wss_client_destroy(writer);
+	free(payload);
+}
+
+/*! \brief Payload handling strategies, for bench_parse */
+enum payload_mode {
+	PAYLOAD_MALLOC,
+	PAYLOAD_POOL,
+	PAYLOAD_REUSE,
+};
+
+/*! \brief Read frames from memory, so that only parsing (and payload handling) is measured */
+static void bench_parse(const char *bench, const char *variant, size_t len, enum payload_mode mode, size_t total)
+{
+	struct memstream ms;
+	struct wss_client *reader;
+	size_t i, iterations = total / (len + 64);
+	double start, elapsed;
+
+	memstream_fill(&ms, len);
+	reader = wss_client_new(&ms, -1, -1);
+	assert(reader != NULL);
+	wss_set_client_type(reader, WS_CLIENT);
+	wss_set_io_callbacks(reader, mem_read, NULL);
+	assert(!wss_set_read_buffer(reader, 65536));
+	if (mode == PAYLOAD_POOL) {
+		wss_set_payload_pool(8 * 1024 * 1024);
+	} else if (mode == PAYLOAD_REUSE) {
+		wss_set_payload_reuse(reader, 1);
+	}
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		assert(wss_read(reader, 0, 1) == 1);
+		wss_frame_destroy(wss_client_frame(reader));
+	}
+	elapsed = now() - start;
+
+	report(bench, variant, len, 0, "frames/s", (double) iterations / elapsed);
+	report(bench, variant, len, 0, "ns/frame", elapsed * 1e9 / (double) iterations);
+	report(bench, variant, len, 0, "MB/s", (double) (iterations * len) / elapsed / 1e6);
+	wss_client_destroy(reader);
+	wss_set_payload_pool(0);
+	free(ms.buf);
+}
+
+/*! \brief Ways of sending, for bench_send */
+enum send_mode {
+	SEND_SERVER,
+	SEND_CLIENT,
+	SEND_BATCH,
+};
+
+/*! \brief Send messages to /dev/null, to see how many write calls each takes */
+static void bench_send(const char *variant, size_t len, enum send_mode mode, size_t total)
+{
+	struct wss_client *writer;
+	struct wss_stats stats;
+	struct wss_msg msgs[32];
+	char *payload = calloc(1, len);
+	size_t i, iterations = total / len;
+	double start, elapsed;
+	int fd = open("/dev/null", O_WRONLY);
+
+	assert(payload != NULL && fd >= 0);
+	writer = wss_client_new(NULL, -1, fd);
+	assert(writer != NULL);
+	assert(!wss_enable_stats(writer, 1));
+	if (mode == SEND_CLIENT) {
+		wss_set_client_type(writer, WS_CLIENT);
+	}
+	for (i = 0; i < 32; i++) {
+		msgs[i].opcode = WS_OPCODE_BINARY;
+		msgs[i].payload = payload;
+		msgs[i].len = len;
+	}
+	iterations = iterations / 32 * 32 + 32;
+
+	start = now();
+	if (mode == SEND_BATCH) {
+		for (i = 0; i < iterations; i += 32) {
+			assert(wss_write_batch(writer, msgs, 32) == 32);
+		}
+	} else {
+		for (i = 0; i < iterations; i++) {
+			assert(!wss_write(writer, WS_OPCODE_BINARY, payload, len));
+		}
+	}
+	elapsed = now() - start;
+
+	assert(!wss_client_stats(writer, &stats));
+	report("send", variant, len, 0, "msgs/s", (double) iterations / elapsed);
+	report("send", variant, len, 0, "writes/msg", (double) stats.writes / (double) iterations);
+	wss_client_destroy(writer);
+	close(fd);
+	free(payload);
+}
+
+/*! \brief Server side of the end-to-end benchmark */
+struct echo {
+	int nconns;
+	int *fds;
+	pthread_t thread;
+};
+
+/*! \brief Echo every message back on the connection it came from, using a client set */
+static void *echo_server(void *varg)
+{
+	struct echo *e = varg;
+	struct wss_clientset *set = wss_clientset_new();
+	struct wss_client **clients = calloc((size_t) e->nconns, sizeof(*clients));
+	struct wss_ready *ready = calloc((size_t) e->nconns, sizeof(*ready));
+	int i, open = e->nconns, want_write = 0;
+
+	assert(set && clients && ready);
+	for (i = 0; i < e->nconns; i++) {
+		assert(!fcntl(e->fds[i], F_SETFL, fcntl(e->fds[i], F_GETFL) | O_NONBLOCK));
+		clients[i] = wss_client_new(NULL, e->fds[i], e->fds[i]);
+		assert(clients[i] != NULL);
+		assert(!wss_set_read_buffer(clients[i], 16384));
+		wss_set_payload_reuse(clients[i], 1);
+		wss_set_nonblocking(clients[i], 1);
+		assert(!wss_clientset_add(set, clients[i]));
+	}
+	while (open > 0) {
+		int n = wss_poll(set, ready, e->nconns, want_write ? 1 : 1000);
+		assert(n >= 0);
+		for (i = 0; i < n; i++) {
+			struct wss_client *client = ready[i].client;
+			struct wss_frame *frame = wss_client_frame(client);
+			if (ready[i].res < 0) {
+				wss_clientset_remove(set, client);
+				open--;
+				continue;
+			}
+			assert(!wss_write(client, wss_frame_opcode(frame), wss_frame_payload(frame), wss_frame_payload_length(frame)));
+			wss_frame_destroy(frame);
+		}
+		want_write = 0;
+		for (i = 0; i < e->nconns; i++) {
+			if (wss_want_write(clients[i])) {
+				want_write |= wss_flush(clients[i]) > 0;
+			}
+		}
+	}
+	for (i = 0; i < e->nconns; i++) {
+		wss_client_destroy(clients[i]);
+		close(e->fds[i]);
+	}
+	wss_clientset_destroy(set);
+	free(clients);
+	free(ready);
+	return NULL;
+}
+
+/*! \brief Create a connected pair of TCP sockets over loopback */
+static void tcp_pair(int listener, struct sockaddr_in *sin, int fds[2])
+{
+	int one = 1;
+
+	fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+	assert(fds[1] >= 0);
+	assert(!connect(fds[1], (struct sockaddr *) sin, sizeof(*sin)));
+	fds[0] = accept(listener, NULL, NULL);
+	assert(fds[0] >= 0);
+	setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*!
+ * \brief Send messages in lockstep rounds over many connections to an echo server, timing each round trip
+ * \param tcp Whether to use TCP over loopback, rather than UNIX sockets
+ * \param len Payload size
+ * \param nconns Number of connections
+ */
+static void bench_e2e(int tcp, size_t len, int nconns)
+{
+	struct wss_client **clients = calloc((size_t) nconns, sizeof(*clients));
+	struct echo e;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	const char *variant = tcp ? "tcp" : "unix";
+	size_t msgs = 64 * 1024 * 1024 / (len + 64);
+	char *payload = calloc(1, len);
+	double *sent = calloc((size_t) nconns, sizeof(*sent));
+	double *latencies;
+	double start, elapsed;
+	int rounds, i, j, n = 0, listener = -1;
+	int *cfds = calloc((size_t) nconns, sizeof(*cfds));
+
+	assert(clients && payload && sent && cfds);
+	e.nconns = nconns;
+	e.fds = calloc((size_t) nconns, sizeof(*e.fds));
+	assert(e.fds != NULL);
+	if (tcp) {
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		assert(listener >= 0);
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		assert(!bind(listener, (struct sockaddr *) &sin, sizeof(sin)));
+		assert(!listen(listener, nconns));
+		assert(!getsockname(listener, (struct sockaddr *) &sin, &sinlen));
+	}
+	for (i = 0; i < nconns; i++) {
+		int fds[2];
+		if (tcp) {
+			tcp_pair(listener, &sin, fds);
+		} else {
+			assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+		}
+		e.fds[i] = fds[0];
+		cfds[i] = fds[1];
+		clients[i] = wss_client_new(NULL, fds[1], fds[1]);
+		assert(clients[i] != NULL);
+		wss_set_client_type(clients[i], WS_CLIENT);
+		assert(!wss_set_read_buffer(clients[i], 16384));
+		wss_set_payload_reuse(clients[i], 1);
+	}
+	if (tcp) {
+		close(listener);
+	}
+	assert(!pthread_create(&e.thread, NULL, echo_server, &e));
+
+	if (msgs > 20000) {
+		msgs = 20000;
+	}
+	rounds = (int) (msgs / (size_t) nconns);
+	if (rounds < 10) {
+		rounds = 10;
+	}
+	latencies = calloc((size_t) rounds * (size_t) nconns, sizeof(*latencies));
+	assert(latencies != NULL);
+
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < nconns; j++) {
+			sent[j] = now();
+			assert(!wss_write(clients[j], WS_OPCODE_BINARY, payload, len));
+		}
+		for (j = 0; j < nconns; j++) {
+			assert(wss_read(clients[j], 5000, 0) == 1);
+			latencies[n++] = now() - sent[j];
+			assert(wss_frame_payload_length(wss_client_frame(clients[j])) == len);
+			wss_frame_destroy(wss_client_frame(clients[j]));
+		}
+	}
+	elapsed = now() - start;
+
+	qsort(latencies, (size_t) n, sizeof(*latencies), cmp_double);
+	report("e2e", variant, len, nconns, "msgs/s", (double) n / elapsed);
+	report("e2e", variant, len, nconns, "p50_us", latencies[n / 2] * 1e6);
+	report("e2e", variant, len, nconns, "p99_us", latencies[(size_t) n * 99 / 100] * 1e6);
+	report("e2e", variant, len, nconns, "p999_us", latencies[(size_t) n * 999 / 1000] * 1e6);
+
+	for (i = 0; i < nconns; i++) {
+		wss_client_destroy(clients[i]);
+		close(cfds[i]);
+	}
+	pthread_join(e.thread, NULL);
+	free(e.fds);
+	free(cfds);
+	free(clients);
+	free(payload);
+	free(sent);
+	free(latencies);
+}
+
+/*! \brief Whether a benchmark was selected on the command line */
+static int selected(int argc, char *argv[], const char *name)
+{
+	int i;
+
+	if (optind >= argc) {
+		return 1; /* Run everything by default */
+	}
+	for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], name)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t sizes[] = { 16, 125, 1024, 65536, 1024 * 1024 };
+	size_t e2e_sizes[] = { 16, 1024, 65536 };
+	int e2e_conns[] = { 1, 16, 64 };
+	size_t i, j;
+	int c;
+
+	while ((c = getopt(argc, argv, "m")) != -1) {
+		switch (c) {
+		case 'm':
+			machine = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-m] [mask|utf8|parse|payload|send|e2e]...\n", argv[0]);
+			fprintf(stderr, "  -m  Print results as CSV (benchmark,variant,size,connections,metric,value)\n");
+			return 1;
+		}
+	}
+	if (machine) {
+		printf("benchmark,variant,size,connections,metric,value\n");
+	}
+
+	if (selected(argc, argv, "mask")) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			bench_mask(sizes[i], 256 * 1024 * 1024);
+		}
+	}
+	if (selected(argc, argv, "utf8")) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			bench_utf8(sizes[i], 256 * 1024 * 1024);
+		}
+	}
+	if (selected(argc, argv, "parse")) {
+		/* Payload lengths that need 7, 16, and 64-bit length encodings */
+		bench_parse("parse", "len7", 16, PAYLOAD_REUSE, 256 * 1024 * 1024);
+		bench_parse("parse", "len16", 200, PAYLOAD_REUSE, 256 * 1024 * 1024);
+		bench_parse("parse", "len64", 65536, PAYLOAD_REUSE, 256 * 1024 * 1024);
+	}
+	if (selected(argc, argv, "payload")) {
+		size_t payload_sizes[] = { 125, 4096, 65536 };
+		for (i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++) {
+			bench_parse("payload", "malloc", payload_sizes[i], PAYLOAD_MALLOC, 256 * 1024 * 1024);
+			bench_parse("payload", "pool", payload_sizes[i], PAYLOAD_POOL, 256 * 1024 * 1024);
+			bench_parse("payload", "reuse", payload_sizes[i], PAYLOAD_REUSE, 256 * 1024 * 1024);
+		}
+	}
+	if (selected(argc, argv, "send")) {
+		size_t send_sizes[] = { 125, 4096, 65536 };
+		for (i = 0; i < sizeof(send_sizes) / sizeof(send_sizes[0]); i++) {
+			bench_send("server", send_sizes[i], SEND_SERVER, 256 * 1024 * 1024);
+			bench_send("client", send_sizes[i], SEND_CLIENT, 256 * 1024 * 1024);
+			bench_send("server_batch", send_sizes[i], SEND_BATCH, 256 * 1024 * 1024);
+		}
+	}
+	if (selected(argc, argv, "e2e")) {
+		for (i = 0; i < sizeof(e2e_sizes) / sizeof(e2e_sizes[0]); i++) {
+			for (j = 0; j < sizeof(e2e_conns) / sizeof(e2e_conns[0]); j++) {
+				bench_e2e(0, e2e_sizes[i], e2e_conns[j]);
+				bench_e2e(1, e2e_sizes[i], e2e_conns[j]);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,590 @@
+/*
+ * libwss -- WebSocket Server Library
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the Mozilla Public License Version 2.
+ */
+
+/*! \file
+ *
+ * \brief WebSocket load generator
+ *
+ * Opens many client connections to an echo server, spread across threads,
+ * and measures the round trip time of each message.
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wss.h"
+
+/*! \brief Maximum number of message sizes in a mix */
+#define MAX_MIX 16
+
+/*! \brief Latency histogram: 8 linear sub-buckets per power of 2 nanoseconds */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct hist {
+	unsigned long long counts[HIST_BUCKETS];
+	unsigned long long total;
+	uint64_t max;
+};
+
+/*! \brief Message sizes, and how often each is sent */
+struct mix {
+	size_t sizes[MAX_MIX];
+	unsigned int weights[MAX_MIX];
+	unsigned int totalweight;
+	int n;
+};
+
+static struct {
+	const char *host;
+	const char *port;
+	const char *path;
+	int conns;
+	int threads;
+	int duration;			/*!< Seconds */
+	unsigned long count;	/*!< Messages per connection, or 0 for no limit */
+	int textpct;			/*!< Percent of messages sent as TEXT, rather than BINARY */
+	size_t fragment;		/*!< Max fragment size, or 0 */
+	int machine;
+	int histogram;
+	struct mix mix;
+} opts = {
+	.port = "80",
+	.path = "/",
+	.conns = 1,
+	.threads = 1,
+	.duration = 10,
+};
+
+/*! \brief A single connection */
+struct conn {
+	struct wss_client *client;
+	int fd;
+	int busy;				/*!< Waiting for a message to be echoed */
+	uint64_t sent;			/*!< When the pending message was sent */
+	size_t len;				/*!< Length of the pending message */
+	unsigned long messages;	/*!< Messages echoed */
+};
+
+/*! \brief A thread, and the connections it drives */
+struct worker {
+	pthread_t thread;
+	int nconns;
+	int connected;
+	unsigned long long messages;
+	unsigned long long bytes;
+	unsigned long long errors;
+	uint64_t prng;
+	struct hist hist;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static unsigned int hist_bucket(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < (1 << HIST_SUB_BITS)) {
+		return (unsigned int) v;
+	}
+	msb = 63 - (unsigned int) __builtin_clzll(v);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | (unsigned int) ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/*! \brief Smallest value that falls in a bucket */
+static uint64_t hist_value(unsigned int bucket)
+{
+	unsigned int exp = bucket >> HIST_SUB_BITS;
+	uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+
+	if (!exp) {
+		return sub;
+	}
+	return (sub | (1 << HIST_SUB_BITS)) << (exp - 1);
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->counts[hist_bucket(v)]++;
+	h->total++;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->counts[i] += src->counts[i];
+	}
+	dst->total += src->total;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+/*! \brief Value at a given percentile (midpoint of its bucket) */
+static uint64_t hist_percentile(const struct hist *h, double pct)
+{
+	unsigned long long target = (unsigned long long) ((double) h->total * pct / 100.0);
+	unsigned long long seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen > target) {
+			uint64_t lo = hist_value(i), hi = i + 1 < HIST_BUCKETS ? hist_value(i + 1) : lo;
+			return lo + (hi - lo) / 2 < h->max ? lo + (hi - lo) / 2 : h->max;
+		}
+	}
+	return h->max;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*!
+ * \brief Connect to the server, and upgrade the connection to a WebSocket
+ * \return Connected socket, or -1 on failure
+ */
+static int ws_connect(void)
+{
+	struct addrinfo hints, *res, *ai;
+	char key[25], request[1024], response[4096];
+	size_t len = 0;
+	int fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(opts.host, opts.port, &hints, &res)) {
+		fprintf(stderr, "Failed to resolve %s\n", opts.host);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to connect to %s:%s: %s\n", opts.host, opts.port, strerror(errno));
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (wss_handshake_key(key)) {
+		close(fd);
+		return -1;
+	}
+	snprintf(request, sizeof(request),
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s:%s\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: %s\r\n"
+		"Sec-WebSocket-Version: 13\r\n"
+		"\r\n", opts.path, opts.host, opts.port, key);
+	if (write(fd, request, strlen(request)) != (ssize_t) strlen(request)) {
+		fprintf(stderr, "Failed to send handshake: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* Read exactly the response headers, leaving anything after them for the library */
+	for (;;) {
+		char *end;
+		ssize_t bytes = recv(fd, response + len, sizeof(response) - 1 - len, MSG_PEEK);
+		if (bytes <= 0) {
+			fprintf(stderr, "Failed to read handshake response: %s\n", bytes ? strerror(errno) : "Disconnected");
+			close(fd);
+			return -1;
+		}
+		response[len + (size_t) bytes] = '\0';
+		end = strstr(response, "\r\n\r\n");
+		if (end) {
+			bytes = (ssize_t) ((size_t) (end + 4 - response) - len);
+		}
+		if (read(fd, response + len, (size_t) bytes) != bytes) {
+			close(fd);
+			return -1;
+		}
+		len += (size_t) bytes;
+		if (end) {
+			break;
+		} else if (len >= sizeof(response) - 1) {
+			fprintf(stderr, "Handshake response too long\n");
+			close(fd);
+			return -1;
+		}
+	}
+	if (wss_handshake_check_response(response, len, key, &len) != 1) {
+		fprintf(stderr, "Upgrade refused: %.*s\n", (int) strcspn(response, "\r\n"), response);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*! \brief Send the next message on a connection */
+static int conn_send(struct worker *w, struct conn *c, const char *text, const char *binary)
+{
+	uint64_t r = xorshift(&w->prng);
+	unsigned int pick = (unsigned int) (r % opts.mix.totalweight);
+	int i, opcode;
+
+	for (i = 0; i < opts.mix.n - 1 && pick >= opts.mix.weights[i]; i++) {
+		pick -= opts.mix.weights[i];
+	}
+	c->len = opts.mix.sizes[i];
+	opcode = (int) ((r >> 32) % 100) < opts.textpct ? WS_OPCODE_TEXT : WS_OPCODE_BINARY;
+	c->sent = now_ns();
+	c->busy = 1;
+	return wss_write(c->client, opcode, opcode == WS_OPCODE_TEXT ? text : binary, c->len);
+}
+
+static void conn_close(struct worker *w, struct conn *c, struct wss_clientset *set)
+{
+	if (!c->client) {
+		return;
+	}
+	wss_clientset_remove(set, c->client);
+	wss_client_destroy(c->client);
+	close(c->fd);
+	c->client = NULL;
+	w->connected--;
+}
+
+static void *worker_run(void *varg)
+{
+	struct worker *w = varg;
+	struct conn *conns = calloc((size_t) w->nconns, sizeof(*conns));
+	struct wss_ready *ready = calloc((size_t) w->nconns, sizeof(*ready));
+	struct wss_clientset *set = wss_clientset_new();
+	size_t maxlen = 0;
+	char *text, *binary;
+	uint64_t deadline;
+	int i;
+
+	for (i = 0; i < opts.mix.n; i++) {
+		maxlen = opts.mix.sizes[i] > maxlen ? opts.mix.sizes[i] : maxlen;
+	}
+	text = malloc(maxlen + 1);
+	binary = malloc(maxlen + 1);
+	if (!conns || !ready || !set || !text || !binary) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < (int) maxlen; i++) {
+		text[i] = (char) ('a' + i % 26);
+		binary[i] = (char) xorshift(&w->prng);
+	}
+
+	for (i = 0; i < w->nconns; i++) {
+		struct conn *c = &conns[i];
+		c->fd = ws_connect();
+		if (c->fd < 0) {
+			w->errors++;
+			continue;
+		}
+		c->client = wss_client_new(c, c->fd, c->fd);
+		if (!c->client) {
+			close(c->fd);
+			w->errors++;
+			continue;
+		}
+		wss_set_client_type(c->client, WS_CLIENT);
+		wss_set_auto_control(c->client, 1);
+		wss_set_payload_reuse(c->client, 1);
+		wss_set_read_buffer(c->client, 16384);
+		if (opts.fragment) {
+			wss_set_max_fragment_size(c->client, opts.fragment);
+		}
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+		wss_set_nonblocking(c->client, 1);
+		if (wss_clientset_add(set, c->client)) {
+			wss_client_destroy(c->client);
+			close(c->fd);
+			c->client = NULL;
+			w->errors++;
+			continue;
+		}
+		w->connected++;
+	}
+
+	deadline = now_ns() + (uint64_t) opts.duration * 1000000000ULL;
+	while (w->connected > 0 && (!opts.duration || now_ns() < deadline)) {
+		int n, want_write = 0;
+		/* Keep one message outstanding on every connection */
+		for (i = 0; i < w->nconns; i++) {
+			struct conn *c = &conns[i];
+			if (!c->client || c->busy) {
+				continue;
+			} else if (opts.count && c->messages >= opts.count) {
+				wss_set_nonblocking(c->client, 0);
+				wss_close(c->client, WS_CLOSE_NORMAL);
+				conn_close(w, c, set);
+			} else if (conn_send(w, c, text, binary)) {
+				w->errors++;
+				conn_close(w, c, set);
+			}
+		}
+		for (i = 0; i < w->nconns; i++) {
+			if (conns[i].client && wss_want_write(conns[i].client)) {
+				want_write |= wss_flush(conns[i].client) > 0;
+			}
+		}
+		n = wss_poll(set, ready, w->nconns, want_write ? 1 : 100);
+		for (i = 0; i < n; i++) {
+			struct wss_frame *frame = wss_client_frame(ready[i].client);
+			struct conn *c = wss_client_data(ready[i].client);
+			if (ready[i].res < 0) {
+				w->errors++;
+				conn_close(w, c, set);
+				continue;
+			}
+			if (wss_frame_opcode(frame) == WS_OPCODE_TEXT || wss_frame_opcode(frame) == WS_OPCODE_BINARY) {
+				if (wss_frame_payload_length(frame) != c->len) {
+					w->errors++; /* Not an echo of what we sent */
+				}
+				hist_add(&w->hist, now_ns() - c->sent);
+				w->messages++;
+				w->bytes += c->len;
+				c->messages++;
+				c->busy = 0;
+			} else if (wss_frame_opcode(frame) == WS_OPCODE_CLOSE) {
+				conn_close(w, c, set);
+				continue;
+			}
+			wss_frame_destroy(frame);
+		}
+	}
+
+	for (i = 0; i < w->nconns; i++) {
+		if (conns[i].client) {
+			wss_set_nonblocking(conns[i].client, 0);
+			wss_close(conns[i].client, WS_CLOSE_NORMAL);
+			conn_close(w, &conns[i], set);
+		}
+	}
+	wss_clientset_destroy(set);
+	free(conns);
+	free(ready);
+	free(text);
+	free(binary);
+	return NULL;
+}
+
+/*! \brief Parse a message mix, e.g. 125:8,4096:2,65536 (size[:weight],...) */
+static int parse_mix(const char *arg, struct mix *mix)
+{
+	const char *s = arg;
+
+	memset(mix, 0, sizeof(*mix));
+	while (*s) {
+		char *end;
+		if (mix->n == MAX_MIX) {
+			fprintf(stderr, "Too many message sizes (max %d)\n", MAX_MIX);
+			return -1;
+		}
+		mix->sizes[mix->n] = strtoul(s, &end, 10);
+		mix->weights[mix->n] = 1;
+		if (end == s) {
+			fprintf(stderr, "Invalid message mix: %s\n", arg);
+			return -1;
+		}
+		if (*end == ':') {
+			s = end + 1;
+			mix->weights[mix->n] = (unsigned int) strtoul(s, &end, 10);
+			if (end == s || !mix->weights[mix->n]) {
+				fprintf(stderr, "Invalid message mix: %s\n", arg);
+				return -1;
+			}
+		}
+		mix->totalweight += mix->weights[mix->n];
+		mix->n++;
+		s = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',') {
+			fprintf(stderr, "Invalid message mix: %s\n", arg);
+			return -1;
+		}
+	}
+	return mix->n ? 0 : -1;
+}
+
+static void report(const char *metric, double value)
+{
+	if (opts.machine) {
+		printf("loadgen,%s,%d,%s,%.3f\n", opts.host, opts.conns, metric, value);
+	} else {
+		printf("%-16s %14.2f\n", metric, value);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] host [port]\n"
+		"  -c conns     Number of connections (default 1)\n"
+		"  -j threads   Number of threads, among which connections are divided (default 1)\n"
+		"  -d seconds   Duration of test (default 10, 0 to run until -n messages have been sent)\n"
+		"  -n count     Messages to send per connection (default: no limit)\n"
+		"  -s mix       Message sizes to send, as size[:weight],... (default 125)\n"
+		"  -t percent   Percentage of messages sent as TEXT rather than BINARY (default 0)\n"
+		"  -f size      Fragment messages larger than this size\n"
+		"  -p path      Request path (default /)\n"
+		"  -H           Print the latency histogram\n"
+		"  -m           Print results as CSV (benchmark,host,connections,metric,value)\n"
+		"The server must echo each data message it receives.\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	struct hist hist;
+	unsigned long long messages = 0, bytes = 0, errors = 0;
+	uint64_t start;
+	double elapsed;
+	int c, i;
+
+	parse_mix("125", &opts.mix);
+	while ((c = getopt(argc, argv, "c:d:f:Hj:mn:p:s:t:")) != -1) {
+		switch (c) {
+		case 'c':
+			opts.conns = atoi(optarg);
+			break;
+		case 'd':
+			opts.duration = atoi(optarg);
+			break;
+		case 'f':
+			opts.fragment = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			opts.histogram = 1;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'm':
+			opts.machine = 1;
+			break;
+		case 'n':
+			opts.count = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			opts.path = optarg;
+			break;
+		case 's':
+			if (parse_mix(optarg, &opts.mix)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			opts.textpct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || opts.conns < 1 || opts.threads < 1 || (!opts.duration && !opts.count)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	opts.host = argv[optind];
+	if (optind + 1 < argc) {
+		opts.port = argv[optind + 1];
+	}
+	if (opts.threads > opts.conns) {
+		opts.threads = opts.conns;
+	}
+
+	workers = calloc((size_t) opts.threads, sizeof(*workers));
+	if (!workers) {
+		return EXIT_FAILURE;
+	}
+	start = now_ns();
+	for (i = 0; i < opts.threads; i++) {
+		workers[i].nconns = opts.conns / opts.threads + (i < opts.conns % opts.threads);
+		workers[i].prng = (uint64_t) (i + 1) * 0x9E3779B97F4A7C15ULL;
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+			fprintf(stderr, "Failed to create thread: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	memset(&hist, 0, sizeof(hist));
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		hist_merge(&hist, &workers[i].hist);
+		messages += workers[i].messages;
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+	}
+	elapsed = (double) (now_ns() - start) / 1e9;
+
+	if (opts.machine) {
+		printf("benchmark,host,connections,metric,value\n");
+	}
+	report("messages", (double) messages);
+	report("errors", (double) errors);
+	report("msgs/s", (double) messages / elapsed);
+	report("MB/s", (double) bytes / elapsed / 1e6);
+	report("p50_us", (double) hist_percentile(&hist, 50) / 1e3);
+	report("p90_us", (double) hist_percentile(&hist, 90) / 1e3);
+	report("p99_us", (double) hist_percentile(&hist, 99) / 1e3);
+	report("p999_us", (double) hist_percentile(&hist, 99.9) / 1e3);
+	report("max_us", (double) hist.max / 1e3);
+	if (opts.histogram) {
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			if (hist.counts[i]) {
+				if (opts.machine) {
+					printf("loadgen,%s,%d,hist_%.3f_us,%llu\n", opts.host, opts.conns, (double) hist_value((unsigned int) i) / 1e3, hist.counts[i]);
+				} else {
+					printf("  >= %12.3f us: %llu\n", (double) hist_value((unsigned int) i) / 1e3, hist.counts[i]);
+				}
+			}
+		}
+	}
+	free(workers);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
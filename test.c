@@ -17,10 +17,17 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <wss.h>
 
@@ -56,7 +63,16 @@ static ssize_t write_cb(void *data, const char *buf, size_t len)
 	return write(cb->wfd, buf, len);
 }
 
-static int test(int io_callbacks)
+static int writes = 0;
+
+static ssize_t writev_cb(void *data, const struct iovec *iov, int iovcnt)
+{
+	struct custom *cb = data;
+	writes++;
+	return writev(cb->wfd, iov, iovcnt);
+}
+
+static int test(int io_callbacks, int buffered)
 {
 	int res;
 	struct wss_client *server, *client;
@@ -66,6 +82,9 @@ static int test(int io_callbacks)
 	char payload[256];
 	size_t payloadlen;
 	struct custom serverdata, clientdata;
+	char *large;
+	int i;
+	struct wss_msg msgs[3];
 
 	wss_set_logger(ws_log);
 	wss_set_log_level(WS_LOG_DEBUG + 10);
@@ -89,6 +108,10 @@ static int test(int io_callbacks)
 		wss_set_io_callbacks(server, read_cb, write_cb);
 		wss_set_io_callbacks(client, read_cb, write_cb);
 	}
+	if (buffered) {
+		assert(!wss_set_read_buffer(server, 16384));
+		assert(!wss_set_read_buffer(client, 16384));
+	}
 
 	/* Server write to client */
 	payloadlen = (size_t) snprintf(payload, sizeof(payload), "%s", "{hello there}");
@@ -116,6 +139,91 @@ static int test(int io_callbacks)
 	assert(!strcmp(wss_frame_payload(frame), payload));
 	wss_frame_destroy(frame);
 
+	/* Header and payload are written together */
+	if (io_callbacks) {
+		wss_set_writev_callback(client, writev_cb);
+		wss_set_writev_callback(server, writev_cb);
+		writes = 0;
+		wss_write(client, WS_OPCODE_TEXT, "vectored", 8);
+		assert(writes == 1);
+		res = wss_read(server, 250, 0);
+		assert(res > 0);
+		frame = wss_client_frame(server);
+		assert(!strcmp(wss_frame_payload(frame), "vectored"));
+		wss_frame_destroy(frame);
+	}
+
+	/* Batched writes */
+	msgs[0].opcode = WS_OPCODE_TEXT;
+	msgs[0].payload = "one";
+	msgs[0].len = 3;
+	msgs[1].opcode = WS_OPCODE_PING;
+	msgs[1].payload = NULL;
+	msgs[1].len = 0;
+	msgs[2].opcode = WS_OPCODE_BINARY;
+	msgs[2].payload = "three";
+	msgs[2].len = 5;
+	for (i = 0; i < 2; i++) {
+		struct wss_client *sender = i ? client : server;
+		struct wss_client *receiver = i ? server : client;
+		writes = 0;
+		res = wss_write_batch(sender, msgs, 3);
+		assert(res == 3);
+		if (io_callbacks) {
+			assert(writes == 1);
+		}
+		assert(wss_read(receiver, 250, 0) > 0);
+		frame = wss_client_frame(receiver);
+		assert(!strcmp(wss_frame_payload(frame), "one"));
+		wss_frame_destroy(frame);
+		assert(wss_read(receiver, 250, 0) > 0);
+		frame = wss_client_frame(receiver);
+		assert(wss_frame_opcode(frame) == WS_OPCODE_PING);
+		assert(wss_frame_payload_length(frame) == 0);
+		wss_frame_destroy(frame);
+		assert(wss_read(receiver, 250, 0) > 0);
+		frame = wss_client_frame(receiver);
+		assert(!memcmp(wss_frame_payload(frame), "three", 5));
+		wss_frame_destroy(frame);
+	}
+
+	/* Payload larger than the masking chunk size */
+	large = malloc(20000);
+	assert(large != NULL);
+	for (i = 0; i < 20000; i++) {
+		large[i] = (char) i;
+	}
+	wss_write(client, WS_OPCODE_BINARY, large, 20000);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload_length(frame) == 20000);
+	assert(!memcmp(wss_frame_payload(frame), large, 20000));
+	wss_frame_destroy(frame);
+	free(large);
+
+	/* Multiple frames written back to back */
+	wss_write(client, WS_OPCODE_TEXT, "first", 5);
+	wss_write(client, WS_OPCODE_BINARY, "second", 6);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_TEXT);
+	assert(!strcmp(wss_frame_payload(frame), "first"));
+	wss_frame_destroy(frame);
+	if (buffered) {
+		/* The second frame was read along with the first one */
+		assert(wss_read_pending(server) > 0);
+	}
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_BINARY);
+	assert(wss_frame_payload_length(frame) == 6);
+	assert(!memcmp(wss_frame_payload(frame), "second", 6));
+	wss_frame_destroy(frame);
+	assert(!wss_read_pending(server));
+
 	/* Clean up */
 	wss_client_destroy(client);
 	wss_client_destroy(server);
@@ -126,13 +234,1977 @@ static int test(int io_callbacks)
 	return 0;
 }
 
+static int test_mask(void)
+{
+	const char key[4] = { 0x01, 0x7f, (char) 0x80, (char) 0xfe };
+	char src[300], dst[300];
+	size_t offset, len, i;
+
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = (char) (i * 7);
+	}
+	/* Mask chunks of varying length at varying offsets, and compare to byte-at-a-time masking */
+	for (offset = 0; offset < 8; offset++) {
+		for (len = 0; len < sizeof(src); len += 13) {
+			wss_mask(dst, src, len, key, offset);
+			for (i = 0; i < len; i++) {
+				assert(dst[i] == (src[i] ^ key[(offset + i) % 4]));
+			}
+			/* Masking twice (in place) gets back the original */
+			wss_mask(dst, dst, len, key, offset);
+			assert(!memcmp(dst, src, len));
+		}
+	}
+	return 0;
+}
+
+static int test_mask_keys(void)
+{
+	struct wss_client *client;
+	unsigned char frame[7], prev[4];
+	int fds[2];
+	int i, repeats = 0, high = 0;
+
+	assert(!pipe(fds));
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	memset(prev, 0, sizeof(prev));
+	for (i = 0; i < 64; i++) {
+		int j;
+		assert(!wss_write(client, WS_OPCODE_TEXT, "x", 1));
+		assert(read(fds[0], frame, sizeof(frame)) == sizeof(frame));
+		assert(frame[1] == (0x80 | 1));
+		assert((frame[6] ^ frame[2]) == 'x');
+		/* Every frame gets a new key, using all 32 bits */
+		if (!memcmp(prev, frame + 2, 4)) {
+			repeats++;
+		}
+		memcpy(prev, frame + 2, 4);
+		for (j = 2; j < 6; j++) {
+			if (frame[j] >= 0x80) {
+				high++;
+			}
+		}
+	}
+	assert(!repeats);
+	assert(high > 0);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static int allocations = 0;
+
+static void *test_realloc(void *data, void *ptr, size_t size)
+{
+	assert(data != NULL);
+	allocations++;
+	return realloc(ptr, size);
+}
+
+static void test_free(void *data, void *ptr)
+{
+	assert(data != NULL);
+	allocations--;
+	free(ptr);
+}
+
+static int test_payload_buffers(void)
+{
+	int res;
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	int upstream[2];
+	char buf[32];
+	char *payload;
+
+	assert(!pipe(upstream));
+	server = wss_client_new(&upstream, upstream[0], upstream[1]);
+	assert(server != NULL);
+	client = wss_client_new(&upstream, upstream[0], upstream[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+
+	/* Custom allocator */
+	wss_set_payload_allocator(server, test_realloc, test_free);
+	wss_write(client, WS_OPCODE_TEXT, "allocated", 9);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	assert(allocations == 1);
+	frame = wss_client_frame(server);
+	assert(!strcmp(wss_frame_payload(frame), "allocated"));
+	wss_frame_destroy(frame);
+	assert(allocations == 0);
+
+	/* Payload reuse */
+	wss_set_payload_allocator(server, NULL, NULL);
+	wss_set_payload_reuse(server, 1);
+	wss_write(client, WS_OPCODE_TEXT, "reused", 6);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	payload = wss_frame_payload(frame);
+	wss_frame_destroy(frame);
+	wss_write(client, WS_OPCODE_TEXT, "again", 5);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload(frame) == payload);
+	assert(!strcmp(wss_frame_payload(frame), "again"));
+	wss_frame_destroy(frame);
+
+	/* Pooled buffers */
+	wss_set_payload_reuse(server, 0);
+	wss_set_payload_pool(65536);
+	wss_write(client, WS_OPCODE_TEXT, "pooled", 6);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	payload = wss_frame_payload(frame);
+	wss_frame_destroy(frame);
+	wss_write(client, WS_OPCODE_TEXT, "from the pool", 13);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload(frame) == payload); /* Same size class */
+	assert(!strcmp(wss_frame_payload(frame), "from the pool"));
+	wss_frame_destroy(frame);
+	wss_set_payload_pool(0);
+
+	/* Application-provided buffer */
+	wss_set_payload_buffer(server, buf, sizeof(buf));
+	wss_write(client, WS_OPCODE_TEXT, "in place", 8);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload(frame) == buf);
+	assert(!strcmp(buf, "in place"));
+	wss_frame_destroy(frame);
+	assert(allocations == 0);
+
+	/* A control frame in the middle of a message doesn't overwrite it */
+	assert(write(upstream[1], "\x01\x86\0\0\0\0HELLO ", 12) == 12);
+	assert(write(upstream[1], "\x89\x8b\0\0\0\0pingpayload", 17) == 17);
+	assert(write(upstream[1], "\x80\x85\0\0\0\0WORLD", 11) == 11);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PING);
+	assert(!strcmp(wss_frame_payload(frame), "pingpayload"));
+	wss_frame_destroy(frame);
+	res = wss_read(server, 250, 0);
+	assert(res > 0);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload(frame) == buf);
+	assert(!strcmp(buf, "HELLO WORLD"));
+	wss_frame_destroy(frame);
+
+	/* Too large for the buffer */
+	memset(buf, 'A', sizeof(buf));
+	wss_write(client, WS_OPCODE_BINARY, buf, sizeof(buf));
+	res = wss_read(server, 250, 0);
+	assert(res < 0);
+	assert(wss_error_code(server) == WS_CLOSE_LARGE_PAYLOAD);
+
+	wss_client_destroy(client);
+	wss_client_destroy(server);
+	close(upstream[0]);
+	close(upstream[1]);
+	return 0;
+}
+
+static int test_encoded(void)
+{
+	struct wss_client *servers[2], *clients[2];
+	struct wss_encoded_frame *encoded;
+	struct wss_frame *frame;
+	int pipes[2][2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		assert(!pipe(pipes[i]));
+		servers[i] = wss_client_new(NULL, pipes[i][0], pipes[i][1]);
+		clients[i] = wss_client_new(NULL, pipes[i][0], pipes[i][1]);
+		assert(servers[i] != NULL && clients[i] != NULL);
+		wss_set_client_type(clients[i], WS_CLIENT);
+	}
+
+	/* Encode once, send to all servers */
+	encoded = wss_encode_frame(WS_SERVER, WS_OPCODE_TEXT, "broadcast", 9);
+	assert(encoded != NULL);
+	for (i = 0; i < 2; i++) {
+		assert(!wss_write_encoded(servers[i], wss_encoded_frame_ref(encoded)));
+		wss_encoded_frame_unref(encoded);
+	}
+	assert(wss_write_encoded(clients[0], encoded) < 0); /* Wrong connection type */
+	wss_encoded_frame_unref(encoded);
+	for (i = 0; i < 2; i++) {
+		assert(wss_read(clients[i], 250, 0) > 0);
+		frame = wss_client_frame(clients[i]);
+		assert(!strcmp(wss_frame_payload(frame), "broadcast"));
+		wss_frame_destroy(frame);
+	}
+
+	/* Frames encoded for clients are masked */
+	encoded = wss_encode_frame(WS_CLIENT, WS_OPCODE_BINARY, "masked", 6);
+	assert(encoded != NULL);
+	for (i = 0; i < 2; i++) {
+		assert(!wss_write_encoded(clients[i], encoded));
+	}
+	wss_encoded_frame_unref(encoded);
+	for (i = 0; i < 2; i++) {
+		assert(wss_read(servers[i], 250, 0) > 0);
+		frame = wss_client_frame(servers[i]);
+		assert(!memcmp(wss_frame_payload(frame), "masked", 6));
+		wss_frame_destroy(frame);
+		wss_client_destroy(servers[i]);
+		wss_client_destroy(clients[i]);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	return 0;
+}
+
+static int test_nonblocking(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	int fds[2], raw[2];
+	char buf[65536];
+	char *large;
+	ssize_t res;
+	size_t total;
+	int i;
+
+	/* Read a frame one byte at a time */
+	assert(!pipe(raw));
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	assert(!fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK));
+	assert(!fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK));
+	server = wss_client_new(NULL, fds[0], fds[0]);
+	assert(server != NULL);
+	wss_set_nonblocking(server, 1);
+	client = wss_client_new(NULL, raw[0], raw[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+
+	assert(wss_read(server, 0, 0) == 0); /* Nothing yet */
+	wss_write(client, WS_OPCODE_TEXT, "nonblocking", 11);
+	res = read(raw[0], buf, sizeof(buf));
+	assert(res == 6 + 11);
+	for (i = 0; i < 6 + 10; i++) { /* Header and payload, one byte at a time */
+		assert(write(fds[1], buf + i, 1) == 1);
+		assert(wss_read(server, 0, 1) == 0);
+	}
+	assert(write(fds[1], buf + i, 1) == 1);
+	assert(wss_read(server, 0, 1) == 1);
+	frame = wss_client_frame(server);
+	assert(!strcmp(wss_frame_payload(frame), "nonblocking"));
+	wss_frame_destroy(frame);
+	assert(wss_read(server, 0, 1) == 0);
+
+	/* Writes that don't fit are queued */
+	large = calloc(1, 1024 * 1024);
+	assert(large != NULL);
+	assert(!wss_want_write(server));
+	assert(!wss_write(server, WS_OPCODE_BINARY, large, 1024 * 1024));
+	assert(wss_want_write(server));
+	assert(!wss_write(server, WS_OPCODE_TEXT, "after", 5));
+	total = 0;
+	do {
+		res = read(fds[1], buf, sizeof(buf));
+		if (res > 0) {
+			total += (size_t) res;
+		} else {
+			assert(errno == EAGAIN);
+		}
+	} while (wss_flush(server) || res > 0);
+	assert(!wss_want_write(server));
+	assert(total == 10 + 1024 * 1024 + 2 + 5);
+	free(large);
+
+	wss_client_destroy(client);
+	wss_client_destroy(server);
+	close(fds[0]);
+	close(fds[1]);
+	close(raw[0]);
+	close(raw[1]);
+	return 0;
+}
+
+/*! \brief Write an unmasked frame directly, bypassing the library, to control fragmentation */
+static void write_raw_frame(int fd, int opcode, int fin, const char *payload, size_t len)
+{
+	unsigned char header[2];
+	assert(len <= 125);
+	header[0] = (unsigned char) ((fin ? 0x80 : 0) | opcode);
+	header[1] = (unsigned char) len;
+	assert(write(fd, header, 2) == 2);
+	assert(write(fd, payload, len) == (ssize_t) len);
+}
+
+static char streamed[64];
+static size_t streamed_len = 0;
+static int streamed_final = 0;
+
+static int stream_cb(void *data, int opcode, const char *buf, size_t len, unsigned long offset, int final_fragment, int final_chunk)
+{
+	(void) data;
+	assert(opcode == WS_OPCODE_TEXT);
+	assert(offset == streamed_len);
+	assert(offset + len <= sizeof(streamed));
+	memcpy(streamed + offset, buf, len);
+	streamed_len += len;
+	streamed_final = final_fragment && final_chunk;
+	return 0;
+}
+
+static int test_fragmented(int buffered)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	struct wss_msg msgs[2];
+	int fds[2];
+	int i;
+	unsigned long fragments, reallocs, fragments2, reallocs2;
+
+	assert(!pipe(fds));
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	if (buffered) {
+		assert(!wss_set_read_buffer(client, 16384));
+	}
+	server = wss_client_new(NULL, fds[0], fds[1]);
+	assert(server != NULL);
+
+	/* Reassembly */
+	write_raw_frame(fds[1], WS_OPCODE_TEXT, 0, "one ", 4);
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 0, "two ", 4);
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 1, "three", 5);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_TEXT);
+	assert(wss_frame_payload_length(frame) == 13);
+	assert(!strcmp(wss_frame_payload(frame), "one two three"));
+	wss_frame_destroy(frame);
+
+	/* Reassembly buffers grow geometrically */
+	write_raw_frame(fds[1], WS_OPCODE_TEXT, 0, "a", 1);
+	for (i = 0; i < 62; i++) {
+		write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 0, "a", 1);
+	}
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 1, "a", 1);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_payload_length(frame) == 64);
+	wss_frame_destroy(frame);
+	wss_reassembly_counters(client, &fragments, &reallocs);
+	assert(fragments == 2 + 63);
+	assert(reallocs <= 2 + 7);
+
+	/* With a size hint, no reallocations are needed */
+	wss_set_message_size_hint(client, 64);
+	write_raw_frame(fds[1], WS_OPCODE_TEXT, 0, "a", 1);
+	for (i = 0; i < 62; i++) {
+		write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 0, "a", 1);
+	}
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 1, "a", 1);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_payload_length(frame) == 64);
+	wss_frame_destroy(frame);
+	fragments2 = fragments;
+	reallocs2 = reallocs;
+	wss_reassembly_counters(client, &fragments, &reallocs);
+	assert(fragments == fragments2 + 63);
+	assert(reallocs == reallocs2);
+
+	/* Streaming */
+	wss_set_stream_callback(client, stream_cb);
+	write_raw_frame(fds[1], WS_OPCODE_TEXT, 0, "streamed ", 9);
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 0, "in ", 3);
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 1, "pieces", 6);
+	assert(wss_read(client, 250, 0) == 1);
+	assert(streamed_final);
+	assert(streamed_len == 18);
+	assert(!memcmp(streamed, "streamed in pieces", 18));
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_TEXT);
+	assert(wss_frame_payload_length(frame) == 18);
+	assert(!wss_frame_payload(frame));
+	streamed_len = 0;
+	streamed_final = 0;
+
+	/* Control frames are still buffered */
+	write_raw_frame(fds[1], WS_OPCODE_PING, 1, "ping", 4);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PING);
+	assert(!strcmp(wss_frame_payload(frame), "ping"));
+	wss_frame_destroy(frame);
+	assert(streamed_len == 0);
+
+	/* Streaming writer, with a control frame in between fragments */
+	wss_set_stream_callback(client, NULL);
+	assert(!wss_write_begin(server, WS_OPCODE_TEXT));
+	assert(!wss_write_chunk(server, "written ", 8));
+	assert(wss_write(server, WS_OPCODE_TEXT, "no", 2) < 0); /* Can't interleave data messages */
+	msgs[0].opcode = WS_OPCODE_PING;
+	msgs[0].payload = NULL;
+	msgs[0].len = 0;
+	msgs[1].opcode = WS_OPCODE_BINARY;
+	msgs[1].payload = "no";
+	msgs[1].len = 2;
+	assert(wss_write_batch(server, msgs, 2) < 0); /* Not even in a batch, and nothing in it is sent */
+	assert(!wss_write(server, WS_OPCODE_PONG, NULL, 0));
+	assert(!wss_write_chunk(server, "in ", 3));
+	assert(!wss_write_end(server, "pieces", 6));
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PONG);
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!strcmp(wss_frame_payload(frame), "written in pieces"));
+	wss_frame_destroy(frame);
+
+	/* Automatic fragmentation */
+	wss_set_max_fragment_size(server, 4);
+	assert(!wss_write(server, WS_OPCODE_BINARY, "auto fragmented", 15));
+	for (i = 0; i < 4; i++) {
+		unsigned char header[2];
+		assert(read(fds[0], header, 2) == 2);
+		assert((header[0] & 0x0f) == (i ? WS_OPCODE_CONTINUE : WS_OPCODE_BINARY));
+		assert(!(header[0] & 0x80) == (i < 3));
+		assert(header[1] == (i < 3 ? 4 : 3));
+		assert(read(fds[0], streamed, header[1]) == header[1]);
+	}
+
+	/* CONTINUE frame without a message in progress */
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 1, "oops", 4);
+	assert(wss_read(client, 250, 0) < 0);
+	assert(wss_error_code(client) == WS_CLOSE_PROTOCOL_ERROR);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+/*! \brief A trivial "compression" scheme, which reverses the payload */
+static int reverse_payload(const char *in, size_t inlen, char **out, size_t *outlen)
+{
+	size_t i;
+	*out = malloc(inlen + 1);
+	assert(*out != NULL);
+	for (i = 0; i < inlen; i++) {
+		(*out)[i] = in[inlen - i - 1];
+	}
+	*outlen = inlen;
+	return 0;
+}
+
+static int reverse_compress(void *ctx, const char *in, size_t inlen, char **out, size_t *outlen)
+{
+	(void) ctx;
+	return reverse_payload(in, inlen, out, outlen);
+}
+
+static int reverse_decompress(void *ctx, const char *in, size_t inlen, char **out, size_t *outlen, size_t maxlen)
+{
+	(void) ctx;
+	if (inlen > maxlen) {
+		return 1;
+	}
+	return reverse_payload(in, inlen, out, outlen);
+}
+
+static const struct wss_compression_ops reverse_ops = {
+	.compress = reverse_compress,
+	.decompress = reverse_decompress,
+};
+
+static int test_compression(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	struct wss_deflate_params local, agreed;
+	char buf[256];
+	unsigned char header[2];
+	int fds[2];
+
+	/* Negotiation */
+	assert(wss_deflate_negotiate("x-webkit-deflate-frame, permessage-deflate; client_max_window_bits", NULL, &agreed, buf, sizeof(buf)) == 1);
+	assert(!strcmp(buf, "permessage-deflate"));
+	assert(agreed.server_max_window_bits == 15 && agreed.client_max_window_bits == 15);
+	memset(&local, 0, sizeof(local));
+	local.server_no_context_takeover = 1;
+	local.client_max_window_bits = 10;
+	assert(wss_deflate_negotiate("permessage-deflate; server_max_window_bits=12; client_max_window_bits", &local, &agreed, buf, sizeof(buf)) == 1);
+	assert(!strcmp(buf, "permessage-deflate; server_no_context_takeover; server_max_window_bits=12; client_max_window_bits=10"));
+	assert(agreed.server_no_context_takeover && !agreed.client_no_context_takeover);
+	/* Invalid or unacceptable offers are skipped */
+	assert(wss_deflate_negotiate("permessage-deflate; foo, permessage-deflate; server_max_window_bits=8", NULL, &agreed, buf, sizeof(buf)) == 0);
+	assert(wss_deflate_negotiate("permessage-deflate; server_no_context_takeover; server_no_context_takeover", NULL, &agreed, buf, sizeof(buf)) == 0);
+	assert(wss_deflate_negotiate("permessage-deflate; client_max_window_bits=\"9\"", NULL, &agreed, buf, sizeof(buf)) == 1);
+	assert(!strcmp(buf, "permessage-deflate; client_max_window_bits=9"));
+	assert(wss_deflate_offer(NULL, buf, sizeof(buf)) > 0);
+	assert(!strcmp(buf, "permessage-deflate; client_max_window_bits"));
+	assert(!wss_deflate_accept("permessage-deflate; client_no_context_takeover; server_max_window_bits=10", &agreed));
+	assert(agreed.client_no_context_takeover && agreed.server_max_window_bits == 10 && agreed.client_max_window_bits == 15);
+	assert(wss_deflate_accept("permessage-deflate; client_max_window_bits", &agreed) < 0);
+
+	assert(!pipe(fds));
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	server = wss_client_new(NULL, fds[0], fds[1]);
+	assert(server != NULL);
+
+	/* Compressed messages, including fragmented ones */
+	wss_set_compression(client, &reverse_ops, NULL);
+	write_raw_frame(fds[1], WS_OPCODE_TEXT | 0x40, 1, "olleh", 5);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!strcmp(wss_frame_payload(frame), "hello"));
+	wss_frame_destroy(frame);
+	write_raw_frame(fds[1], WS_OPCODE_TEXT | 0x40, 0, "dlrow ", 6);
+	write_raw_frame(fds[1], WS_OPCODE_CONTINUE, 1, "olleh", 5);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_payload_length(frame) == 11);
+	assert(!strcmp(wss_frame_payload(frame), "hello world"));
+	wss_frame_destroy(frame);
+
+	/* Sending compressed messages sets RSV1 on the first frame only */
+	wss_set_compression(server, &reverse_ops, NULL);
+	wss_set_max_fragment_size(server, 3);
+	assert(!wss_write(server, WS_OPCODE_TEXT, "abcdef", 6));
+	assert(read(fds[0], header, 2) == 2);
+	assert(header[0] == (0x40 | WS_OPCODE_TEXT) && header[1] == 3);
+	assert(read(fds[0], buf, 3) == 3 && !memcmp(buf, "fed", 3));
+	assert(read(fds[0], header, 2) == 2);
+	assert(header[0] == (0x80 | WS_OPCODE_CONTINUE) && header[1] == 3);
+	assert(read(fds[0], buf, 3) == 3 && !memcmp(buf, "cba", 3));
+	/* Control frames are never compressed */
+	assert(!wss_write(server, WS_OPCODE_PING, "ping", 4));
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!strcmp(wss_frame_payload(frame), "ping"));
+	wss_frame_destroy(frame);
+
+	/* RSV1 on a control frame is invalid */
+	write_raw_frame(fds[1], WS_OPCODE_PING | 0x40, 1, "", 0);
+	assert(wss_read(client, 250, 0) < 0);
+	assert(wss_error_code(client) == WS_CLOSE_PROTOCOL_ERROR);
+
+	/* RSV1 is a protocol error unless compression was negotiated */
+	wss_set_compression(client, NULL, NULL);
+	write_raw_frame(fds[1], WS_OPCODE_TEXT | 0x40, 1, "", 0);
+	assert(wss_read(client, 250, 0) < 0);
+	assert(wss_error_code(client) == WS_CLOSE_PROTOCOL_ERROR);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static int test_utf8(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	char buf[300];
+	int fds[2];
+	size_t i;
+
+	assert(wss_utf8_valid("", 0));
+	assert(wss_utf8_valid("plain ASCII", 11));
+	assert(wss_utf8_valid("\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5", 11));
+	assert(wss_utf8_valid("\xf0\x9f\x98\x80 \xf4\x8f\xbf\xbf \xed\x9f\xbf", 13));
+	assert(!wss_utf8_valid("\xc0\x80", 2)); /* Overlong */
+	assert(!wss_utf8_valid("\xe0\x80\xaf", 3)); /* Overlong */
+	assert(!wss_utf8_valid("\xed\xa0\x80", 3)); /* Surrogate */
+	assert(!wss_utf8_valid("\xf4\x90\x80\x80", 4)); /* Above U+10FFFF */
+	assert(!wss_utf8_valid("\xce", 1)); /* Truncated */
+	assert(!wss_utf8_valid("\x80", 1));
+	assert(!wss_utf8_valid("\xff", 1));
+	/* Invalid bytes at every position in a long buffer, to exercise the vectorized paths */
+	memset(buf, 'a', sizeof(buf));
+	assert(wss_utf8_valid(buf, sizeof(buf)));
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = (char) 0xff;
+		assert(!wss_utf8_valid(buf, sizeof(buf)));
+		buf[i] = 'a';
+	}
+	for (i = 0; i + 2 <= sizeof(buf); i++) {
+		memcpy(buf + i, "\xc3\xa9", 2);
+		assert(wss_utf8_valid(buf, sizeof(buf)));
+		memset(buf + i, 'a', 2);
+	}
+
+	assert(!pipe(fds));
+	server = wss_client_new(NULL, fds[0], fds[1]);
+	assert(server != NULL);
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	wss_set_utf8_validation(server, 1);
+
+	/* Characters split across fragments are fine (the payloads are masked, so validation is fused with unmasking) */
+	memset(buf, 'a', sizeof(buf));
+	memcpy(buf + 99, "\xe2\x82\xac", 3);
+	wss_set_max_fragment_size(client, 100);
+	assert(!wss_write(client, WS_OPCODE_TEXT, buf, 150));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload_length(frame) == 150);
+	assert(!memcmp(wss_frame_payload(frame), buf, 150));
+	wss_frame_destroy(frame);
+
+	/* BINARY messages aren't validated */
+	assert(!wss_write(client, WS_OPCODE_BINARY, "\xff", 1));
+	assert(wss_read(server, 250, 0) == 1);
+	wss_frame_destroy(wss_client_frame(server));
+
+	/* Message ending in the middle of a character */
+	assert(!wss_write(client, WS_OPCODE_TEXT, buf, 100));
+	assert(wss_read(server, 250, 0) < 0);
+	assert(wss_error_code(server) == WS_CLOSE_DATA_INCONSISTENT);
+	wss_frame_destroy(wss_client_frame(server));
+
+	/* Invalid sequence */
+	buf[20] = (char) 0xc0;
+	assert(!wss_write(client, WS_OPCODE_TEXT, buf, 50));
+	assert(wss_read(server, 250, 0) < 0);
+	assert(wss_error_code(server) == WS_CLOSE_DATA_INCONSISTENT);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static char dest_a[5000], dest_b[20000];
+static struct iovec dest_iov[2];
+
+static int dest_cb(void *data, int opcode, unsigned long offset, unsigned long len, const struct iovec **iov, int *iovcnt)
+{
+	(void) data;
+	assert(opcode == WS_OPCODE_BINARY);
+	if (offset + len > sizeof(dest_a) + sizeof(dest_b)) {
+		*iovcnt = 0; /* Too large */
+		return 0;
+	}
+	/* Scatter the message across two buffers */
+	if (offset < sizeof(dest_a)) {
+		dest_iov[0].iov_base = dest_a + offset;
+		dest_iov[0].iov_len = sizeof(dest_a) - offset;
+		dest_iov[1].iov_base = dest_b;
+		dest_iov[1].iov_len = sizeof(dest_b);
+		*iov = dest_iov;
+		*iovcnt = 2;
+	} else {
+		dest_iov[1].iov_base = dest_b + offset - sizeof(dest_a);
+		dest_iov[1].iov_len = sizeof(dest_b) - (offset - sizeof(dest_a));
+		*iov = &dest_iov[1];
+		*iovcnt = 1;
+	}
+	return 0;
+}
+
+static int test_destination(int buffered)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	char *payload;
+	int fds[2];
+	int i;
+
+	assert(!pipe(fds));
+	server = wss_client_new(NULL, fds[0], fds[1]);
+	assert(server != NULL);
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	if (buffered) {
+		assert(!wss_set_read_buffer(server, 4096));
+	}
+	wss_set_payload_destination(server, dest_cb);
+
+	payload = malloc(25001);
+	assert(payload != NULL);
+	for (i = 0; i < 25001; i++) {
+		payload[i] = (char) (i % 251);
+	}
+	/* Masked, and fragmented, so that frames start in the middle of each buffer */
+	wss_set_max_fragment_size(client, 7000);
+	assert(!wss_write(client, WS_OPCODE_BINARY, payload, 25000));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_BINARY);
+	assert(wss_frame_payload_length(frame) == 25000);
+	assert(!wss_frame_payload(frame));
+	assert(!memcmp(dest_a, payload, sizeof(dest_a)));
+	assert(!memcmp(dest_b, payload + sizeof(dest_a), sizeof(dest_b)));
+
+	/* Control frames are still buffered */
+	assert(!wss_write(client, WS_OPCODE_PING, "ping", 4));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(!strcmp(wss_frame_payload(frame), "ping"));
+	wss_frame_destroy(frame);
+
+	/* Not enough room */
+	wss_set_max_fragment_size(client, 0);
+	assert(!wss_write(client, WS_OPCODE_BINARY, payload, 25001));
+	assert(wss_read(server, 250, 0) < 0);
+	assert(wss_error_code(server) == WS_CLOSE_LARGE_PAYLOAD);
+
+	free(payload);
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static int test_inplace(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	struct custom cb;
+	char *payload, *expected;
+	int fds[2];
+	int i;
+
+	assert(!pipe(fds));
+	cb.rfd = fds[0];
+	cb.wfd = fds[1];
+	server = wss_client_new(NULL, fds[0], fds[1]);
+	assert(server != NULL);
+	client = wss_client_new(&cb, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	wss_set_writev_callback(client, writev_cb);
+
+	payload = malloc(50000);
+	expected = malloc(50000);
+	assert(payload && expected);
+	for (i = 0; i < 50000; i++) {
+		expected[i] = (char) (i % 253);
+	}
+
+	/* Default: masked through an 8 KB staging buffer */
+	for (i = 0; i < 2; i++) {
+		if (i) {
+			/* Larger staging buffer */
+			assert(!wss_set_mask_chunk_size(client, 32768));
+		}
+		writes = 0;
+		assert(!wss_write(client, WS_OPCODE_BINARY, expected, 50000));
+		assert(writes == (i ? 2 : 7));
+		assert(wss_read(server, 250, 0) == 1);
+		frame = wss_client_frame(server);
+		assert(wss_frame_payload_length(frame) == 50000);
+		assert(!memcmp(wss_frame_payload(frame), expected, 50000));
+		wss_frame_destroy(frame);
+	}
+
+	/* In place: a single write */
+	memcpy(payload, expected, 50000);
+	writes = 0;
+	assert(!wss_write_inplace(client, WS_OPCODE_BINARY, payload, 50000));
+	assert(writes == 1);
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(!memcmp(wss_frame_payload(frame), expected, 50000));
+	wss_frame_destroy(frame);
+
+	free(payload);
+	free(expected);
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static ssize_t fail_write_cb(void *data, const char *buf, size_t len)
+{
+	(void) data;
+	(void) buf;
+	(void) len;
+	errno = EIO;
+	return -1;
+}
+
+static int test_stats(void)
+{
+	struct wss_client *server, *client;
+	struct wss_stats stats, global;
+	struct wss_msg msgs[2];
+	char payload[1000];
+	int fds[2];
+
+	assert(!pipe(fds));
+	server = wss_client_new(NULL, fds[0], fds[1]);
+	assert(server != NULL);
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	memset(payload, 'x', sizeof(payload));
+
+	/* Disabled by default */
+	assert(wss_client_stats(server, &stats) == -1);
+	assert(!wss_enable_stats(server, 1));
+	assert(!wss_enable_stats(client, 1));
+
+	assert(!wss_write(client, WS_OPCODE_TEXT, "hello", 5));
+	assert(!wss_write(client, WS_OPCODE_BINARY, payload, sizeof(payload)));
+	assert(wss_read(server, 250, 0) == 1);
+	wss_frame_destroy(wss_client_frame(server));
+	assert(wss_read(server, 250, 0) == 1);
+	wss_frame_destroy(wss_client_frame(server));
+
+	assert(!wss_client_stats(client, &stats));
+	assert(stats.frames_out[WS_OPCODE_TEXT] == 1);
+	assert(stats.frames_out[WS_OPCODE_BINARY] == 1);
+	assert(stats.bytes_out[WS_OPCODE_BINARY] == sizeof(payload));
+	assert(stats.bytes_masked == 5 + sizeof(payload));
+	assert(stats.writes == 2);
+	assert(stats.reads == 0);
+
+	assert(!wss_client_stats(server, &stats));
+	assert(stats.frames_in[WS_OPCODE_TEXT] == 1);
+	assert(stats.frames_in[WS_OPCODE_BINARY] == 1);
+	assert(stats.bytes_in[WS_OPCODE_TEXT] == 5);
+	assert(stats.bytes_in[WS_OPCODE_BINARY] == sizeof(payload));
+	assert(stats.bytes_masked == 5 + sizeof(payload));
+	assert(stats.reads > 0);
+	assert(stats.polls > 0);
+	assert(stats.frames_out[WS_OPCODE_TEXT] == 0);
+
+	/* Frames in a batch are only counted once they're written */
+	msgs[0].opcode = WS_OPCODE_TEXT;
+	msgs[0].payload = "lost";
+	msgs[0].len = 4;
+	msgs[1].opcode = WS_OPCODE_CLOSE;
+	msgs[1].payload = NULL;
+	msgs[1].len = 0;
+	wss_set_io_callbacks(server, NULL, fail_write_cb);
+	assert(wss_write_batch(server, msgs, 2) < 0);
+	assert(!wss_client_stats(server, &stats));
+	assert(stats.frames_out[WS_OPCODE_TEXT] == 0);
+	assert(stats.frames_out[WS_OPCODE_CLOSE] == 0);
+	wss_set_io_callbacks(server, NULL, NULL);
+
+	/* ... and since the CLOSE never went out, the peer's CLOSE is still echoed */
+	wss_set_auto_control(server, 1);
+	assert(!wss_write(client, WS_OPCODE_CLOSE, NULL, 0));
+	assert(wss_read(server, 250, 0) == 1);
+	wss_frame_destroy(wss_client_frame(server));
+	assert(!wss_client_stats(server, &stats));
+	assert(stats.frames_out[WS_OPCODE_CLOSE] == 1);
+	assert(read(fds[0], payload, 2) == 2); /* Discard the echo */
+
+	wss_global_stats(&global);
+	assert(global.frames_in[WS_OPCODE_BINARY] >= 1);
+	assert(global.frames_out[WS_OPCODE_BINARY] >= 1);
+	assert(global.bytes_masked >= 2 * (5 + sizeof(payload)));
+
+	/* Disabling stops counting, but global totals are retained */
+	assert(!wss_enable_stats(server, 0));
+	assert(wss_client_stats(server, &stats) == -1);
+	wss_global_stats(&stats);
+	assert(stats.bytes_masked == global.bytes_masked);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static int test_control(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	int c2s[2], s2c[2], fds[2];
+	char *large, *buf;
+	size_t total, binary;
+	ssize_t res;
+
+	assert(!pipe(c2s));
+	assert(!pipe(s2c));
+	server = wss_client_new(NULL, c2s[0], s2c[1]);
+	assert(server != NULL);
+	client = wss_client_new(NULL, s2c[0], c2s[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	assert(!wss_set_read_buffer(server, 4096));
+	wss_set_auto_control(server, 1);
+	assert(wss_rtt(client) == 0);
+
+	/* PINGs are answered, and not returned */
+	assert(!wss_write(client, WS_OPCODE_PING, "a", 1));
+	assert(!wss_write(client, WS_OPCODE_PING, "b", 1));
+	assert(!wss_write(client, WS_OPCODE_TEXT, "data", 4));
+	usleep(2000);
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_TEXT);
+	assert(!strcmp(wss_frame_payload(frame), "data"));
+	wss_frame_destroy(frame);
+
+	/* Both were already received, so only the last one was answered */
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PONG);
+	assert(wss_frame_payload_length(frame) == 1 && wss_frame_payload(frame)[0] == 'b');
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 0, 0) == 0);
+	assert(wss_rtt(client) >= 2000);
+
+	/* In the middle of a fragmented message */
+	assert(!wss_write_begin(client, WS_OPCODE_TEXT));
+	assert(!wss_write_chunk(client, "frag", 4));
+	assert(!wss_write(client, WS_OPCODE_PING, "c", 1));
+	assert(!wss_write_end(client, "ment", 4));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(!strcmp(wss_frame_payload(frame), "fragment"));
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PONG && wss_frame_payload(frame)[0] == 'c');
+	wss_frame_destroy(frame);
+
+	/* CLOSE is echoed, but still returned */
+	assert(!wss_close(client, WS_CLOSE_NORMAL));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_close_code(frame) == WS_CLOSE_NORMAL);
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_close_code(frame) == WS_CLOSE_NORMAL);
+	wss_frame_destroy(frame);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(c2s[0]);
+	close(c2s[1]);
+	close(s2c[0]);
+	close(s2c[1]);
+
+	/* PONGs go out ahead of queued data */
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	assert(!fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK));
+	assert(!fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK));
+	server = wss_client_new(NULL, fds[0], fds[0]);
+	assert(server != NULL);
+	wss_set_nonblocking(server, 1);
+	wss_set_auto_control(server, 1);
+	large = calloc(1, 1024 * 1024);
+	buf = malloc(2 * 1024 * 1024);
+	assert(large && buf);
+
+	assert(!wss_write(server, WS_OPCODE_BINARY, large, 1024 * 1024));
+	assert(wss_want_write(server));
+	assert(!wss_write(server, WS_OPCODE_BINARY, large, 1000));
+	client = wss_client_new(NULL, fds[1], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	assert(!wss_write(client, WS_OPCODE_PING, "ping", 4));
+	assert(wss_read(server, 0, 1) == 0);
+	total = 0;
+	do {
+		res = read(fds[1], buf + total, 2 * 1024 * 1024 - total);
+		if (res > 0) {
+			total += (size_t) res;
+		} else {
+			assert(errno == EAGAIN);
+		}
+	} while (wss_flush(server) || res > 0);
+	binary = 10 + 1024 * 1024;
+	assert(total == binary + 2 + 4 + 4 + 1000);
+	assert((unsigned char) buf[binary] == 0x8a); /* FIN + PONG */
+	assert(!memcmp(buf + binary + 2, "ping", 4));
+	assert((unsigned char) buf[binary + 6] == 0x82); /* Then the rest of the data */
+	free(large);
+	free(buf);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+#define QUEUE_THREADS 4
+#define QUEUE_MESSAGES 2000
+
+static void *queue_producer(void *varg)
+{
+	struct wss_client *server = varg;
+	static int next_id = 0;
+	int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+	char buf[2][32];
+	struct wss_msg msgs[2];
+	int i;
+
+	for (i = 0; i < QUEUE_MESSAGES; i++) {
+		int len = snprintf(buf[i % 2], sizeof(buf[0]), "%d %d", id, i);
+		if (id % 2 == 0) {
+			assert(!wss_write(server, WS_OPCODE_TEXT, buf[i % 2], (size_t) len));
+			continue;
+		}
+		/* Odd threads send pairs of messages in batches */
+		msgs[i % 2].opcode = WS_OPCODE_TEXT;
+		msgs[i % 2].payload = buf[i % 2];
+		msgs[i % 2].len = (size_t) len;
+		if (i % 2) {
+			assert(wss_write_batch(server, msgs, 2) == 2);
+		}
+	}
+	return NULL;
+}
+
+static int notified = 0;
+
+static void notify_cb(void *data)
+{
+	(void) data;
+	notified++;
+}
+
+static int test_send_queue(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	pthread_t threads[QUEUE_THREADS];
+	int last[QUEUE_THREADS];
+	struct wss_msg msgs[2];
+	int fds[2];
+	int i;
+
+	assert(!pipe(fds));
+	server = wss_client_new(NULL, fds[0], fds[1]);
+	assert(server != NULL);
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+
+	/* Many writers, no locking */
+	wss_set_send_queue(server, 1, NULL);
+	for (i = 0; i < QUEUE_THREADS; i++) {
+		last[i] = -1;
+		assert(!pthread_create(&threads[i], NULL, queue_producer, server));
+	}
+	for (i = 0; i < QUEUE_THREADS * QUEUE_MESSAGES; i++) {
+		int id, seq;
+		assert(wss_read(client, 1000, 0) == 1);
+		frame = wss_client_frame(client);
+		assert(sscanf(wss_frame_payload(frame), "%d %d", &id, &seq) == 2);
+		assert(id >= 0 && id < QUEUE_THREADS);
+		assert(seq == last[id] + 1); /* Each thread's messages stay in order */
+		last[id] = seq;
+		wss_frame_destroy(frame);
+	}
+	for (i = 0; i < QUEUE_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	assert(wss_read(client, 0, 0) == 0);
+
+	/* With a dedicated drainer, writes just queue */
+	wss_set_send_queue(server, 1, notify_cb);
+	assert(!wss_write(server, WS_OPCODE_TEXT, "first", 5));
+	assert(!wss_write(server, WS_OPCODE_PONG, "pong", 4));
+	assert(notified == 1);
+	assert(wss_read(client, 0, 0) == 0);
+	assert(!wss_drain(server));
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PONG); /* PONGs jump the queue */
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!strcmp(wss_frame_payload(frame), "first"));
+	wss_frame_destroy(frame);
+
+	/* Batches are queued too, and fragmented messages can't bypass the queue */
+	msgs[0].opcode = WS_OPCODE_TEXT;
+	msgs[0].payload = "second";
+	msgs[0].len = 6;
+	msgs[1].opcode = WS_OPCODE_BINARY;
+	msgs[1].payload = "third";
+	msgs[1].len = 5;
+	assert(wss_write_batch(server, msgs, 2) == 2);
+	assert(notified == 2);
+	assert(wss_read(client, 0, 0) == 0);
+	assert(wss_write_begin(server, WS_OPCODE_TEXT) < 0);
+	assert(!wss_drain(server));
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!strcmp(wss_frame_payload(frame), "second"));
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!memcmp(wss_frame_payload(frame), "third", 5));
+	wss_frame_destroy(frame);
+
+	/* Left in the queue when destroyed */
+	assert(!wss_write(server, WS_OPCODE_TEXT, "never sent", 10));
+	assert(notified == 3);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+/*! \brief Control frames sent from the send queue are tracked like any others */
+static int test_send_queue_control(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	int c2s[2], s2c[2];
+
+	assert(!pipe(c2s));
+	assert(!pipe(s2c));
+	server = wss_client_new(NULL, c2s[0], s2c[1]);
+	assert(server != NULL);
+	client = wss_client_new(NULL, s2c[0], c2s[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	wss_set_send_queue(server, 1, NULL);
+	wss_set_auto_control(server, 1);
+
+	/* Round trip time is measured */
+	assert(!wss_write(server, WS_OPCODE_PING, "rtt", 3));
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PING);
+	wss_frame_destroy(frame);
+	usleep(2000);
+	assert(!wss_write(client, WS_OPCODE_PONG, "rtt", 3));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PONG);
+	wss_frame_destroy(frame);
+	assert(wss_rtt(server) >= 2000);
+
+	/* Having sent a CLOSE, the CLOSE in reply isn't answered with another */
+	assert(!wss_close(server, WS_CLOSE_NORMAL));
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_CLOSE);
+	wss_frame_destroy(frame);
+	assert(!wss_close(client, WS_CLOSE_NORMAL));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_CLOSE);
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 0, 0) == 0);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(c2s[0]);
+	close(c2s[1]);
+	close(s2c[0]);
+	close(s2c[1]);
+	return 0;
+}
+
+static int above_calls = 0, below_calls = 0;
+
+static void watermark_cb(void *data, int above)
+{
+	(void) data;
+	if (above) {
+		above_calls++;
+	} else {
+		below_calls++;
+	}
+}
+
+/*! \brief Flush everything queued by the server and read it. Returns the number of messages, which start with their index. */
+static int read_queued(struct wss_client *server, struct wss_client *reader, int *ids, int max, int *closecode)
+{
+	int n = 0, idle = 0;
+
+	*closecode = 0;
+	while (idle < 100 && !*closecode) {
+		int res = wss_flush(server);
+		assert(res >= 0);
+		res = wss_read(reader, 0, 1);
+		assert(res >= 0);
+		if (res == 1) {
+			struct wss_frame *frame = wss_client_frame(reader);
+			if (wss_frame_opcode(frame) == WS_OPCODE_CLOSE) {
+				*closecode = wss_close_code(frame);
+			} else {
+				assert(n < max);
+				ids[n++] = (unsigned char) wss_frame_payload(frame)[0];
+			}
+			wss_frame_destroy(frame);
+			idle = 0;
+		} else if (!wss_want_write(server)) {
+			idle++;
+		}
+	}
+	return n;
+}
+
+static int test_backpressure(void)
+{
+	struct wss_client *server, *reader;
+	char *payload;
+	int fds[2], ids[64];
+	int i, n, closecode, res;
+
+	payload = malloc(30000);
+	assert(payload != NULL);
+	memset(payload, 'x', 30000);
+
+	for (i = 0; i < 4; i++) {
+		int policy = i ? (i == 2 ? WS_BACKPRESSURE_CLOSE : WS_BACKPRESSURE_DROP) : WS_BACKPRESSURE_NONE;
+		int j;
+
+		assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+		assert(!fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK));
+		assert(!fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK));
+		server = wss_client_new(NULL, fds[0], fds[0]);
+		assert(server != NULL);
+		wss_set_nonblocking(server, 1);
+		reader = wss_client_new(NULL, fds[1], fds[1]);
+		assert(reader != NULL);
+		wss_set_client_type(reader, WS_CLIENT);
+		wss_set_nonblocking(reader, 1);
+		assert(wss_set_watermarks(server, 100, 200, policy, NULL) == -1); /* Low above high */
+		assert(!wss_set_watermarks(server, 100000, 20000, policy, watermark_cb));
+		if (i == 3) {
+			wss_set_send_queue(server, 1, notify_cb); /* Only drained at the end */
+		}
+
+		above_calls = below_calls = 0;
+		res = 0;
+		for (j = 0; j < 40 && !res; j++) {
+			payload[0] = (char) j;
+			res = wss_write(server, WS_OPCODE_BINARY, payload, 30000);
+			if (i == 3) {
+				assert(wss_outbound_bytes(server) == (size_t) (j + 1) * 30000);
+			} else if (i == 1) {
+				assert(wss_outbound_bytes(server) <= 100000);
+			}
+		}
+		assert(above_calls == 1);
+		assert(wss_backpressure(server) == 1 || i == 2);
+		if (i == 3) {
+			assert(!wss_drain(server));
+			assert(wss_outbound_bytes(server) <= 100000);
+		}
+		if (i == 2) {
+			assert(res == -1); /* Closed, once the high watermark was exceeded */
+			assert(wss_error_code(server) == WS_CLOSE_POLICY_VIOLATION);
+		} else {
+			assert(res == 0);
+		}
+
+		n = read_queued(server, reader, ids, 64, &closecode);
+		if (i == 0) {
+			assert(n == 40); /* Nothing dropped */
+			assert(!closecode);
+			assert(below_calls == 1);
+			assert(!wss_backpressure(server));
+		} else if (i == 2) {
+			assert(n < 40);
+			assert(closecode == WS_CLOSE_POLICY_VIOLATION);
+		} else {
+			/* The oldest were dropped */
+			assert(n < 40);
+			assert(ids[n - 1] == 39);
+			assert(!closecode);
+			assert(!wss_backpressure(server));
+		}
+		for (j = 1; j < n; j++) {
+			assert(ids[j] > ids[j - 1]);
+		}
+
+		wss_client_destroy(server);
+		wss_client_destroy(reader);
+		close(fds[0]);
+		close(fds[1]);
+	}
+	free(payload);
+	return 0;
+}
+
+/*! \brief Overflowing while a masked frame is only partly queued finishes the frame before closing */
+static int test_backpressure_midframe(void)
+{
+	struct wss_client *client, *reader;
+	char *payload;
+	int fds[2], ids[65536];
+	int n, filled = 0, closecode;
+
+	payload = malloc(20000);
+	assert(payload != NULL);
+	memset(payload, 'x', 20000);
+	payload[0] = 1;
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	assert(!fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK));
+	assert(!fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK));
+	client = wss_client_new(NULL, fds[0], fds[0]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT); /* Masked in chunks */
+	wss_set_nonblocking(client, 1);
+	reader = wss_client_new(NULL, fds[1], fds[1]);
+	assert(reader != NULL);
+	wss_set_nonblocking(reader, 1);
+	assert(!wss_set_watermarks(client, 1000, 100, WS_BACKPRESSURE_CLOSE, NULL));
+
+	/* Fill the socket with small (masked) frames */
+	for (;;) {
+		ssize_t res = write(fds[0], "\x82\x81\0\0\0\0\xff", 7);
+		if (res < 0) {
+			assert(errno == EAGAIN);
+			break;
+		}
+		assert(res == 7);
+		filled++;
+	}
+	assert(filled < 65536);
+
+	assert(!wss_write(client, WS_OPCODE_BINARY, payload, 20000));
+	assert(wss_outbound_bytes(client) > 20000); /* The whole frame, and the CLOSE */
+	assert(wss_write(client, WS_OPCODE_TEXT, "late", 4) == -1);
+	assert(wss_error_code(client) == WS_CLOSE_POLICY_VIOLATION);
+
+	n = read_queued(client, reader, ids, 65536, &closecode);
+	assert(n == filled + 1);
+	assert(ids[n - 1] == 1);
+	assert(closecode == WS_CLOSE_POLICY_VIOLATION);
+
+	wss_client_destroy(client);
+	wss_client_destroy(reader);
+	close(fds[0]);
+	close(fds[1]);
+	free(payload);
+	return 0;
+}
+
+static void *raw_reader(void *varg)
+{
+	int *fd = varg;
+	char buf[65536];
+	size_t total = 0;
+
+	while (total < 40 * (30000 + 4)) {
+		struct pollfd pfd = { .fd = *fd, .events = POLLIN };
+		ssize_t res;
+		assert(poll(&pfd, 1, 1000) == 1);
+		res = read(*fd, buf, sizeof(buf));
+		assert(res > 0 || (res < 0 && errno == EAGAIN));
+		if (res > 0) {
+			total += (size_t) res;
+		}
+		usleep(100); /* Be a slow consumer */
+	}
+	return NULL;
+}
+
+static int test_backpressure_block(void)
+{
+	struct wss_client *server;
+	pthread_t thread;
+	char *payload;
+	int fds[2];
+	int i;
+
+	payload = calloc(1, 30000);
+	assert(payload != NULL);
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	assert(!fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK));
+	assert(!fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK));
+	server = wss_client_new(NULL, fds[0], fds[0]);
+	assert(server != NULL);
+	wss_set_nonblocking(server, 1);
+	assert(!wss_set_watermarks(server, 100000, 20000, WS_BACKPRESSURE_BLOCK, NULL));
+
+	assert(!pthread_create(&thread, NULL, raw_reader, &fds[1]));
+	for (i = 0; i < 40; i++) {
+		assert(!wss_write(server, WS_OPCODE_BINARY, payload, 30000));
+		assert(wss_outbound_bytes(server) <= 100000); /* Waited for it to drain instead */
+	}
+	while (wss_flush(server)) {
+		usleep(1000);
+	}
+	pthread_join(thread, NULL);
+
+	wss_client_destroy(server);
+	close(fds[0]);
+	close(fds[1]);
+	free(payload);
+	return 0;
+}
+
+/*! \brief Simulated TLS layer, which reads everything available into its own buffer */
+struct tls {
+	int fd;
+	char buf[4096];
+	size_t len;
+};
+
+static ssize_t tls_read(void *data, char *buf, size_t len)
+{
+	struct tls *tls = data;
+	if (!tls->len) {
+		ssize_t res = read(tls->fd, tls->buf, sizeof(tls->buf));
+		if (res <= 0) {
+			return res;
+		}
+		tls->len = (size_t) res;
+	}
+	len = len > tls->len ? tls->len : len;
+	memcpy(buf, tls->buf, len);
+	memmove(tls->buf, tls->buf + len, tls->len - len);
+	tls->len -= len;
+	return (ssize_t) len;
+}
+
+static ssize_t tls_write(void *data, const char *buf, size_t len)
+{
+	struct tls *tls = data;
+	return write(tls->fd, buf, len);
+}
+
+static size_t tls_pending(void *data)
+{
+	struct tls *tls = data;
+	return tls->len;
+}
+
+#define SET_CLIENTS 50
+
+static int test_clientset(void)
+{
+	struct wss_clientset *set;
+	struct wss_client *servers[SET_CLIENTS], *clients[SET_CLIENTS];
+	struct wss_ready ready[SET_CLIENTS];
+	struct tls tls;
+	int fds[SET_CLIENTS][2];
+	int i, n;
+
+	set = wss_clientset_new();
+	assert(set != NULL);
+	for (i = 0; i < SET_CLIENTS; i++) {
+		assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+		assert(!fcntl(fds[i][0], F_SETFL, fcntl(fds[i][0], F_GETFL) | O_NONBLOCK));
+		servers[i] = wss_client_new(i ? NULL : &tls, fds[i][0], fds[i][0]);
+		clients[i] = wss_client_new(NULL, fds[i][1], fds[i][1]);
+		assert(servers[i] && clients[i]);
+		wss_set_client_type(clients[i], WS_CLIENT);
+		if (!i) {
+			assert(wss_clientset_add(set, servers[i]) == -1); /* Must be non-blocking */
+			tls.fd = fds[i][0];
+			tls.len = 0;
+			wss_set_io_callbacks(servers[i], tls_read, tls_write);
+			wss_set_pending_callback(servers[i], tls_pending);
+		} else if (i % 2) {
+			assert(!wss_set_read_buffer(servers[i], 4096));
+		}
+		wss_set_nonblocking(servers[i], 1);
+		assert(!wss_clientset_add(set, servers[i]));
+	}
+	assert(wss_clientset_add(set, servers[0]) == -1); /* Already added */
+	assert(wss_clientset_count(set) == SET_CLIENTS);
+	assert(wss_poll(set, ready, SET_CLIENTS, 0) == 0);
+
+	/* Only the ones with frames */
+	assert(!wss_write(clients[3], WS_OPCODE_TEXT, "three", 5));
+	assert(!wss_write(clients[18], WS_OPCODE_TEXT, "eighteen", 8));
+	assert(!wss_write(clients[42], WS_OPCODE_TEXT, "forty-two", 9));
+	n = wss_poll(set, ready, SET_CLIENTS, 1000);
+	assert(n == 3);
+	for (i = 0; i < n; i++) {
+		struct wss_frame *frame = wss_client_frame(ready[i].client);
+		assert(ready[i].res == 1);
+		assert(ready[i].client == servers[3] || ready[i].client == servers[18] || ready[i].client == servers[42]);
+		assert(!strcmp(wss_frame_payload(frame), ready[i].client == servers[3] ? "three" : ready[i].client == servers[18] ? "eighteen" : "forty-two"));
+		wss_frame_destroy(frame);
+	}
+	assert(wss_poll(set, ready, SET_CLIENTS, 0) == 0);
+
+	/* Several frames read at once, into the receive buffer or the TLS layer, come out one at a time */
+	for (i = 0; i < 2; i++) {
+		struct wss_client *server = servers[i ? 1 : 0];
+		struct wss_client *client = clients[i ? 1 : 0];
+		int j;
+		assert(!wss_write(client, WS_OPCODE_TEXT, "a", 1));
+		assert(!wss_write(client, WS_OPCODE_TEXT, "b", 1));
+		assert(!wss_write(client, WS_OPCODE_TEXT, "c", 1));
+		for (j = 0; j < 3; j++) {
+			struct wss_frame *frame;
+			n = wss_poll(set, ready, 1, 1000);
+			assert(n == 1);
+			assert(ready[0].client == server);
+			frame = wss_client_frame(server);
+			assert(wss_frame_payload(frame)[0] == 'a' + j);
+			wss_frame_destroy(frame);
+		}
+		assert(wss_poll(set, ready, SET_CLIENTS, 0) == 0);
+	}
+
+	/* Disconnects are reported */
+	wss_client_destroy(clients[7]);
+	close(fds[7][1]);
+	n = wss_poll(set, ready, SET_CLIENTS, 1000);
+	assert(n == 1);
+	assert(ready[0].client == servers[7] && ready[0].res == -1);
+	assert(!wss_clientset_remove(set, servers[7]));
+	assert(wss_clientset_remove(set, servers[7]) == -1);
+	assert(wss_clientset_count(set) == SET_CLIENTS - 1);
+	wss_client_destroy(servers[7]);
+	close(fds[7][0]);
+
+	for (i = 0; i < SET_CLIENTS; i++) {
+		if (i == 7) {
+			continue;
+		}
+		wss_client_destroy(servers[i]); /* Removes it from the set */
+		wss_client_destroy(clients[i]);
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	assert(wss_clientset_count(set) == 0);
+	wss_clientset_destroy(set);
+	return 0;
+}
+
+/*! \brief Blocking and non-blocking clients using io_uring */
+static int test_uring(void)
+{
+	struct wss_uring *ring;
+	struct wss_client *servers[2], *clients[2];
+	struct wss_ready ready[2];
+	struct wss_frame *frame;
+	struct custom cb;
+	char payload[20000];
+	int fds[2][2];
+	int i;
+
+	ring = wss_uring_new(64, 8, 1024);
+	if (!ring) {
+		fprintf(stderr, "io_uring not available, skipping io_uring tests\n");
+		return 0;
+	}
+	for (i = 0; i < (int) sizeof(payload); i++) {
+		payload[i] = (char) ('a' + i % 26);
+	}
+	for (i = 0; i < 2; i++) {
+		assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+		servers[i] = wss_client_new(NULL, fds[i][0], fds[i][0]);
+		clients[i] = wss_client_new(i ? NULL : &cb, fds[i][1], fds[i][1]);
+		assert(servers[i] && clients[i]);
+		wss_set_client_type(clients[i], WS_CLIENT);
+		assert(!wss_set_io_uring(servers[i], ring));
+	}
+	cb.rfd = cb.wfd = fds[0][1];
+	wss_set_io_callbacks(clients[0], read_cb, write_cb);
+	assert(wss_set_io_uring(clients[0], ring) == -1); /* Sockets only */
+
+	/* Blocking: several frames in one read, and one larger than all the ring's buffers combined */
+	assert(!wss_write(clients[0], WS_OPCODE_TEXT, "one", 3));
+	assert(!wss_write(clients[0], WS_OPCODE_TEXT, "two", 3));
+	assert(!wss_write(clients[0], WS_OPCODE_BINARY, payload, sizeof(payload)));
+	assert(wss_read(servers[0], 1000, 0) == 1);
+	frame = wss_client_frame(servers[0]);
+	assert(!strcmp(wss_frame_payload(frame), "one"));
+	wss_frame_destroy(frame);
+	assert(wss_read_pending(servers[0]) > 0);
+	assert(wss_read(servers[0], 1000, 0) == 1);
+	frame = wss_client_frame(servers[0]);
+	assert(!strcmp(wss_frame_payload(frame), "two"));
+	wss_frame_destroy(frame);
+	assert(wss_read(servers[0], 1000, 0) == 1);
+	frame = wss_client_frame(servers[0]);
+	assert(wss_frame_payload_length(frame) == sizeof(payload));
+	assert(!memcmp(wss_frame_payload(frame), payload, sizeof(payload)));
+	wss_frame_destroy(frame);
+	assert(wss_read(servers[0], 10, 0) == 0); /* Timeout */
+
+	/* Writes, as linked sends */
+	assert(!wss_write(servers[0], WS_OPCODE_BINARY, payload, sizeof(payload)));
+	assert(!wss_write(servers[0], WS_OPCODE_TEXT, "three", 5));
+	assert(wss_read(clients[0], 1000, 0) == 1);
+	frame = wss_client_frame(clients[0]);
+	assert(wss_frame_payload_length(frame) == sizeof(payload));
+	assert(!memcmp(wss_frame_payload(frame), payload, sizeof(payload)));
+	wss_frame_destroy(frame);
+	assert(wss_read(clients[0], 1000, 0) == 1);
+	frame = wss_client_frame(clients[0]);
+	assert(!strcmp(wss_frame_payload(frame), "three"));
+	wss_frame_destroy(frame);
+
+	/* Stop using io_uring, with something still buffered */
+	assert(!wss_write(clients[0], WS_OPCODE_TEXT, "four", 4));
+	assert(!wss_set_io_uring(servers[0], NULL));
+
+	/* Non-blocking */
+	assert(!fcntl(fds[1][0], F_SETFL, fcntl(fds[1][0], F_GETFL) | O_NONBLOCK));
+	wss_set_nonblocking(servers[1], 1);
+	assert(wss_uring_poll(ring, ready, 2, 0) == 0);
+	assert(!wss_write(clients[1], WS_OPCODE_TEXT, "five", 4));
+	assert(!wss_write(clients[1], WS_OPCODE_TEXT, "six", 3));
+	for (i = 0; i < 2; i++) {
+		assert(wss_uring_poll(ring, ready, 2, 1000) == 1);
+		assert(ready[0].client == servers[1] && ready[0].res == 1);
+		frame = wss_client_frame(servers[1]);
+		assert(!strcmp(wss_frame_payload(frame), i ? "six" : "five"));
+		wss_frame_destroy(frame);
+	}
+	assert(wss_uring_poll(ring, ready, 2, 0) == 0);
+	assert(!wss_write(servers[1], WS_OPCODE_TEXT, "seven", 5));
+	assert(wss_read(clients[1], 1000, 0) == 1);
+	frame = wss_client_frame(clients[1]);
+	assert(!strcmp(wss_frame_payload(frame), "seven"));
+	wss_frame_destroy(frame);
+
+	/* Disconnects are reported */
+	wss_client_destroy(clients[1]);
+	close(fds[1][1]);
+	assert(wss_uring_poll(ring, ready, 2, 1000) == 1);
+	assert(ready[0].client == servers[1] && ready[0].res == -1);
+
+	for (i = 0; i < 2; i++) {
+		wss_client_destroy(servers[i]);
+		close(fds[i][0]);
+		if (!i) {
+			wss_client_destroy(clients[i]);
+			close(fds[i][1]);
+		}
+	}
+	wss_uring_destroy(ring);
+	return 0;
+}
+
+/*! \brief Read a frame from a file-backed payload, and check it */
+static void check_file_frame(struct wss_client *reader, const char *expected, size_t len)
+{
+	struct wss_frame *frame = wss_client_frame(reader);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_BINARY);
+	assert(wss_frame_payload_length(frame) == len);
+	assert(!len || !memcmp(wss_frame_payload(frame), expected, len));
+	wss_frame_destroy(frame);
+}
+
+static int test_write_file(void)
+{
+	struct wss_client *server, *client;
+	struct custom cb;
+	char path[] = "/tmp/wss_test_XXXXXX";
+	char *contents;
+	int fds[2];
+	int i, fd, res;
+
+	contents = malloc(300000);
+	assert(contents != NULL);
+	for (i = 0; i < 300000; i++) {
+		contents[i] = (char) (i * 7);
+	}
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+	assert(write(fd, contents, 300000) == 300000);
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	server = wss_client_new(NULL, fds[0], fds[0]);
+	client = wss_client_new(&cb, fds[1], fds[1]);
+	assert(server && client);
+	wss_set_client_type(client, WS_CLIENT);
+
+	/* Blocking, straight from the file */
+	assert(!wss_write_file(server, fd, 100, 50000));
+	assert(!wss_write_file(server, fd, 0, 0));
+	assert(wss_read(client, 1000, 0) == 1);
+	check_file_frame(client, contents + 100, 50000);
+	assert(wss_read(client, 1000, 0) == 1);
+	check_file_frame(client, contents, 0);
+
+	/* Past the end of the file */
+	assert(wss_write_file(client, fd, 299000, 2000) == -1);
+
+	/* Masked, from a client */
+	assert(!wss_write_file(client, fd, 5, 1000));
+	assert(wss_read(server, 1000, 0) == 1);
+	check_file_frame(server, contents + 5, 1000);
+
+	/* Copied, with I/O callbacks */
+	cb.rfd = cb.wfd = fds[0];
+	wss_client_destroy(server);
+	server = wss_client_new(&cb, fds[0], fds[0]);
+	assert(server != NULL);
+	wss_set_io_callbacks(server, read_cb, write_cb);
+	assert(!wss_write_file(server, fd, 1234, 40000));
+	assert(wss_read(client, 1000, 0) == 1);
+	check_file_frame(client, contents + 1234, 40000);
+	wss_client_destroy(server);
+
+	/* Non-blocking, more than the socket will take at once */
+	server = wss_client_new(NULL, fds[0], fds[0]);
+	assert(server != NULL);
+	assert(!fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK));
+	assert(!fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK));
+	wss_set_nonblocking(server, 1);
+	wss_set_nonblocking(client, 1);
+	assert(!wss_write_file(server, fd, 0, 300000));
+	assert(!wss_write(server, WS_OPCODE_TEXT, "after", 5));
+	assert(wss_want_write(server));
+	do {
+		assert(wss_flush(server) >= 0);
+		res = wss_read(client, 0, 1);
+		assert(res >= 0);
+	} while (!res);
+	check_file_frame(client, contents, 300000);
+	do {
+		assert(wss_flush(server) >= 0);
+		res = wss_read(client, 0, 1);
+		assert(res >= 0);
+	} while (!res);
+	assert(!strcmp(wss_frame_payload(wss_client_frame(client)), "after"));
+	wss_frame_destroy(wss_client_frame(client));
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	close(fd);
+	free(contents);
+	return 0;
+}
+
+static int test_handshake(void)
+{
+	struct wss_handshake hs;
+	struct wss_deflate_params local;
+	struct wss_client *server;
+	struct wss_frame *frame;
+	char accept[29], key[25], response[512], request[1024], x[201];
+	char *large;
+	const char *p;
+	size_t length;
+	int i, len;
+	const struct {
+		size_t len;
+		const char *accept;
+	} vectors[] = {
+		/* Around the padding and block boundaries */
+		{ 0, "Kfh9QIsMVZcl6xEPYxPHzW8SZ8w=" },
+		{ 19, "qQsxh2Nb/vsnD9od6HBiP6Igif0=" },
+		{ 20, "7jD6MP55bPPoLSNhT1mD/AE8sjc=" },
+		{ 28, "atUL8kQGe4qplhq19Y5TKRw/Uj4=" },
+		{ 92, "N6jQH9SY1VrfN6p4qvkUdTUUhwQ=" },
+		{ 200, "2/xdrRDawKrkzT3zWJGBWn134JI=" },
+	};
+	const char valid[] = "GET /chat HTTP/1.1\r\n"
+		"Host: server.example.com\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: keep-alive, Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		"Origin: http://example.com\r\n"
+		"Sec-WebSocket-Protocol: chat, superchat\r\n"
+		"Sec-WebSocket-Extensions: x-webkit-deflate-frame\r\n"
+		"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+		"Sec-WebSocket-Version: 13\r\n"
+		"\r\n";
+
+	/* RFC 6455 1.3 */
+	wss_handshake_accept("dGhlIHNhbXBsZSBub25jZQ==", 24, accept);
+	assert(!strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="));
+	memset(x, 'x', sizeof(x));
+	for (i = 0; i < (int) (sizeof(vectors) / sizeof(vectors[0])); i++) {
+		wss_handshake_accept(x, vectors[i].len, accept);
+		assert(!strcmp(accept, vectors[i].accept));
+	}
+
+	/* Incomplete, then complete */
+	assert(wss_handshake_parse(valid, sizeof(valid) - 3, &hs) == 0);
+	assert(wss_handshake_parse(valid, sizeof(valid) - 1, &hs) == 1);
+	assert(hs.length == sizeof(valid) - 1);
+	assert(hs.path.len == 5 && !strncmp(hs.path.s, "/chat", 5));
+	assert(hs.host.len == 18 && !strncmp(hs.host.s, "server.example.com", 18));
+	assert(hs.origin.len == 18 && !strncmp(hs.origin.s, "http://example.com", 18));
+	assert(hs.protocols.len == 15 && !strncmp(hs.protocols.s, "chat, superchat", 15));
+	assert(hs.nextensions == 2 && hs.version == 13);
+
+	/* Without and with compression */
+	len = wss_handshake_response(&hs, "chat", NULL, response, sizeof(response));
+	assert(len > 0 && !hs.deflate);
+	assert(strstr(response, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+	assert(strstr(response, "Sec-WebSocket-Protocol: chat\r\n"));
+	assert(!strstr(response, "Sec-WebSocket-Extensions"));
+	assert(wss_handshake_check_response(response, (size_t) len - 1, "dGhlIHNhbXBsZSBub25jZQ==", &length) == 0);
+	assert(wss_handshake_check_response(response, (size_t) len, "dGhlIHNhbXBsZSBub25jZQ==", &length) == 1);
+	assert(length == (size_t) len);
+	assert(wss_handshake_check_response(response, (size_t) len, "AAAAAAAAAAAAAAAAAAAAAA==", &length) == -1);
+
+	memset(&local, 0, sizeof(local));
+	len = wss_handshake_response(&hs, NULL, &local, response, sizeof(response));
+	assert(len > 0 && hs.deflate == 1);
+	assert(strstr(response, "Sec-WebSocket-Extensions: permessage-deflate"));
+	assert(!strstr(response, "Sec-WebSocket-Protocol"));
+
+	/* Invalid requests */
+	p = "POST /chat HTTP/1.1\r\nHost: a\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	assert(wss_handshake_parse(p, strlen(p), &hs) == -1 && hs.status == 400);
+	p = "GET /chat HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	assert(wss_handshake_parse(p, strlen(p), &hs) == -1 && hs.status == 400);
+	p = "GET /chat HTTP/1.1\r\nHost: a\r\nUpgrade: websocket\r\nConnection: keep-alive\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	assert(wss_handshake_parse(p, strlen(p), &hs) == -1 && hs.status == 400);
+	p = "GET /chat HTTP/1.1\r\nHost: a\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: short==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	assert(wss_handshake_parse(p, strlen(p), &hs) == -1 && hs.status == 400);
+	p = "GET /chat HTTP/1.1\r\nHost: a\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 8\r\n\r\n";
+	assert(wss_handshake_parse(p, strlen(p), &hs) == -1 && hs.status == 426);
+	len = wss_handshake_response(&hs, NULL, NULL, response, sizeof(response));
+	assert(len > 0 && !strncmp(response, "HTTP/1.1 426 ", 13));
+	assert(strstr(response, "Sec-WebSocket-Version: 13\r\n"));
+	assert(wss_handshake_check_response(response, (size_t) len, "dGhlIHNhbXBsZSBub25jZQ==", &length) == -1);
+
+	/* Large headers are fine, as long as the caller has buffered them */
+	large = malloc(8192);
+	assert(large != NULL);
+	len = snprintf(large, 8192, "GET / HTTP/1.1\r\nHost: a\r\nCookie: %06000d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n", 0);
+	assert(len > 6000 && len < 8192);
+	large = realloc(large, (size_t) len); /* Not NUL terminated, so nothing is read past the end */
+	assert(large != NULL);
+	assert(wss_handshake_parse(large, (size_t) len, &hs) == 1);
+	assert(hs.length == (size_t) len);
+	assert(hs.key.len == 24 && hs.key.s > large + 6000);
+	assert(wss_handshake_parse(large, (size_t) len - 1, &hs) == 0);
+	free(large);
+
+	/* A frame received along with the request ends up in the client's read buffer */
+	assert(wss_handshake_key(key) == 0 && strlen(key) == 24);
+	len = snprintf(request, sizeof(request), "GET / HTTP/1.1\r\nHost: a\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n", key);
+	memcpy(request + len, "\x81\x82\x00\x00\x00\x00hi", 8);
+	assert(wss_handshake_parse(request, (size_t) len + 8, &hs) == 1);
+	assert(hs.length == (size_t) len);
+	server = wss_handshake_client_new(&hs, request, (size_t) len + 8, NULL, -1, -1);
+	assert(server != NULL);
+	assert(wss_read_pending(server) == 8);
+	assert(wss_read(server, 0, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload_length(frame) == 2 && !strcmp(wss_frame_payload(frame), "hi"));
+	wss_frame_destroy(frame);
+	wss_client_destroy(server);
+	return 0;
+}
+
+static int test_memory(void)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	int c2s[2], s2c[2];
+	size_t base;
+
+	assert(!pipe(c2s));
+	assert(!pipe(s2c));
+	server = wss_client_new(NULL, c2s[0], s2c[1]);
+	assert(server != NULL);
+	client = wss_client_new(NULL, s2c[0], c2s[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	wss_set_auto_control(server, 1);
+	base = wss_client_memory_usage(server);
+	assert(base > 0);
+
+	/* The receive buffer isn't allocated until it's used */
+	assert(!wss_set_read_buffer(server, 4096));
+	assert(wss_client_memory_usage(server) == base);
+	assert(!wss_write(client, WS_OPCODE_TEXT, "data", 4));
+	assert(wss_read(server, 250, 0) == 1);
+	assert(wss_client_memory_usage(server) > base + 4096); /* Including the payload */
+	frame = wss_client_frame(server);
+	assert(!strcmp(wss_frame_payload(frame), "data"));
+	wss_frame_destroy(frame);
+	assert(wss_client_memory_usage(server) == base + 4096);
+
+	/* Fragmented messages and PINGs need a little more */
+	wss_set_max_fragment_size(client, 2);
+	assert(!wss_write(client, WS_OPCODE_TEXT, "abcdef", 6));
+	assert(!wss_write(client, WS_OPCODE_PING, "p", 1));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(!strcmp(wss_frame_payload(frame), "abcdef"));
+	wss_frame_destroy(frame);
+	assert(wss_read(server, 250, 0) == 0); /* PING answered */
+	assert(wss_client_memory_usage(server) > base + 4096);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(wss_frame_opcode(frame) == WS_OPCODE_PONG);
+	wss_frame_destroy(frame);
+
+	/* Idle, so everything can go, and is allocated again as needed */
+	wss_client_trim(server);
+	assert(wss_client_memory_usage(server) == base);
+	assert(!wss_write(client, WS_OPCODE_BINARY, "again", 5));
+	assert(wss_read(server, 250, 0) == 1);
+	frame = wss_client_frame(server);
+	assert(wss_frame_payload_length(frame) == 5 && !memcmp(wss_frame_payload(frame), "again", 5));
+	wss_frame_destroy(frame);
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(c2s[0]);
+	close(c2s[1]);
+	close(s2c[0]);
+	close(s2c[1]);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	(void) argc;
 	(void) argv;
 
 	fprintf(stderr, "Running WebSocket integration tests\n");
-	test(0); /* Tests witout I/O callbacks */
-	test(1); /* Tests with I/O callbacks */
+	test_mask();
+	test_mask_keys();
+	test(0, 0); /* Tests witout I/O callbacks */
+	test(1, 0); /* Tests with I/O callbacks */
+	test(0, 1); /* Tests with buffered reads */
+	test(1, 1); /* Tests with buffered reads and I/O callbacks */
+	test_payload_buffers();
+	test_encoded();
+	test_nonblocking();
+	test_fragmented(0);
+	test_fragmented(1);
+	test_compression();
+	test_utf8();
+	test_destination(0);
+	test_destination(1);
+	test_inplace();
+	test_stats();
+	test_control();
+	test_send_queue();
+	test_send_queue_control();
+	test_backpressure();
+	test_backpressure_midframe();
+	test_backpressure_block();
+	test_clientset();
+	test_uring();
+	test_write_file();
+	test_handshake();
+	test_memory();
 	fprintf(stderr, "Tests completed successfully\n");
 }
@@ -0,0 +1,218 @@
+/*
+ * libwss -- WebSocket Server Library
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the Mozilla Public License Version 2.
+ */
+
+/*! \file
+ *
+ * \brief permessage-deflate test
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/socket.h>
+
+#include <wss.h>
+#include "wss_deflate.h"
+
+static size_t written = 0;
+
+static ssize_t write_cb(void *data, const char *buf, size_t len)
+{
+	int *fd = data;
+	written += len;
+	return write(*fd, buf, len);
+}
+
+static ssize_t read_cb(void *data, char *buf, size_t len)
+{
+	int *fd = data;
+	return read(*fd, buf, len);
+}
+
+/*! \brief Send messages in both directions, with the given parameters */
+static int test_roundtrip(const char *offer)
+{
+	struct wss_client *server, *client;
+	struct wss_frame *frame;
+	struct wss_deflate_params agreed, accepted;
+	char payload[20000], response[256];
+	int fds[2];
+	int i;
+
+	assert(wss_deflate_negotiate(offer, NULL, &agreed, response, sizeof(response)) == 1);
+	assert(!wss_deflate_accept(response, &accepted));
+	assert(!memcmp(&agreed, &accepted, sizeof(agreed)));
+
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	server = wss_client_new(&fds[0], -1, -1);
+	client = wss_client_new(&fds[1], -1, -1);
+	assert(server && client);
+	wss_set_io_callbacks(server, read_cb, write_cb);
+	wss_set_io_callbacks(client, read_cb, write_cb);
+	wss_set_client_type(client, WS_CLIENT);
+	assert(!wss_deflate_enable(server, WS_SERVER, &agreed, -1));
+	assert(!wss_deflate_enable(client, WS_CLIENT, &accepted, -1));
+
+	for (i = 0; i < (int) sizeof(payload); i++) {
+		payload[i] = "compressible "[i % 13];
+	}
+	for (i = 0; i < 3; i++) {
+		/* Repeat, so that context takeover (if used) is exercised */
+		written = 0;
+		assert(!wss_write(client, WS_OPCODE_TEXT, payload, sizeof(payload)));
+		assert(written < sizeof(payload) / 10);
+		assert(wss_read(server, 1000, 0) == 1);
+		frame = wss_client_frame(server);
+		assert(wss_frame_payload_length(frame) == sizeof(payload));
+		assert(!memcmp(wss_frame_payload(frame), payload, sizeof(payload)));
+		wss_frame_destroy(frame);
+
+		/* Also fragmented */
+		wss_set_max_fragment_size(server, 100);
+		assert(!wss_write(server, WS_OPCODE_BINARY, payload, 5000));
+		assert(wss_read(client, 1000, 0) == 1);
+		frame = wss_client_frame(client);
+		assert(wss_frame_opcode(frame) == WS_OPCODE_BINARY);
+		assert(wss_frame_payload_length(frame) == 5000);
+		assert(!memcmp(wss_frame_payload(frame), payload, 5000));
+		wss_frame_destroy(frame);
+	}
+	if (!agreed.server_no_context_takeover) {
+		/* The compressor is retained, and its memory is accounted for */
+		assert(wss_client_memory_usage(server) > 64 * 1024);
+	}
+
+	wss_client_destroy(server);
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+/*! \brief Compress a message once, and send it to multiple connections */
+static int test_broadcast(void)
+{
+	struct wss_client *servers[3], *clients[3];
+	struct wss_encoded_frame *encoded;
+	struct wss_deflate_params agreed;
+	const char *offers[3] = {
+		"permessage-deflate; server_no_context_takeover",
+		"permessage-deflate; server_no_context_takeover; server_max_window_bits=12",
+		"permessage-deflate", /* Context takeover, so this one can't share */
+	};
+	char payload[4096], response[256];
+	int fds[3][2];
+	int i;
+
+	for (i = 0; i < (int) sizeof(payload); i++) {
+		payload[i] = "broadcast "[i % 10];
+	}
+	for (i = 0; i < 3; i++) {
+		assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+		servers[i] = wss_client_new(&fds[i][0], -1, -1);
+		clients[i] = wss_client_new(&fds[i][1], -1, -1);
+		assert(servers[i] && clients[i]);
+		wss_set_io_callbacks(servers[i], read_cb, write_cb);
+		wss_set_io_callbacks(clients[i], read_cb, write_cb);
+		wss_set_client_type(clients[i], WS_CLIENT);
+		assert(wss_deflate_negotiate(offers[i], NULL, &agreed, response, sizeof(response)) == 1);
+		assert(!wss_deflate_enable(servers[i], WS_SERVER, &agreed, -1));
+		assert(!wss_deflate_accept(response, &agreed));
+		assert(!wss_deflate_enable(clients[i], WS_CLIENT, &agreed, -1));
+	}
+	assert(wss_deflate_can_share(servers[0], 12));
+	assert(wss_deflate_can_share(servers[1], 12));
+	assert(!wss_deflate_can_share(servers[1], 15));
+	assert(!wss_deflate_can_share(servers[2], 12));
+	assert(!wss_deflate_can_share(clients[0], 12)); /* Clients use context takeover in this direction */
+
+	encoded = wss_deflate_encode_frame(WS_SERVER, WS_OPCODE_TEXT, payload, sizeof(payload), 12, -1);
+	assert(encoded != NULL);
+	for (i = 0; i < 3; i++) {
+		struct wss_frame *frame;
+		if (wss_deflate_can_share(servers[i], 12)) {
+			written = 0;
+			assert(!wss_write_encoded(servers[i], encoded));
+			assert(written < sizeof(payload) / 10);
+		} else {
+			assert(!wss_write(servers[i], WS_OPCODE_TEXT, payload, sizeof(payload)));
+		}
+		assert(wss_read(clients[i], 1000, 0) == 1);
+		frame = wss_client_frame(clients[i]);
+		assert(wss_frame_payload_length(frame) == sizeof(payload));
+		assert(!memcmp(wss_frame_payload(frame), payload, sizeof(payload)));
+		wss_frame_destroy(frame);
+		wss_client_destroy(servers[i]);
+		wss_client_destroy(clients[i]);
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	wss_encoded_frame_unref(encoded);
+	return 0;
+}
+
+/*! \brief Decompress the example in RFC 7692 7.2.3.1 */
+static int test_rfc_example(void)
+{
+	struct wss_client *client;
+	struct wss_frame *frame;
+	struct wss_deflate_params params;
+	const char hello[] = { (char) 0xc1, 0x07, (char) 0xf2, 0x48, (char) 0xcd, (char) 0xc9, (char) 0xc9, 0x07, 0x00 };
+	int fds[2];
+
+	assert(!pipe(fds));
+	client = wss_client_new(NULL, fds[0], fds[1]);
+	assert(client != NULL);
+	wss_set_client_type(client, WS_CLIENT);
+	memset(&params, 0, sizeof(params));
+	assert(!wss_deflate_enable(client, WS_CLIENT, &params, -1));
+
+	/* Twice, since the second message can use the first as context */
+	assert(write(fds[1], hello, sizeof(hello)) == sizeof(hello));
+	assert(write(fds[1], hello, sizeof(hello)) == sizeof(hello));
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!strcmp(wss_frame_payload(frame), "Hello"));
+	wss_frame_destroy(frame);
+	assert(wss_read(client, 250, 0) == 1);
+	frame = wss_client_frame(client);
+	assert(!strcmp(wss_frame_payload(frame), "Hello"));
+	wss_frame_destroy(frame);
+
+	/* Garbage */
+	assert(write(fds[1], "\xc1\x02\xff\xff", 4) == 4);
+	assert(wss_read(client, 250, 0) < 0);
+	assert(wss_error_code(client) == WS_CLOSE_DATA_INCONSISTENT);
+
+	wss_client_destroy(client);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	(void) argc;
+	(void) argv;
+
+	fprintf(stderr, "Running permessage-deflate tests\n");
+	test_rfc_example();
+	test_roundtrip("permessage-deflate; client_max_window_bits"); /* Context takeover */
+	test_roundtrip("permessage-deflate; server_no_context_takeover; client_no_context_takeover"); /* Pooled streams */
+	test_roundtrip("permessage-deflate; server_max_window_bits=10; client_max_window_bits=9");
+	test_broadcast();
+	wss_deflate_set_pool_size(0);
+	fprintf(stderr, "Tests completed successfully\n");
+}
@@ -22,13 +22,50 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <math.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/random.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WS_MASK_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WS_MASK_NEON 1
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#define WS_EPOLL 1
+#define WS_SENDFILE 1
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/event.h>
+#define WS_KQUEUE 1
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define WS_IO_URING 1
+#endif
+#endif
+#endif
 
 #if defined(__linux__)
 #include <endian.h>
@@ -53,6 +90,300 @@
 #define BIT6 0x02
 #define BIT7 0x01
 
+/* Masking
+ * All of the masking routines below take the offset into the payload of the first byte,
+ * so that data can be (un)masked in arbitrary chunks, e.g. as it's returned by read. */
+
+/*! \brief Expand a 4-byte mask into 8 bytes, rotated for the given payload offset */
+static inline uint64_t mask_word(const char key[4], size_t offset)
+{
+	unsigned char k[8];
+	uint64_t word;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		k[i] = (unsigned char) key[(offset + i) % 4];
+	}
+	memcpy(&word, k, sizeof(word));
+	return word;
+}
+
+/*! \brief Portable word-at-a-time masking, 8 bytes per step */
+static void mask_generic(char *dst, const char *src, size_t len, const char key[4], size_t offset)
+{
+	uint64_t word, k = mask_word(key, offset);
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&word, src + i, sizeof(word));
+		word ^= k;
+		memcpy(dst + i, &word, sizeof(word));
+	}
+	/* i is a multiple of 4 here, so the key phase is still offset % 4 */
+	for (; i < len; i++) {
+		dst[i] = src[i] ^ key[(offset + i) % 4];
+	}
+}
+
+#ifdef WS_MASK_X86
+static __attribute__((target("sse2"))) void mask_sse2(char *dst, const char *src, size_t len, const char key[4], size_t offset)
+{
+	__m128i k = _mm_set1_epi64x((long long) mask_word(key, offset));
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i word = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(word, k));
+	}
+	mask_generic(dst + i, src + i, len - i, key, offset + i);
+}
+
+static __attribute__((target("avx2"))) void mask_avx2(char *dst, const char *src, size_t len, const char key[4], size_t offset)
+{
+	__m256i k = _mm256_set1_epi64x((long long) mask_word(key, offset));
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i word = _mm256_loadu_si256((const __m256i *) (src + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(word, k));
+	}
+	mask_generic(dst + i, src + i, len - i, key, offset + i);
+}
+#elif defined(WS_MASK_NEON)
+static void mask_neon(char *dst, const char *src, size_t len, const char key[4], size_t offset)
+{
+	uint8x16_t k = vreinterpretq_u8_u64(vdupq_n_u64(mask_word(key, offset)));
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		uint8x16_t word = vld1q_u8((const uint8_t *) (src + i));
+		vst1q_u8((uint8_t *) (dst + i), veorq_u8(word, k));
+	}
+	mask_generic(dst + i, src + i, len - i, key, offset + i);
+}
+#endif
+
+/* UTF-8 validation
+ * A byte-at-a-time state machine, so that validation can be resumed across chunks and fragments.
+ * The routines below skip over runs of ASCII a word or vector at a time, and can unmask at the same time,
+ * so that each byte of a TEXT payload is only touched once. */
+
+enum utf8_state {
+	UTF8_ACCEPT = 0,	/*!< At a character boundary */
+	UTF8_REJECT,		/*!< Invalid sequence */
+	UTF8_NEED1,			/*!< 1 continuation byte remaining */
+	UTF8_NEED2,			/*!< 2 continuation bytes remaining */
+	UTF8_NEED3,			/*!< 3 continuation bytes remaining */
+	UTF8_E0,			/*!< After E0: A0-BF, to exclude overlong encodings */
+	UTF8_ED,			/*!< After ED: 80-9F, to exclude surrogates */
+	UTF8_F0,			/*!< After F0: 90-BF, to exclude overlong encodings */
+	UTF8_F4,			/*!< After F4: 80-8F, to exclude code points above U+10FFFF */
+};
+
+#define UTF8_CONTINUATION(c) (((c) & 0xc0) == 0x80)
+
+static inline unsigned char utf8_step(unsigned char state, unsigned char c)
+{
+	switch (state) {
+		case UTF8_ACCEPT:
+			if (c < 0x80) {
+				return UTF8_ACCEPT;
+			} else if (c < 0xc2) {
+				return UTF8_REJECT; /* Continuation byte, or overlong 2-byte sequence */
+			} else if (c < 0xe0) {
+				return UTF8_NEED1;
+			} else if (c == 0xe0) {
+				return UTF8_E0;
+			} else if (c == 0xed) {
+				return UTF8_ED;
+			} else if (c < 0xf0) {
+				return UTF8_NEED2;
+			} else if (c == 0xf0) {
+				return UTF8_F0;
+			} else if (c < 0xf4) {
+				return UTF8_NEED3;
+			} else if (c == 0xf4) {
+				return UTF8_F4;
+			}
+			return UTF8_REJECT;
+		case UTF8_NEED1:
+			return UTF8_CONTINUATION(c) ? UTF8_ACCEPT : UTF8_REJECT;
+		case UTF8_NEED2:
+			return UTF8_CONTINUATION(c) ? UTF8_NEED1 : UTF8_REJECT;
+		case UTF8_NEED3:
+			return UTF8_CONTINUATION(c) ? UTF8_NEED2 : UTF8_REJECT;
+		case UTF8_E0:
+			return c >= 0xa0 && c <= 0xbf ? UTF8_NEED1 : UTF8_REJECT;
+		case UTF8_ED:
+			return c >= 0x80 && c <= 0x9f ? UTF8_NEED1 : UTF8_REJECT;
+		case UTF8_F0:
+			return c >= 0x90 && c <= 0xbf ? UTF8_NEED2 : UTF8_REJECT;
+		case UTF8_F4:
+			return c >= 0x80 && c <= 0x8f ? UTF8_NEED2 : UTF8_REJECT;
+	}
+	return UTF8_REJECT;
+}
+
+static inline unsigned char utf8_bytes(unsigned char state, const char *buf, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len && state != UTF8_REJECT; i++) {
+		state = utf8_step(state, (unsigned char) buf[i]);
+	}
+	return state;
+}
+
+/*!
+ * \brief Validate a block of up to 32 bytes, given a bitmask of which bytes are non-ASCII
+ * \note Only the non-ASCII bytes (and the continuation bytes after them) are processed individually
+ */
+static inline unsigned char utf8_block(unsigned char state, const char *buf, unsigned int len, uint32_t high)
+{
+	unsigned int i = 0;
+
+	while (i < len) {
+		if (state == UTF8_ACCEPT) {
+			/* Skip ahead to the next non-ASCII byte */
+			uint32_t rest = high >> i;
+			if (!rest) {
+				break;
+			}
+			i += (unsigned int) __builtin_ctz(rest);
+		}
+		state = utf8_step(state, (unsigned char) buf[i++]);
+		if (state == UTF8_REJECT) {
+			break;
+		}
+	}
+	return state;
+}
+
+#define HIGH_BITS 0x8080808080808080ULL
+
+/*!
+ * \brief Portable word-at-a-time UTF-8 validation, optionally unmasking in place first
+ * \param buf Data to validate
+ * \param len
+ * \param key Masking key, or NULL if the data is not masked
+ * \param offset Offset of buf within the payload
+ * \param[in,out] state Validator state
+ */
+static void utf8_generic(char *buf, size_t len, const char *key, size_t offset, unsigned char *state)
+{
+	uint64_t word, k = key ? mask_word(key, offset) : 0;
+	unsigned char s = *state;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&word, buf + i, sizeof(word));
+		if (key) {
+			word ^= k;
+			memcpy(buf + i, &word, sizeof(word));
+		}
+		/* Pure ASCII at a character boundary needs no further checking */
+		if ((word & HIGH_BITS) || s != UTF8_ACCEPT) {
+			s = utf8_bytes(s, buf + i, 8);
+			if (s == UTF8_REJECT) {
+				*state = s;
+				return; /* No point in unmasking the rest */
+			}
+		}
+	}
+	for (; i < len && s != UTF8_REJECT; i++) {
+		if (key) {
+			buf[i] ^= key[(offset + i) % 4];
+		}
+		s = utf8_step(s, (unsigned char) buf[i]);
+	}
+	*state = s;
+}
+
+#ifdef WS_MASK_X86
+static __attribute__((target("sse2"))) void utf8_sse2(char *buf, size_t len, const char *key, size_t offset, unsigned char *state)
+{
+	__m128i k = _mm_set1_epi64x(key ? (long long) mask_word(key, offset) : 0);
+	unsigned char s = *state;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i word = _mm_loadu_si128((const __m128i *) (buf + i));
+		uint32_t high;
+		if (key) {
+			word = _mm_xor_si128(word, k);
+			_mm_storeu_si128((__m128i *) (buf + i), word);
+		}
+		high = (uint32_t) _mm_movemask_epi8(word);
+		if (high || s != UTF8_ACCEPT) {
+			s = utf8_block(s, buf + i, 16, high);
+			if (s == UTF8_REJECT) {
+				*state = s;
+				return;
+			}
+		}
+	}
+	*state = s;
+	utf8_generic(buf + i, len - i, key, offset + i, state);
+}
+
+static __attribute__((target("avx2"))) void utf8_avx2(char *buf, size_t len, const char *key, size_t offset, unsigned char *state)
+{
+	__m256i k = _mm256_set1_epi64x(key ? (long long) mask_word(key, offset) : 0);
+	unsigned char s = *state;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i word = _mm256_loadu_si256((const __m256i *) (buf + i));
+		uint32_t high;
+		if (key) {
+			word = _mm256_xor_si256(word, k);
+			_mm256_storeu_si256((__m256i *) (buf + i), word);
+		}
+		high = (uint32_t) _mm256_movemask_epi8(word);
+		if (high || s != UTF8_ACCEPT) {
+			s = utf8_block(s, buf + i, 32, high);
+			if (s == UTF8_REJECT) {
+				*state = s;
+				return;
+			}
+		}
+	}
+	*state = s;
+	utf8_generic(buf + i, len - i, key, offset + i, state);
+}
+#endif
+
+static void (*mask_impl)(char *dst, const char *src, size_t len, const char key[4], size_t offset) = mask_generic;
+static void (*utf8_impl)(char *buf, size_t len, const char *key, size_t offset, unsigned char *state) = utf8_generic;
+
+/*! \brief Pick the fastest masking and validation implementations supported by this CPU */
+static void __attribute__((constructor)) mask_init(void)
+{
+#ifdef WS_MASK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		mask_impl = mask_avx2;
+		utf8_impl = utf8_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		mask_impl = mask_sse2;
+		utf8_impl = utf8_sse2;
+	}
+#elif defined(WS_MASK_NEON)
+	mask_impl = mask_neon;
+#endif
+}
+
+void wss_mask(char *dst, const char *src, size_t len, const char key[4], size_t offset)
+{
+	mask_impl(dst, src, len, key, offset);
+}
+
+int wss_utf8_valid(const char *buf, size_t len)
+{
+	unsigned char state = UTF8_ACCEPT;
+	utf8_impl((char *) buf, len, NULL, 0, &state); /* Not modified, since there's no key */
+	return state == UTF8_ACCEPT;
+}
+
 enum wss_parse_state {
 	WS_PARSE_INITIAL = 0,
 	WS_PARSE_LENGTH,
@@ -82,41 +413,338 @@ struct wss_frame {
 	unsigned int rsv3:1;	/*!< RSV3: 0 unless defined by extension */
 	unsigned int opcode:4;	/*!< Opcode */
 	unsigned int masked:1;	/*!< Masked? (used for data from client to server, only) */
-	unsigned long length;	/*!< Payload length */
+	/* Frame parsing (these fit in the space left by the bit fields) */
+	unsigned char state;	/*!< enum wss_parse_state */
+	unsigned char maxread;	/*!< Number of bytes wanted for the current part of the header */
+	unsigned char datapos;	/*!< Number of bytes of the current part of the header received so far */
 	char key[4];			/*!< Masking key (4 bytes) */
+	unsigned long length;	/*!< Payload length */
 	char *data;
-	/* Frame parsing */
+	size_t datasize;		/*!< Allocated size of data */
+	unsigned long payloadpos;	/*!< Number of bytes of payload received so far */
 	char buf[8];
-	enum wss_parse_state state;
-	unsigned int maxread;
-	unsigned int datapos;
 };
 
+/*! \brief State for receiving fragmented messages, allocated when a client first receives one */
+struct wss_fragstate {
+	struct wss_frame frag;		/*!< Continuation frame currently being read */
+	struct wss_frame stash;		/*!< Partially received message, while a control frame received in the middle of it is returned */
+	char ctlbuf[126];			/*!< Payload of a control frame received in the middle of a message, if payload_buf holds the message */
+};
+
+/*!
+ * \note The fields used for every frame received come first, so that parsing a frame header from
+ *       the receive buffer touches only the first two cache lines, and sending a frame mostly the third.
+ *       Bit fields written by different threads (the reader, a writer, and wss_poll) are kept in separate storage units.
+ *       State only some connections need is allocated separately, when first used.
+ */
 struct wss_client {
-	int rfd;
-	int wfd;
-	void *data;
+	/* Frame parsing */
 	struct wss_frame frame;
+	int rfd;
 	unsigned short int closecode;	/*!< Close code on errors */
-	enum websocket_type type:1; /*!< Server or client? */
+	unsigned char utf8state;	/*!< Validator state for the TEXT message currently being read */
+	unsigned char stashed:1;	/*!< Whether fragstate->stash contains a message */
+	unsigned char pongpending:1;	/*!< A PING has been received but not yet answered */
+	/* Receiving */
+	struct wss_frame *rframe;	/*!< Frame currently being read, if a frame is partially received */
+	void *data;
 	ssize_t (*read_cb)(void *data, char *buf, size_t len);
+	char *rbuf;				/*!< Receive buffer, if enabled and allocated */
+	size_t rbufpos;			/*!< Offset of first unconsumed byte in receive buffer */
+	size_t rbuflen;			/*!< Number of unconsumed bytes in receive buffer */
+	size_t rbufsize;		/*!< Size of receive buffer (0 if disabled) */
+	unsigned long msglength;	/*!< Total payload length of message currently being read */
+	/* Sending */
+	int wfd;
+	/* Settings (only changed while setting up a connection) */
+	enum websocket_type type:1; /*!< Server or client? */
+	unsigned int nonblocking:1;	/*!< Non-blocking mode */
+	unsigned int reuse:1;	/*!< Retain payload buffers between frames */
+	unsigned int utf8:1;		/*!< Validate TEXT payloads */
+	unsigned int autoctl:1;		/*!< Answer PINGs and CLOSEs automatically */
+	unsigned int sendqueue:1;	/*!< Writes are queued, for a single drainer to send */
 	ssize_t (*write_cb)(void *data, const char *buf, size_t len);
+	ssize_t (*writev_cb)(void *data, const struct iovec *iov, int iovcnt);
+	uint64_t prng;				/*!< Masking key generator state (0 until seeded) */
+	struct wss_outbuf *outhead;	/*!< Queue of data that has yet to be written */
+	struct wss_stats *stats;	/*!< Performance counters, if enabled */
+	const struct wss_compression_ops *compress_ops;	/*!< Compression extension, if negotiated */
+	size_t maxfragment;			/*!< Max payload size of frames sent by wss_write (0 for no limit) */
+	unsigned int wmidframe:1;	/*!< The data currently being written ends partway through a frame */
+	unsigned int wpriority:1;	/*!< The frame currently being written should be queued ahead of other data */
+	unsigned int wdroppable:1;	/*!< The frame currently being written may be dropped under backpressure */
+	unsigned int wfragmenting:1;	/*!< Currently sending a message in fragments */
+	unsigned int wstarted:1;	/*!< At least one fragment of the current message has been sent */
+	unsigned int wrsv1:1;		/*!< The message currently being sent in fragments is compressed */
+	int wopcode;				/*!< Opcode of message currently being sent in fragments */
+	struct wss_outbuf *outtail;
+	size_t outbytes;			/*!< Number of bytes in outbound queue */
+	struct wss_watermarks *wm;	/*!< Outbound buffering limits, if set */
+	int overflow;				/*!< enum wss_overflow */
+	unsigned char closesent;	/*!< A CLOSE has been sent (not a bit field, since it's set by whichever thread writes) */
+	unsigned char ponglen;		/*!< Length of pong */
+	/* Everything else */
+	struct wss_fragstate *fragstate;	/*!< Fragmented message state, once one has been received */
+	char *pong;					/*!< Payload of the most recent unanswered PING (125 bytes), once one with a payload has been received */
+	void *compress_ctx;
+	/* Streaming */
+	int (*stream_cb)(void *data, int opcode, const char *buf, size_t len, unsigned long offset, int final_fragment, int final_chunk);
+	unsigned long streampos;	/*!< Number of bytes of message currently being read delivered so far */
+	int (*dest_cb)(void *data, int opcode, unsigned long offset, unsigned long len, const struct iovec **iov, int *iovcnt);
+	const struct iovec *destiov;	/*!< Where the payload of the frame currently being read goes */
+	int destcnt;				/*!< Number of entries in destiov */
+	int destidx;				/*!< Current entry in destiov */
+	size_t destoff;				/*!< Offset into current entry in destiov */
+	/* Payload allocation */
+	void *(*realloc_cb)(void *data, void *ptr, size_t size);
+	void (*free_cb)(void *data, void *ptr);
+	char *payload_buf;		/*!< Application-provided payload buffer, if any */
+	size_t payload_bufsize;	/*!< Size of application-provided payload buffer */
+	char *spare;			/*!< Payload buffer retained for reuse */
+	size_t sparesize;		/*!< Allocated size of spare */
+	size_t sizehint;		/*!< Expected size of fragmented messages */
+	unsigned long fragments;	/*!< Number of continuation frames reassembled */
+	unsigned long reallocs;	/*!< Number of times a reassembly buffer had to be grown */
+	char *wstage;				/*!< Staging buffer for masking outgoing payloads, if not the default */
+	size_t wstagesize;
+	/* Control frames */
+	uint64_t pingsent;			/*!< When the last unanswered PING was sent (ns), or 0 */
+	uint64_t srtt;				/*!< Smoothed round trip time (ns), or 0 */
+	/* Send queue */
+	void (*notify_cb)(void *data);	/*!< Called when the send queue becomes non-empty, if set */
+	struct wss_sendmsg *sendq;	/*!< Queued messages, most recent first */
+	int draining;				/*!< The send queue is currently being drained */
+	int sendqerr;				/*!< Draining the send queue failed */
+	size_t sendqbytes;			/*!< Number of bytes in send queue */
+	/* Readiness sets */
+	size_t (*pending_cb)(void *data);	/*!< Bytes buffered by the application's I/O layer (e.g. TLS) */
+	struct wss_clientset *set;		/*!< Set to which this client belongs, if any */
+	struct wss_client *setnext;	/*!< Next client in set's list of clients with data already buffered */
+	unsigned int setpending:1;	/*!< In set's list of clients with data already buffered */
+	unsigned int setready:1;	/*!< Already returned by the current wss_poll call */
+	struct wss_uclient *uring;	/*!< io_uring state, if using io_uring for I/O */
+};
+
+_Static_assert(offsetof(struct wss_client, rframe) <= 64, "Frame parsing state should fit in the first cache line");
+
+/*! \brief Outbound buffering limits, see wss_set_watermarks */
+struct wss_watermarks {
+	size_t high;
+	size_t low;
+	enum wss_backpressure_policy policy;
+	void (*cb)(void *data, int above);
+	int above;				/*!< Above the high watermark, and not yet back down to the low watermark */
+	int waiters;			/*!< Number of threads waiting for the queue to drain */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/*! \brief Progress of closing a connection whose outbound queue overflowed */
+enum wss_overflow {
+	WS_OVERFLOW_NONE = 0,
+	WS_OVERFLOW_REQUESTED,		/*!< Overflowed, but the CLOSE must wait for the drainer (send queue) or the end of the frame being written */
+	WS_OVERFLOW_CLOSING,		/*!< Sending the CLOSE */
+	WS_OVERFLOW_CLOSED,			/*!< Nothing more may be sent */
+};
+
+/*! \brief A message in a client's send queue */
+struct wss_sendmsg {
+	struct wss_sendmsg *next;
+	struct wss_encoded_frame *encoded;	/*!< Pre-encoded frame, if not a message */
+	int opcode;
+	size_t len;
+	char data[];
+};
+
+#define SENDMSG_BYTES(msg) ((msg)->encoded ? (msg)->encoded->len : (msg)->len)
+
+static void sendq_free(struct wss_sendmsg *msg)
+{
+	while (msg) {
+		struct wss_sendmsg *next = msg->next;
+		if (msg->encoded) {
+			wss_encoded_frame_unref(msg->encoded);
+		}
+		free(msg);
+		msg = next;
+	}
+}
+
+/*! \brief Data queued for writing on a non-blocking connection */
+struct wss_outbuf {
+	struct wss_outbuf *next;
+	size_t len;					/*!< Length of data */
+	size_t pos;					/*!< Bytes of data already written */
+	unsigned int midframe:1;	/*!< Data ends partway through a frame */
+	unsigned int droppable:1;	/*!< Data is a single, complete, uncompressed data message that may be dropped */
+	char data[];
 };
 
+/*! \brief Whether the last I/O operation failed only because it would have blocked */
+#define WS_WOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+
+/*! \brief Whether a frame's payload should be streamed to the application, rather than buffered */
+#define STREAMING(client, frame) ((client->stream_cb || client->dest_cb) && frame->opcode <= WS_OPCODE_BINARY && !client->frame.rsv1)
+
+/*! \brief Whether a frame's payload should be validated as UTF-8 as it is received (compressed messages are validated once inflated) */
+#define VALIDATE_UTF8(client, frame) (client->utf8 && frame->opcode <= WS_OPCODE_BINARY && client->frame.opcode == WS_OPCODE_TEXT && !client->frame.rsv1)
+
+/*! \brief Counters aggregated across all clients with counters enabled */
+static struct wss_stats global_stats;
+
+/*! \brief Increment a performance counter, if counters are enabled for the client */
+#define STAT_ADD(client, field, n) \
+	do { \
+		if (client->stats) { \
+			__atomic_fetch_add(&client->stats->field, (unsigned long long) (n), __ATOMIC_RELAXED); \
+			__atomic_fetch_add(&global_stats.field, (unsigned long long) (n), __ATOMIC_RELAXED); \
+		} \
+	} while (0)
+
+/*! \brief Internal return value for reads that would block */
+#define WS_READ_AGAIN -2
+
+/*! \brief Get the client to which a frame belongs (only valid for the frame embedded in the client) */
+#define frame_client(f) ((struct wss_client *) ((char *) (f) - offsetof(struct wss_client, frame)))
+
+#ifdef WS_IO_URING
+static ssize_t uring_read(struct wss_client *client, char *buf, size_t len);
+static ssize_t uring_writev(struct wss_client *client, const struct iovec *iov, int iovcnt);
+static int uring_poll(struct wss_client *client, int ms);
+static void uring_detach(struct wss_client *client);
+static size_t uring_pending(struct wss_client *client);
+static size_t uring_memory_usage(struct wss_client *client);
+#endif
+
 static ssize_t __read_cb(struct wss_client *client, char *buf, size_t len)
 {
+	ssize_t res;
+
+#ifdef WS_IO_URING
+	if (client->uring) {
+		res = uring_read(client, buf, len);
+	} else
+#endif
 	if (client->read_cb) {
-		return client->read_cb(client->data, buf, len);
+		res = client->read_cb(client->data, buf, len);
+	} else {
+		res = read(client->rfd, buf, len);
+	}
+	if (client->stats) {
+		STAT_ADD(client, reads, 1);
+		if (res < 0 && WS_WOULDBLOCK()) {
+			STAT_ADD(client, eagains, 1);
+		} else if (res > 0 && (size_t) res < len) {
+			STAT_ADD(client, partial_reads, 1);
+		}
+	}
+	return res;
+}
+
+/*! \brief Allocate the receive buffer, if it hasn't been yet (on failure, this fails like a read, with errno ENOMEM) */
+static int rbuf_alloc(struct wss_client *client)
+{
+	if (!client->rbuf) {
+		client->rbuf = malloc(client->rbufsize);
+		if (!client->rbuf) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Read as much data as is available into the (empty) receive buffer */
+static ssize_t rbuf_fill(struct wss_client *client)
+{
+	ssize_t res;
+
+	if (rbuf_alloc(client)) {
+		return -1;
+	}
+	res = __read_cb(client, client->rbuf, client->rbufsize);
+	if (res > 0) {
+		client->rbufpos = 0;
+		client->rbuflen = (size_t) res;
+	}
+	return res;
+}
+
+/*!
+ * \brief Read data from the client, using the receive buffer if one is enabled
+ * \note Like read, this may return fewer bytes than requested
+ */
+static ssize_t client_read(struct wss_client *client, char *buf, size_t len)
+{
+	if (!client->rbufsize) {
+		return __read_cb(client, buf, len);
+	}
+	if (!client->rbuflen) {
+		ssize_t res;
+		if (len >= client->rbufsize) {
+			/* Large read, and nothing buffered. Read directly into the destination, since buffering would only add a copy. */
+			return __read_cb(client, buf, len);
+		}
+		/* Read as much as is available, and serve subsequent reads from the buffer */
+		res = rbuf_fill(client);
+		if (res <= 0) {
+			return res;
+		}
+	}
+	if (len > client->rbuflen) {
+		len = client->rbuflen;
+	}
+	memcpy(buf, client->rbuf + client->rbufpos, len);
+	client->rbufpos += len;
+	client->rbuflen -= len;
+	return (ssize_t) len;
+}
+
+/*! \brief Max number of bytes to coalesce into a single write, if a write callback is used without a writev callback */
+#define WS_COALESCE_SIZE 4096
+
+static ssize_t writev_dispatch(struct wss_client *client, const struct iovec *iov, int iovcnt)
+{
+#ifdef WS_IO_URING
+	if (client->uring) {
+		return uring_writev(client, iov, iovcnt);
+	}
+#endif
+	if (client->writev_cb) {
+		return client->writev_cb(client->data, iov, iovcnt);
+	} else if (client->write_cb) {
+		char buf[WS_COALESCE_SIZE];
+		size_t len = 0;
+		int i;
+		/* Copy small writes into a single buffer, so that e.g. a TLS layer can send them in one record */
+		for (i = 0; i < iovcnt; i++) {
+			if (len + iov[i].iov_len > sizeof(buf)) {
+				break;
+			}
+			if (iov[i].iov_len) {
+				memcpy(buf + len, iov[i].iov_base, iov[i].iov_len); /* iov_base may be NULL for an empty payload */
+				len += iov[i].iov_len;
+			}
+		}
+		if (i == iovcnt) {
+			return client->write_cb(client->data, buf, len);
+		}
+		/* Too large, just write the first chunk, the caller will handle the rest */
+		return client->write_cb(client->data, iov[0].iov_base, iov[0].iov_len);
 	}
-	return read(client->rfd, buf, len);
+	return writev(client->wfd, iov, iovcnt);
 }
 
-static ssize_t __write_cb(struct wss_client *client, const char *buf, size_t len)
+static ssize_t __writev_cb(struct wss_client *client, const struct iovec *iov, int iovcnt)
 {
-	if (client->write_cb) {
-		return client->write_cb(client->data, buf, len);
+	ssize_t res = writev_dispatch(client, iov, iovcnt);
+	if (client->stats) {
+		STAT_ADD(client, writes, 1);
+		if (res < 0 && WS_WOULDBLOCK()) {
+			STAT_ADD(client, eagains, 1);
+		}
 	}
-	return write(client->wfd, buf, len);
+	return res;
 }
 
 void wss_set_client_type(struct wss_client *client, enum websocket_type type)
@@ -130,6 +758,11 @@ void wss_set_io_callbacks(struct wss_client *client, ssize_t (*read_cb)(void *da
 	client->write_cb = write_cb;
 }
 
+void wss_set_writev_callback(struct wss_client *client, ssize_t (*writev_cb)(void *data, const struct iovec *iov, int iovcnt))
+{
+	client->writev_cb = writev_cb;
+}
+
 static const char *opcode_name(int opcode)
 {
 	switch (opcode) {
@@ -151,26 +784,44 @@ const char *wss_frame_name(struct wss_frame *frame)
 static void (*logger_cb)(int level, int bytes, const char *file, const char *function, int line, const char *msg) = NULL;
 static int loglevel = WS_LOG_NONE;
 
+#ifndef WS_MAX_LOG_LEVEL
+/*! \brief Highest log level compiled in. Messages above this compile to nothing (e.g. make WS_MAX_LOG_LEVEL=2 for release builds). */
+#define WS_MAX_LOG_LEVEL 10
+#endif
+
 #define wss_debug(level, fmt, ...) wss_log(level + WS_LOG_DEBUG, fmt, ## __VA_ARGS__)
 
-#define wss_log(level, fmt, ...) __wss_log(level, __FILE__, __func__, __LINE__, fmt, ## __VA_ARGS__)
+/* The level check is inline, so that disabled messages don't cost a call or evaluate their arguments */
+#define wss_log(level, fmt, ...) \
+	do { \
+		if ((level) <= WS_MAX_LOG_LEVEL && __builtin_expect((level) <= loglevel, 0)) { \
+			__wss_log(level, __FILE__, __func__, __LINE__, fmt, ## __VA_ARGS__); \
+		} \
+	} while (0)
+
+/*! \brief Size of the stack buffer used to format log messages. Only longer messages are heap allocated. */
+#define WS_LOG_BUFSIZE 512
 
-static void __attribute__ ((format (printf, 5, 6))) __wss_log(int level, const char *file, const char *function, int line, const char *fmt, ...)
+static void __attribute__ ((format (printf, 5, 6))) __attribute__ ((noinline, cold)) __wss_log(int level, const char *file, const char *function, int line, const char *fmt, ...)
 {
 	va_list ap;
 	int len;
-	char *buf;
-
-	if (level > loglevel) {
-		return;
-	}
+	char stackbuf[WS_LOG_BUFSIZE];
+	char *buf = stackbuf;
 
 	va_start(ap, fmt);
-	len = vasprintf(&buf, fmt, ap);
+	len = vsnprintf(stackbuf, sizeof(stackbuf), fmt, ap);
 	va_end(ap);
 
 	if (len < 0) {
 		return;
+	} else if (len >= (int) sizeof(stackbuf)) {
+		va_start(ap, fmt);
+		len = vasprintf(&buf, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			return;
+		}
 	}
 
 	if (logger_cb) {
@@ -180,7 +831,9 @@ static void __attribute__ ((format (printf, 5, 6))) __wss_log(int level, const c
 		int res = write(STDERR_FILENO, buf, len);
 		(void) res;
 	}
-	free(buf);
+	if (buf != stackbuf) {
+		free(buf);
+	}
 }
 
 void wss_set_logger(void (*logger)(int level, int bytes, const char *file, const char *function, int line, const char *msg))
@@ -193,69 +846,471 @@ void wss_set_log_level(int level)
 	loglevel = level;
 }
 
-static void frame_init(struct wss_frame *frame)
-{
-	memset(frame, 0, sizeof(struct wss_frame));
-	frame->state = WS_PARSE_INITIAL;
-	frame->maxread = 2; /* Max 2 bytes for the first part of the frame */
-	frame->datapos = 0;
-}
+/* Payload pool: freelists of power-of-2 sized blocks, shared by all clients */
+#define WS_POOL_MIN_SHIFT 6 /* Smallest class is 64 bytes */
+#define WS_POOL_CLASSES 15 /* Largest class is 1 MB */
 
-void wss_frame_destroy(struct wss_frame *frame)
+struct pool_block {
+	struct pool_block *next;
+};
+
+static struct payload_pool {
+	pthread_mutex_t lock;
+	struct pool_block *blocks[WS_POOL_CLASSES];
+	size_t retained;		/*!< Bytes currently retained in the pool */
+	size_t max_retained;	/*!< Maximum number of bytes to retain. 0 if pooling disabled. */
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*! \brief Get the pool size class that can fit size bytes, or -1 if too large */
+static int pool_class(size_t size)
 {
-	if (frame->data) {
-		free(frame->data);
-		frame->data = NULL;
+	int c;
+	for (c = 0; c < WS_POOL_CLASSES; c++) {
+		if (size <= ((size_t) 1 << (c + WS_POOL_MIN_SHIFT))) {
+			return c;
+		}
 	}
+	return -1;
 }
 
-void wss_client_destroy(struct wss_client *client)
+/*! \brief Allocate at least size bytes, from the pool if possible */
+static char *pool_alloc(size_t size, size_t *capacity)
 {
-	wss_frame_destroy(&client->frame);
-	free(client);
+	char *buf;
+
+	if (__atomic_load_n(&pool.max_retained, __ATOMIC_RELAXED)) {
+		int c = pool_class(size);
+		if (c >= 0) {
+			size = (size_t) 1 << (c + WS_POOL_MIN_SHIFT);
+			pthread_mutex_lock(&pool.lock);
+			buf = (char *) pool.blocks[c];
+			if (buf) {
+				pool.blocks[c] = pool.blocks[c]->next;
+				pool.retained -= size;
+			}
+			pthread_mutex_unlock(&pool.lock);
+			if (buf) {
+				*capacity = size;
+				return buf;
+			}
+		}
+	}
+	buf = malloc(size);
+	if (buf) {
+		*capacity = size;
+	}
+	return buf;
 }
 
-struct wss_client *wss_client_new(void *data, int rfd, int wfd)
+/*! \brief Return a buffer allocated using pool_alloc to the pool, or free it */
+static void pool_release(char *buf, size_t capacity)
 {
-	/* Since this is a library, the structure shouldn't be stack allocated, for ABI */
-	struct wss_client *client = calloc(1, sizeof(*client));
-	if (client) {
-		client->rfd = rfd;
-		client->wfd = wfd;
-		client->data = data;
+	if (__atomic_load_n(&pool.max_retained, __ATOMIC_RELAXED)) {
+		int c = pool_class(capacity);
+		/* Only blocks that are exactly a class size could have come from the pool */
+		if (c >= 0 && capacity == (size_t) 1 << (c + WS_POOL_MIN_SHIFT)) {
+			struct pool_block *block = (struct pool_block *) buf;
+			pthread_mutex_lock(&pool.lock);
+			if (pool.retained + capacity <= pool.max_retained) {
+				block->next = pool.blocks[c];
+				pool.blocks[c] = block;
+				pool.retained += capacity;
+				buf = NULL;
+			}
+			pthread_mutex_unlock(&pool.lock);
+			if (!buf) {
+				return;
+			}
+		}
 	}
-	return client;
+	free(buf);
 }
 
-#define WS_PARSE_NEXT(consumed, newstate, bytes) \
-	pos += consumed; \
-	res -= consumed; \
-	frame->state = newstate; \
-	frame->maxread = bytes; \
-	frame->datapos = 0; /* Reset */ \
-	if (!res) { \
-		break; \
-	} \
+void wss_set_payload_pool(size_t max_retained)
+{
+	int c;
 
-#define WS_NEED_BYTES(c) \
-	frame->datapos += res; \
-	if (frame->datapos < c) { \
-		/* Incomplete */ \
-		frame->maxread = c - frame->datapos; \
-		wss_debug(4, "Incomplete read (want %d bytes, have %d so far, want %d more\n", c, frame->datapos, frame->maxread); \
-		return 0; \
+	pthread_mutex_lock(&pool.lock);
+	__atomic_store_n(&pool.max_retained, max_retained, __ATOMIC_RELAXED);
+	/* Trim the pool until it's within the new limit */
+	for (c = WS_POOL_CLASSES - 1; c >= 0 && pool.retained > max_retained; c--) {
+		while (pool.blocks[c] && pool.retained > max_retained) {
+			struct pool_block *block = pool.blocks[c];
+			pool.blocks[c] = block->next;
+			pool.retained -= (size_t) 1 << (c + WS_POOL_MIN_SHIFT);
+			free(block);
+		}
 	}
+	pthread_mutex_unlock(&pool.lock);
+}
 
-/*! \note This function is blocking. Precede with poll() if needed */
-static int frame_internal_read(struct wss_client *client, struct wss_frame *frame)
+/*!
+ * \brief Allocate (ptr is NULL) or grow (ptr is not NULL) a payload buffer
+ * \param client
+ * \param ptr Existing buffer, or NULL
+ * \param size Required size
+ * \param[in,out] capacity Allocated size of ptr, updated with the allocated size of the returned buffer
+ */
+static char *payload_realloc(struct wss_client *client, char *ptr, size_t size, size_t *capacity)
 {
-	int res;
+	char *newbuf;
+
+	if (client->payload_buf) {
+		if (size > client->payload_bufsize) {
+			wss_log(WS_LOG_ERROR, "Payload buffer too small (%lu bytes needed, have %lu)\n", size, client->payload_bufsize);
+			client->closecode = WS_CLOSE_LARGE_PAYLOAD;
+			return NULL;
+		}
+		*capacity = client->payload_bufsize;
+		return client->payload_buf;
+	}
+	if (ptr) {
+		if (size <= *capacity) {
+			return ptr; /* Already large enough */
+		}
+		/* Reassembling a fragmented message, and out of room.
+		 * Grow geometrically, so that a message sent in many small fragments doesn't need a realloc (and copy) for each one. */
+		if (size < 2 * *capacity) {
+			size = 2 * *capacity;
+		}
+		client->reallocs++;
+		STAT_ADD(client, reallocs, 1);
+	}
+	if (client->realloc_cb) {
+		newbuf = client->realloc_cb(client->data, ptr, size);
+		if (newbuf) {
+			*capacity = size;
+		}
+	} else if (client->reuse || __atomic_load_n(&pool.max_retained, __ATOMIC_RELAXED)) {
+		size_t want = size, oldcapacity = *capacity;
+		if (!ptr && client->spare) {
+			if (client->sparesize >= size) {
+				/* Reuse the last payload buffer */
+				newbuf = client->spare;
+				*capacity = client->sparesize;
+				client->spare = NULL;
+				return newbuf;
+			}
+			/* Too small. Replace it with one that's at least twice as large. */
+			want = size > 2 * client->sparesize ? size : 2 * client->sparesize;
+			pool_release(client->spare, client->sparesize);
+			client->spare = NULL;
+		}
+		newbuf = pool_alloc(want, capacity);
+		if (newbuf && ptr) {
+			memcpy(newbuf, ptr, oldcapacity);
+			pool_release(ptr, oldcapacity);
+		}
+	} else {
+		newbuf = realloc(ptr, size);
+		if (newbuf) {
+			*capacity = size;
+		}
+	}
+	if (!newbuf) {
+		wss_log(WS_LOG_ERROR, "Failed to allocate %lu bytes for payload\n", size);
+		client->closecode = WS_CLOSE_UNEXPECTED;
+	}
+	return newbuf;
+}
+
+static void payload_free(struct wss_client *client, char *ptr, size_t capacity)
+{
+	if (ptr == client->payload_buf) {
+		return; /* Owned by the application */
+	} else if (client->fragstate && ptr == client->fragstate->ctlbuf) {
+		return;
+	} else if (client->free_cb) {
+		client->free_cb(client->data, ptr);
+	} else if (client->reuse && (!client->spare || capacity > client->sparesize)) {
+		/* Hang onto it for the next frame, keeping whichever buffer is larger */
+		if (client->spare) {
+			pool_release(client->spare, client->sparesize);
+		}
+		client->spare = ptr;
+		client->sparesize = capacity;
+	} else {
+		pool_release(ptr, capacity);
+	}
+}
+
+static void frame_init(struct wss_frame *frame)
+{
+	memset(frame, 0, sizeof(struct wss_frame));
+	frame->state = WS_PARSE_INITIAL;
+	frame->maxread = 2; /* Max 2 bytes for the first part of the frame */
+	frame->datapos = 0;
+}
+
+void wss_frame_destroy(struct wss_frame *frame)
+{
+	if (frame->data) {
+		payload_free(frame_client(frame), frame->data, frame->datasize);
+		frame->data = NULL;
+	}
+}
+
+void wss_client_destroy(struct wss_client *client)
+{
+	wss_frame_destroy(&client->frame);
+	if (client->stashed && client->fragstate->stash.data) {
+		payload_free(client, client->fragstate->stash.data, client->fragstate->stash.datasize);
+	}
+	free(client->fragstate);
+	free(client->pong);
+	while (client->outhead) {
+		struct wss_outbuf *next = client->outhead->next;
+		free(client->outhead);
+		client->outhead = next;
+	}
+	if (client->spare) {
+		pool_release(client->spare, client->sparesize);
+	}
+	if (client->compress_ops && client->compress_ops->destroy) {
+		client->compress_ops->destroy(client->compress_ctx);
+	}
+	if (client->set) {
+		wss_clientset_remove(client->set, client);
+	}
+#ifdef WS_IO_URING
+	if (client->uring) {
+		uring_detach(client);
+	}
+#endif
+	sendq_free(client->sendq);
+	if (client->wm) {
+		pthread_mutex_destroy(&client->wm->lock);
+		pthread_cond_destroy(&client->wm->cond);
+		free(client->wm);
+	}
+	free(client->wstage);
+	free(client->stats);
+	free(client->rbuf);
+	free(client);
+}
+
+struct wss_client *wss_client_new(void *data, int rfd, int wfd)
+{
+	/* Since this is a library, the structure shouldn't be stack allocated, for ABI */
+	struct wss_client *client;
+
+	/* Cache line aligned, so the hot fields at the start share as few lines as possible */
+	if (posix_memalign((void **) &client, 64, sizeof(*client))) {
+		wss_log(WS_LOG_ERROR, "Failed to allocate client\n");
+		return NULL;
+	}
+	memset(client, 0, sizeof(*client));
+	client->rfd = rfd;
+	client->wfd = wfd;
+	client->data = data;
+	return client;
+}
+
+void *wss_client_data(struct wss_client *client)
+{
+	return client->data;
+}
+
+int wss_set_read_buffer(struct wss_client *client, size_t size)
+{
+	char *newbuf;
+
+	if (client->rbuflen > size) {
+		wss_log(WS_LOG_ERROR, "Can't shrink receive buffer to %lu bytes with %lu bytes still pending\n", size, client->rbuflen);
+		return -1;
+	}
+	if (!client->rbuflen) {
+		/* Nothing to carry over, so wait until it's needed */
+		free(client->rbuf);
+		client->rbuf = NULL;
+		client->rbufsize = size;
+		client->rbufpos = 0;
+		return 0;
+	}
+	newbuf = malloc(size);
+	if (!newbuf) {
+		wss_log(WS_LOG_ERROR, "malloc failed\n");
+		return -1;
+	}
+	/* Carry over anything we haven't processed yet */
+	memcpy(newbuf, client->rbuf + client->rbufpos, client->rbuflen);
+	free(client->rbuf);
+	client->rbuf = newbuf;
+	client->rbufsize = size;
+	client->rbufpos = 0;
+	return 0;
+}
+
+size_t wss_read_pending(struct wss_client *client)
+{
+	size_t pending = client->rbuflen + (client->pending_cb ? client->pending_cb(client->data) : 0);
+#ifdef WS_IO_URING
+	if (client->uring) {
+		pending += uring_pending(client);
+	}
+#endif
+	return pending;
+}
+
+void wss_set_pending_callback(struct wss_client *client, size_t (*pending_cb)(void *data))
+{
+	client->pending_cb = pending_cb;
+}
+
+void wss_set_payload_allocator(struct wss_client *client, void *(*realloc_cb)(void *data, void *ptr, size_t size), void (*free_cb)(void *data, void *ptr))
+{
+	client->realloc_cb = realloc_cb;
+	client->free_cb = free_cb;
+}
+
+void wss_set_stream_callback(struct wss_client *client, int (*stream_cb)(void *data, int opcode, const char *buf, size_t len, unsigned long offset, int final_fragment, int final_chunk))
+{
+	client->stream_cb = stream_cb;
+}
+
+void wss_set_payload_destination(struct wss_client *client, int (*dest_cb)(void *data, int opcode, unsigned long offset, unsigned long len, const struct iovec **iov, int *iovcnt))
+{
+	client->dest_cb = dest_cb;
+}
+
+void wss_set_nonblocking(struct wss_client *client, int nonblocking)
+{
+	client->nonblocking = nonblocking ? 1 : 0;
+}
+
+void wss_set_payload_reuse(struct wss_client *client, int reuse)
+{
+	client->reuse = reuse ? 1 : 0;
+	if (!reuse && client->spare) {
+		pool_release(client->spare, client->sparesize);
+		client->spare = NULL;
+	}
+}
+
+void wss_set_message_size_hint(struct wss_client *client, size_t size)
+{
+	client->sizehint = size;
+}
+
+void wss_reassembly_counters(struct wss_client *client, unsigned long *fragments, unsigned long *reallocs)
+{
+	*fragments = client->fragments;
+	*reallocs = client->reallocs;
+}
+
+void wss_set_compression(struct wss_client *client, const struct wss_compression_ops *ops, void *ctx)
+{
+	client->compress_ops = ops;
+	client->compress_ctx = ctx;
+}
+
+int wss_enable_stats(struct wss_client *client, int enable)
+{
+	if (enable && !client->stats) {
+		client->stats = calloc(1, sizeof(*client->stats));
+		if (!client->stats) {
+			wss_log(WS_LOG_ERROR, "calloc failed\n");
+			return -1;
+		}
+	} else if (!enable && client->stats) {
+		free(client->stats);
+		client->stats = NULL;
+	}
+	return 0;
+}
+
+/*! \brief Copy counters that may be concurrently updated */
+static void stats_snapshot(struct wss_stats *dst, struct wss_stats *src)
+{
+	unsigned long long *d = (unsigned long long *) dst, *s = (unsigned long long *) src;
+	size_t i;
+
+	for (i = 0; i < sizeof(*dst) / sizeof(*d); i++) {
+		d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+	}
+}
+
+int wss_client_stats(struct wss_client *client, struct wss_stats *stats)
+{
+	if (!client->stats) {
+		return -1;
+	}
+	stats_snapshot(stats, client->stats);
+	return 0;
+}
+
+void wss_global_stats(struct wss_stats *stats)
+{
+	stats_snapshot(stats, &global_stats);
+}
+
+void wss_set_auto_control(struct wss_client *client, int enable)
+{
+	client->autoctl = enable ? 1 : 0;
+}
+
+unsigned long wss_rtt(struct wss_client *client)
+{
+	return (unsigned long) (client->srtt / 1000);
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void wss_set_utf8_validation(struct wss_client *client, int validate)
+{
+	client->utf8 = validate ? 1 : 0;
+}
+
+void *wss_compression_context(struct wss_client *client, const struct wss_compression_ops *ops)
+{
+	return client->compress_ops == ops ? client->compress_ctx : NULL;
+}
+
+void wss_set_payload_buffer(struct wss_client *client, char *buf, size_t size)
+{
+	client->payload_buf = buf;
+	client->payload_bufsize = buf ? size : 0;
+}
+
+#define WS_PARSE_NEXT(consumed, newstate, bytes) \
+	pos += consumed; \
+	res -= consumed; \
+	frame->state = newstate; \
+	frame->maxread = bytes; \
+	frame->datapos = 0; /* Reset */ \
+	if (!res) { \
+		break; \
+	} \
+
+#define WS_NEED_BYTES(c) \
+	frame->datapos += res; \
+	if (frame->datapos < c) { \
+		/* Incomplete */ \
+		frame->maxread = c - frame->datapos; \
+		wss_debug(4, "Incomplete read (want %d bytes, have %d so far, want %d more\n", c, frame->datapos, frame->maxread); \
+		return 0; \
+	}
+
+/*! \note This function is blocking. Precede with poll() if needed */
+static int frame_internal_read(struct wss_client *client, struct wss_frame *frame)
+{
+	int res;
 	int pos = 0;
 
 	/* Assume that some amount of data is available and read will at least return immediately. */
 	assert(frame->maxread <= sizeof(frame->buf) - frame->datapos); /* or buffer overflow */
-	res = __read_cb(client, frame->buf + frame->datapos, frame->maxread);
+	res = client_read(client, frame->buf + frame->datapos, frame->maxread);
 	if (res <= 0) {
+		if (res < 0 && client->nonblocking && WS_WOULDBLOCK()) {
+			return WS_READ_AGAIN; /* Nothing available yet. We pick up where we left off next time. */
+		}
 		wss_debug(1, "WebSocket client read returned %d: %s\n", res, strerror(errno));
 		return -1;
 	}
@@ -269,10 +1324,11 @@ static int frame_internal_read(struct wss_client *client, struct wss_frame *fram
 			frame->rsv1 = (frame->buf[pos] & BIT1) == BIT1;
 			frame->rsv2 = (frame->buf[pos] & BIT2) == BIT2;
 			frame->rsv3 = (frame->buf[pos] & BIT3) == BIT3;
-			if (frame->rsv1 || frame->rsv2 || frame->rsv3) {
+			/* RSV1 indicates a compressed message, if compression was negotiated. Nothing uses RSV2 or RSV3. */
+			if ((frame->rsv1 && !client->compress_ops) || frame->rsv2 || frame->rsv3) {
 				wss_log(WS_LOG_ERROR, "RSV bit(s) must be low\n");
 				client->closecode = WS_CLOSE_PROTOCOL_ERROR;
-				return 1;
+				return -1;
 			}
 			frame->opcode = frame->buf[pos] & 0x0f; /* Lower half of the byte */
 			if (!WS_OPCODE_VALID(frame->opcode)) {
@@ -307,7 +1363,7 @@ static int frame_internal_read(struct wss_client *client, struct wss_frame *fram
 			} else {
 				/* We're done, that is the length */
 				if (frame->masked) {
-					WS_PARSE_NEXT(1, WS_PARSE_MASK, 1);
+					WS_PARSE_NEXT(1, WS_PARSE_MASK, 4);
 				} else {
 					WS_PARSE_NEXT(1, WS_PARSE_PAYLOAD, frame->length);
 				}
@@ -359,243 +1415,3542 @@ static int frame_internal_read(struct wss_client *client, struct wss_frame *fram
 	return 0;
 }
 
-static int read_payload(struct wss_client *client, struct wss_frame *frame)
+/*! \brief Allocate memory for a frame's payload, once its header has been received */
+static int payload_start(struct wss_client *client, struct wss_frame *frame)
 {
-	unsigned long already = 0;
 	unsigned long length = frame->length;
+	char *buf;
 
 	if (frame->opcode == WS_OPCODE_CONTINUE) {
-		char *newbuf = realloc(client->frame.data, client->frame.length + length + 1);
+		/* Append to the payload of the first frame in the message */
+		char *newbuf = payload_realloc(client, client->frame.data, client->frame.length + length + 1, &client->frame.datasize);
 		if (!newbuf) {
-			free(client->frame.data);
-			wss_log(WS_LOG_ERROR, "realloc failed\n");
-			client->closecode = WS_CLOSE_UNEXPECTED;
 			return -1;
 		}
 		client->frame.data = newbuf;
+		buf = newbuf + client->frame.length;
 		client->frame.length += length;
+		client->fragments++;
+		STAT_ADD(client, fragments, 1);
 	} else {
-		frame->data = malloc(length + 1); /* If it's text, make it null terminated */
+		size_t size = length + 1; /* If it's text, make it null terminated */
+		if (client->payload_buf && frame != &client->frame) {
+			/* Control frame in the middle of a message. The application's buffer already holds the first part of the message. */
+			frame->data = client->fragstate->ctlbuf;
+			frame->datasize = sizeof(client->fragstate->ctlbuf);
+			frame->data[length] = '\0'; /* Control frames are at most 125 bytes, checked by read_frame */
+			return 0;
+		}
+		if (!frame->fin && frame->opcode <= WS_OPCODE_BINARY && client->sizehint >= size) {
+			/* Start of a fragmented message. Allocate enough for the whole thing up front, if we have an idea how large it'll be. */
+			size = client->sizehint + 1;
+		}
+		frame->data = payload_realloc(client, NULL, size, &frame->datasize);
+		if (!frame->data) {
+			return -1;
+		}
+		buf = frame->data;
 	}
-	client->frame.data[client->frame.length] = '\0'; /* For text payloads, null terminate. Don't subtract 1, the buffer is already +1 larger. */
-	if (!frame->data) {
-		wss_log(WS_LOG_ERROR, "malloc failed\n");
-		client->closecode = WS_CLOSE_UNEXPECTED;
-		return -1;
+	buf[length] = '\0'; /* For text payloads, null terminate. Don't subtract 1, the buffer is already +1 larger. */
+	return 0;
+}
+
+/*!
+ * \brief Unmask (if needed) and validate (if enabled) a chunk of a frame's payload that was just received, in place
+ * \param client
+ * \param frame
+ * \param buf
+ * \param len Length of chunk. 0 to only check that the message doesn't end in the middle of a character.
+ * \param pos Offset of the chunk in the frame's payload
+ * \retval 0 on success, -1 if the payload is invalid
+ */
+static int payload_unmask(struct wss_client *client, struct wss_frame *frame, char *buf, size_t len, unsigned long pos)
+{
+	/* The offset takes care of keeping the key in phase between reads. */
+	if (VALIDATE_UTF8(client, frame)) {
+		utf8_impl(buf, len, client->frame.masked ? frame->key : NULL, pos, &client->utf8state);
+		if (client->frame.masked) {
+			STAT_ADD(client, bytes_masked, len);
+		}
+		if (client->utf8state == UTF8_REJECT || (frame->fin && pos + len == frame->length && client->utf8state != UTF8_ACCEPT)) {
+			wss_log(WS_LOG_ERROR, "Invalid UTF-8 in TEXT message\n");
+			client->closecode = WS_CLOSE_DATA_INCONSISTENT;
+			return -1;
+		}
+	} else if (client->frame.masked) {
+		wss_mask(buf, buf, len, frame->key, pos);
+		STAT_ADD(client, bytes_masked, len);
 	}
-	while (length > 0) {
-		unsigned long i = already;
-		int res = __read_cb(client, frame->data + already, length);
+	return 0;
+}
+
+/*!
+ * \brief Read as much of a frame's payload as possible
+ * \retval 0 if the entire payload has been received, WS_READ_AGAIN if more is needed (non-blocking mode), -1 on failure
+ */
+static int read_payload(struct wss_client *client, struct wss_frame *frame)
+{
+	/* Where this frame's payload goes (for continuation frames, it's appended to the first frame's payload) */
+	char *buf = frame->opcode == WS_OPCODE_CONTINUE ? client->frame.data + client->frame.length - frame->length : frame->data;
+
+	while (frame->payloadpos < frame->length) {
+		unsigned long pos = frame->payloadpos;
+		int res = client_read(client, buf + pos, frame->length - pos);
 		if (res <= 0) {
+			if (res < 0 && client->nonblocking && WS_WOULDBLOCK()) {
+				wss_debug(4, "Partial payload received (%lu/%lu bytes so far)\n", pos, frame->length);
+				return WS_READ_AGAIN;
+			}
 			wss_debug(1, "WebSocket client read returned %d: %s\n", res, strerror(errno));
 			client->closecode = WS_CLOSE_PROTOCOL_ERROR;
 			return -1;
 		}
-		already += res;
-		length -= res;
-		/* Unmask the data received */
-		if (client->frame.masked) {
-			for (; i < already; i++) {
-				frame->data[i] = frame->data[i] ^ frame->key[i % 4];
-			}
+		if (payload_unmask(client, frame, buf + pos, (size_t) res, pos)) {
+			return -1;
 		}
+		frame->payloadpos += (unsigned long) res;
 	}
 	return 0;
 }
 
-int wss_read(struct wss_client *client, int pollms, int ready)
+/*! \brief Ask the application where a frame's payload should go */
+static int dest_start(struct wss_client *client, struct wss_frame *frame)
 {
-	int res;
-	struct pollfd pfd;
-	struct wss_frame *frame, frame2;
-	unsigned long full_length = 0;
+	size_t total = 0;
+	int i;
 
-	memset(&pfd, 0, sizeof(pfd));
-	pfd.fd = client->rfd;
-	pfd.events = POLLIN;
+	client->destiov = NULL;
+	client->destcnt = 0;
+	if (client->dest_cb(client->data, client->frame.opcode, client->streampos, frame->length, &client->destiov, &client->destcnt)) {
+		wss_debug(1, "Destination callback aborted frame\n");
+		client->closecode = WS_CLOSE_UNEXPECTED;
+		return -1;
+	}
+	for (i = 0; i < client->destcnt; i++) {
+		total += client->destiov[i].iov_len;
+	}
+	if (total < frame->length) {
+		wss_log(WS_LOG_ERROR, "Payload destination too small (%lu bytes needed, have %lu)\n", frame->length, total);
+		client->closecode = WS_CLOSE_LARGE_PAYLOAD;
+		return -1;
+	}
+	client->destidx = 0;
+	client->destoff = 0;
+	return 0;
+}
 
-	frame_init(&client->frame);
-	frame = &client->frame;
+/*!
+ * \brief Copy a chunk of a frame's payload to the application's destination, unmasking it on the way
+ * \param client
+ * \param frame
+ * \param buf Chunk of payload, as received (still masked)
+ * \param len
+ * \param pos Offset of the chunk in the frame's payload
+ */
+static int dest_copy(struct wss_client *client, struct wss_frame *frame, char *buf, size_t len, unsigned long pos)
+{
+	int validate = VALIDATE_UTF8(client, frame);
 
-	for (;;) {
-		/* Connections must make progress. */
-		pfd.revents = 0;
-		if (ready) {
-			/* If calling application knows data is available on this fd, skip the first poll */
-			ready = 0;
-		} else if (!client->read_cb) { /* If there's a read callback, further data might be buffered (e.g. TLS) */
-			res = poll(&pfd, 1, frame->state == WS_PARSE_INITIAL ? pollms : 1000);
-			if (res <= 0) {
-				wss_debug(1, "WebSocket client poll returned %d (%s)\n", res, strerror(errno));
-				if (frame->state != WS_PARSE_INITIAL) {
-					wss_log(WS_LOG_ERROR, "Partial WebSocket frame received (discarding)\n"); /* Possible parsing issue? */
-					client->closecode = WS_CLOSE_PROTOCOL_ERROR;
-				}
-				break;
-			}
+	if (validate && payload_unmask(client, frame, buf, len, pos)) {
+		return -1; /* Validation is fused with unmasking, so do that in place first. It's still hot in cache for the copy. */
+	}
+	while (len) {
+		const struct iovec *iov = &client->destiov[client->destidx];
+		char *dst = (char *) iov->iov_base + client->destoff;
+		size_t n = iov->iov_len - client->destoff;
+		if (n > len) {
+			n = len;
 		}
-		res = frame_internal_read(client, frame);
-		if (res) {
-			break;
-		} else if (frame->state == WS_PARSE_PAYLOAD) {
-			/* End of frame_internal_read loop. Read the payload now. */
-			full_length += frame->length;
-			if (full_length > WS_MAX_PAYLOAD_LENGTH) {
-				wss_log(WS_LOG_ERROR, "Payload length (%lu) exceeds max allowed (%u)\n", full_length, WS_MAX_PAYLOAD_LENGTH);
-				client->closecode = WS_CLOSE_LARGE_PAYLOAD;
-				return -1;
-			}
-			if (frame->length) {
-				res = read_payload(client, frame);
-				if (res < 0) {
-					wss_log(WS_LOG_ERROR, "Partial WebSocket frame received? (length supposed to be %lu)\n", frame->length);
-					client->closecode = WS_CLOSE_PROTOCOL_ERROR;
-					return -1;
-				}
-			}
-			wss_debug(3, "WebSocket %s frame received (length %lu)\n", wss_frame_name(frame), frame->length);
-			if (!frame->fin && (frame->opcode == WS_OPCODE_TEXT || frame->opcode == WS_OPCODE_BINARY)) {
-				/* The next frame will have more data. Read into the temp frame. */
-				frame_init(&frame2);
-				frame = &frame2;
-				continue;
-			}
-			res = 1;
-			break; /* Return finalized frame to the application */
+		if (client->frame.masked && !validate) {
+			wss_mask(dst, buf, n, frame->key, pos);
+			STAT_ADD(client, bytes_masked, n);
+		} else {
+			memcpy(dst, buf, n);
+		}
+		buf += n;
+		len -= n;
+		pos += n;
+		client->destoff += n;
+		if (client->destoff == iov->iov_len) {
+			client->destidx++;
+			client->destoff = 0;
 		}
 	}
-	return res;
+	return 0;
 }
 
-struct wss_frame *wss_client_frame(struct wss_client *client)
+/*!
+ * \brief Deliver as much of a frame's payload as possible to the application's stream callback (or destination)
+ * \retval 0 if the entire payload has been delivered, WS_READ_AGAIN if more is needed (non-blocking mode), -1 on failure
+ */
+static int stream_payload(struct wss_client *client, struct wss_frame *frame)
 {
-	return &client->frame;
-}
+	char chunk[8192];
+	int opcode = client->frame.opcode; /* Opcode of the message, not the frame */
 
-int wss_frame_opcode(struct wss_frame *frame)
-{
+	if (!frame->length) {
+		/* Nothing to deliver, unless this is the end of the message */
+		if (payload_unmask(client, frame, NULL, 0, 0)) {
+			return -1;
+		}
+		if (frame->fin && client->stream_cb && client->stream_cb(client->data, opcode, NULL, 0, client->streampos, 1, 1)) {
+			client->closecode = WS_CLOSE_UNEXPECTED;
+			return -1;
+		}
+		return 0;
+	}
+
+	while (frame->payloadpos < frame->length) {
+		unsigned long pos = frame->payloadpos;
+		size_t len = frame->length - pos;
+		char *buf;
+		if (client->rbufsize) {
+			/* Deliver straight out of the receive buffer, rather than copying */
+			if (!client->rbuflen) {
+				ssize_t res = rbuf_fill(client);
+				if (res <= 0) {
+					if (res < 0 && client->nonblocking && WS_WOULDBLOCK()) {
+						return WS_READ_AGAIN;
+					}
+					wss_debug(1, "WebSocket client read returned %d: %s\n", (int) res, strerror(errno));
+					client->closecode = WS_CLOSE_PROTOCOL_ERROR;
+					return -1;
+				}
+			}
+			buf = client->rbuf + client->rbufpos;
+			if (len > client->rbuflen) {
+				len = client->rbuflen;
+			}
+			client->rbufpos += len;
+			client->rbuflen -= len;
+		} else {
+			ssize_t res = __read_cb(client, chunk, len > sizeof(chunk) ? sizeof(chunk) : len);
+			if (res <= 0) {
+				if (res < 0 && client->nonblocking && WS_WOULDBLOCK()) {
+					return WS_READ_AGAIN;
+				}
+				wss_debug(1, "WebSocket client read returned %d: %s\n", (int) res, strerror(errno));
+				client->closecode = WS_CLOSE_PROTOCOL_ERROR;
+				return -1;
+			}
+			buf = chunk;
+			len = (size_t) res;
+		}
+		if (client->dest_cb) {
+			/* Staged in the receive buffer (or chunk), and unmasked while copying to the final destination */
+			if (dest_copy(client, frame, buf, len, pos)) {
+				return -1;
+			}
+			frame->payloadpos += len;
+			client->streampos += len;
+			continue;
+		}
+		if (payload_unmask(client, frame, buf, len, pos)) {
+			return -1;
+		}
+		frame->payloadpos += len;
+		if (client->stream_cb(client->data, opcode, buf, len, client->streampos, frame->fin, frame->payloadpos == frame->length)) {
+			wss_debug(1, "Stream callback aborted frame\n");
+			client->closecode = WS_CLOSE_UNEXPECTED;
+			return -1;
+		}
+		client->streampos += len;
+	}
+	return 0;
+}
+
+/*! \brief Replace the payload of a complete compressed message with the decompressed payload */
+static int decompress_payload(struct wss_client *client)
+{
+	struct wss_frame *frame = &client->frame;
+	char *out;
+	size_t outlen;
+	int res;
+
+	res = client->compress_ops->decompress(client->compress_ctx, frame->data ? frame->data : "", frame->length, &out, &outlen, WS_MAX_PAYLOAD_LENGTH);
+	if (res) {
+		if (res > 0) {
+			wss_log(WS_LOG_ERROR, "Decompressed payload length exceeds max allowed (%u)\n", WS_MAX_PAYLOAD_LENGTH);
+			client->closecode = WS_CLOSE_LARGE_PAYLOAD;
+		} else {
+			wss_log(WS_LOG_ERROR, "Failed to decompress %lu-byte payload\n", frame->length);
+			client->closecode = WS_CLOSE_DATA_INCONSISTENT;
+		}
+		return -1;
+	}
+	wss_debug(4, "Decompressed %lu-byte payload to %lu bytes\n", frame->length, outlen);
+	if (frame->data) {
+		payload_free(client, frame->data, frame->datasize);
+	}
+	if (!client->payload_buf && !client->realloc_cb) {
+		/* Default allocator, so the decompressed buffer can be used as is */
+		frame->data = out;
+		frame->datasize = outlen + 1;
+	} else {
+		frame->data = payload_realloc(client, NULL, outlen + 1, &frame->datasize);
+		if (!frame->data) {
+			free(out);
+			return -1;
+		}
+		memcpy(frame->data, out, outlen);
+		free(out);
+	}
+	frame->data[outlen] = '\0';
+	frame->length = outlen;
+	frame->rsv1 = 0;
+	if (client->utf8 && frame->opcode == WS_OPCODE_TEXT && !wss_utf8_valid(frame->data, outlen)) {
+		wss_log(WS_LOG_ERROR, "Invalid UTF-8 in TEXT message\n");
+		client->closecode = WS_CLOSE_DATA_INCONSISTENT;
+		return -1;
+	}
+	return 0;
+}
+
+static int wss_frame_write(struct wss_client *client, int opcode, const char *payload, size_t len, int fin, int rsv1, int inplace);
+static int sendq_push(struct wss_client *client, struct wss_encoded_frame *encoded, int opcode, const char *payload, size_t len);
+static int sendq_kick(struct wss_client *client, int notify);
+static int sendq_add(struct wss_client *client, struct wss_encoded_frame *encoded, int opcode, const char *payload, size_t len);
+
+/*! \brief Answer the most recent PING received */
+static int send_pong(struct wss_client *client)
+{
+	int res;
+
+	client->pongpending = 0;
+	if (client->sendqueue) {
+		return sendq_add(client, NULL, WS_OPCODE_PONG, client->pong, client->ponglen); /* The drainer sends these first */
+	}
+	client->wpriority = 1; /* Don't make it wait behind queued data */
+	res = wss_frame_write(client, WS_OPCODE_PONG, client->pong, client->ponglen, 1, 0, 1);
+	client->wpriority = 0;
+	return res;
+}
+
+/*!
+ * \brief Handle a control frame that was just received
+ * \retval 1 if the frame was consumed, 0 if it should be returned to the application, -1 on failure
+ */
+static int control_frame(struct wss_client *client, struct wss_frame *frame)
+{
+	uint64_t pingsent = __atomic_load_n(&client->pingsent, __ATOMIC_RELAXED);
+
+	if (frame->opcode == WS_OPCODE_PONG && pingsent) {
+		uint64_t sample = monotonic_ns() - pingsent;
+		/* Same smoothing as TCP (RFC 6298) */
+		client->srtt = client->srtt ? client->srtt - client->srtt / 8 + sample / 8 : sample;
+		__atomic_store_n(&client->pingsent, 0, __ATOMIC_RELAXED);
+		wss_debug(4, "Round trip time now %lu us\n", (unsigned long) (client->srtt / 1000));
+		return 0;
+	} else if (!client->autoctl) {
+		return 0;
+	} else if (frame->opcode == WS_OPCODE_PING) {
+		/* Only answer once we've caught up, in case more PINGs are already waiting */
+		if (frame->length) {
+			if (!client->pong) {
+				client->pong = malloc(125);
+				if (!client->pong) {
+					wss_log(WS_LOG_ERROR, "malloc failed\n");
+					return -1;
+				}
+			}
+			memcpy(client->pong, frame->data, frame->length);
+			payload_free(client, frame->data, frame->datasize);
+			frame->data = NULL;
+		}
+		client->ponglen = (unsigned char) frame->length;
+		client->pongpending = !client->closesent; /* Nothing more to say once we've sent a CLOSE */
+		return 1;
+	} else if (frame->opcode == WS_OPCODE_CLOSE && !client->closesent) {
+		/* Echo the status code (or lack thereof) */
+		size_t len = frame->length >= 2 ? 2 : 0;
+		wss_debug(2, "Echoing CLOSE frame\n");
+		if (client->sendqueue ? sendq_add(client, NULL, WS_OPCODE_CLOSE, frame->data, len) : wss_frame_write(client, WS_OPCODE_CLOSE, frame->data, len, 1, 0, 0)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Wait for data from a client, like poll */
+static int client_poll(struct wss_client *client, struct pollfd *pfd, int ms)
+{
+#ifdef WS_IO_URING
+	if (client->uring) {
+		return uring_poll(client, ms);
+	}
+#endif
+	return poll(pfd, 1, ms);
+}
+
+static int read_frame(struct wss_client *client, int pollms, int ready)
+{
+	int res;
+	struct pollfd pfd;
+	struct wss_frame *frame;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = client->rfd;
+	pfd.events = POLLIN;
+
+	if (client->stashed) {
+		/* A control frame was received in the middle of a fragmented message. Now, resume the message. */
+		memcpy(&client->frame, &client->fragstate->stash, sizeof(client->frame));
+		client->stashed = 0;
+		frame_init(&client->fragstate->frag);
+		client->rframe = &client->fragstate->frag;
+	} else if (!client->rframe) {
+		/* Start of a new frame (otherwise, resume the one in progress) */
+		frame_init(&client->frame);
+		client->msglength = 0;
+		client->streampos = 0;
+		client->utf8state = UTF8_ACCEPT;
+		client->rframe = &client->frame;
+	}
+	frame = client->rframe;
+
+	for (;;) {
+		/* Connections must make progress. */
+		pfd.revents = 0;
+		if (client->pongpending && !client->rbuflen && send_pong(client)) {
+			res = -1; /* Nothing else buffered, so answer before waiting for more */
+			break;
+		}
+		if (ready) {
+			/* If calling application knows data is available on this fd, skip the first poll */
+			ready = 0;
+		} else if (client->nonblocking) {
+			/* Just try to read, the application is responsible for waiting for activity */
+		} else if (client->rbuflen) {
+			/* Data is already buffered, no need to poll */
+		} else if (!client->read_cb || (client->pending_cb && client->rfd >= 0 && !client->pending_cb(client->data))) {
+			/* If there's a read callback, further data might be buffered (e.g. TLS), unless we can ask */
+			if (client->stats) {
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				res = client_poll(client, &pfd, frame->state == WS_PARSE_INITIAL ? pollms : 1000);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				STAT_ADD(client, polls, 1);
+				STAT_ADD(client, poll_ns, (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+			} else {
+				res = client_poll(client, &pfd, frame->state == WS_PARSE_INITIAL ? pollms : 1000);
+			}
+			if (res <= 0) {
+				wss_debug(1, "WebSocket client poll returned %d (%s)\n", res, strerror(errno));
+				if (frame->state != WS_PARSE_INITIAL) {
+					wss_log(WS_LOG_ERROR, "Partial WebSocket frame received (discarding)\n"); /* Possible parsing issue? */
+					client->closecode = WS_CLOSE_PROTOCOL_ERROR;
+				}
+				break;
+			}
+		}
+		if (frame->state != WS_PARSE_PAYLOAD) {
+			res = frame_internal_read(client, frame);
+			if (res == WS_READ_AGAIN) {
+				return 0; /* Frame is incomplete, return without resetting it */
+			} else if (res) {
+				break;
+			} else if (frame->state != WS_PARSE_PAYLOAD) {
+				continue;
+			}
+			/* End of frame_internal_read loop. Read the payload now. */
+			if (frame->opcode <= WS_OPCODE_BINARY && (frame->opcode == WS_OPCODE_CONTINUE) != (frame != &client->frame)) {
+				/* CONTINUE frames (and only CONTINUE frames) must follow a non-final data frame */
+				wss_log(WS_LOG_ERROR, "Unexpected %s frame\n", wss_frame_name(frame));
+				client->closecode = WS_CLOSE_PROTOCOL_ERROR;
+				res = -1;
+				break;
+			}
+			if (frame->rsv1 && (frame->opcode == WS_OPCODE_CONTINUE || frame->opcode >= WS_OPCODE_CLOSE)) {
+				/* Only the first frame of a data message indicates compression */
+				wss_log(WS_LOG_ERROR, "RSV1 must not be set on %s frames\n", wss_frame_name(frame));
+				client->closecode = WS_CLOSE_PROTOCOL_ERROR;
+				res = -1;
+				break;
+			}
+			if (frame->opcode >= WS_OPCODE_CLOSE && (!frame->fin || frame->length > 125)) {
+				wss_log(WS_LOG_ERROR, "Control frames must not be fragmented and must have a payload of at most 125 bytes\n");
+				client->closecode = WS_CLOSE_PROTOCOL_ERROR;
+				res = -1;
+				break;
+			}
+			if (frame->opcode <= WS_OPCODE_BINARY) {
+				client->msglength += frame->length;
+			}
+			if (STREAMING(client, frame)) {
+				/* No limit on streamed payloads, since they're not buffered */
+				if (frame != &client->frame) {
+					client->frame.length += frame->length;
+				}
+				if (client->dest_cb && frame->length && dest_start(client, frame)) {
+					res = -1;
+					break;
+				}
+			} else if (client->msglength > WS_MAX_PAYLOAD_LENGTH) {
+				wss_log(WS_LOG_ERROR, "Payload length (%lu) exceeds max allowed (%u)\n", client->msglength, WS_MAX_PAYLOAD_LENGTH);
+				client->closecode = WS_CLOSE_LARGE_PAYLOAD;
+				res = -1;
+				break;
+			} else if (frame->length && payload_start(client, frame)) {
+				res = -1;
+				break;
+			}
+		}
+		if (STREAMING(client, frame)) {
+			res = stream_payload(client, frame);
+			if (res == WS_READ_AGAIN) {
+				return 0; /* Resume streaming the payload next time */
+			} else if (res < 0) {
+				break;
+			}
+		} else if (frame->length) {
+			res = read_payload(client, frame);
+			if (res == WS_READ_AGAIN) {
+				return 0; /* Resume reading the payload next time */
+			} else if (res < 0) {
+				wss_log(WS_LOG_ERROR, "Partial WebSocket frame received? (length supposed to be %lu)\n", frame->length);
+				if (!client->closecode) {
+					client->closecode = WS_CLOSE_PROTOCOL_ERROR;
+				}
+				break;
+			}
+		} else if (payload_unmask(client, frame, NULL, 0, 0)) {
+			res = -1; /* Empty final fragment, after an incomplete character */
+			break;
+		}
+		wss_debug(3, "WebSocket %s frame received (length %lu)\n", wss_frame_name(frame), frame->length);
+		STAT_ADD(client, frames_in[frame->opcode], 1);
+		STAT_ADD(client, bytes_in[frame->opcode], frame->length);
+		if (!frame->fin && frame->opcode <= WS_OPCODE_BINARY) {
+			/* The next frame will have more data. Read into the temp frame. */
+			if (!client->fragstate) {
+				client->fragstate = malloc(sizeof(*client->fragstate));
+				if (!client->fragstate) {
+					wss_log(WS_LOG_ERROR, "malloc failed\n");
+					res = -1;
+					break;
+				}
+			}
+			frame_init(&client->fragstate->frag);
+			frame = client->rframe = &client->fragstate->frag;
+			continue;
+		} else if (frame != &client->frame && frame->opcode >= WS_OPCODE_CLOSE) {
+			/* Control frame in the middle of a fragmented message.
+			 * Set the message aside and return the control frame now. */
+			memcpy(&client->fragstate->stash, &client->frame, sizeof(client->fragstate->stash));
+			memcpy(&client->frame, &client->fragstate->frag, sizeof(client->frame));
+			client->stashed = 1;
+		} else if (client->frame.rsv1 && decompress_payload(client)) {
+			res = -1;
+			break;
+		}
+		if (client->utf8 && client->frame.opcode == WS_OPCODE_CLOSE && client->frame.length > 2 && !wss_utf8_valid(client->frame.data + 2, client->frame.length - 2)) {
+			wss_log(WS_LOG_ERROR, "Invalid UTF-8 in close reason\n");
+			client->closecode = WS_CLOSE_DATA_INCONSISTENT;
+			res = -1;
+			break;
+		}
+		if (frame->opcode >= WS_OPCODE_CLOSE) {
+			res = control_frame(client, frame);
+			if (res < 0) {
+				break;
+			} else if (res) {
+				/* Consumed, move on to the next frame */
+				if (client->stashed) {
+					memcpy(&client->frame, &client->fragstate->stash, sizeof(client->frame));
+					client->stashed = 0;
+					frame_init(&client->fragstate->frag);
+					frame = client->rframe = &client->fragstate->frag;
+				} else {
+					frame_init(&client->frame);
+					frame = client->rframe = &client->frame;
+				}
+				continue;
+			}
+		}
+		res = 1;
+		break; /* Return finalized frame to the application */
+	}
+	client->rframe = NULL;
+	return res;
+}
+
+int wss_read(struct wss_client *client, int pollms, int ready)
+{
+	int res = read_frame(client, pollms, ready);
+	if (client->pongpending && send_pong(client) && res == 0) {
+		res = -1;
+	}
+	return res;
+}
+
+size_t wss_client_memory_usage(struct wss_client *client)
+{
+	size_t bytes = sizeof(*client);
+
+	if (client->rbuf) {
+		bytes += client->rbufsize;
+	}
+	if (client->frame.data && client->frame.data != client->payload_buf && (!client->fragstate || client->frame.data != client->fragstate->ctlbuf)) {
+		bytes += client->frame.datasize;
+	}
+	if (client->fragstate) {
+		bytes += sizeof(*client->fragstate);
+		if (client->stashed && client->fragstate->stash.data && client->fragstate->stash.data != client->payload_buf) {
+			bytes += client->fragstate->stash.datasize;
+		}
+	}
+	if (client->pong) {
+		bytes += 125;
+	}
+	if (client->spare) {
+		bytes += client->sparesize;
+	}
+	if (client->wstage) {
+		bytes += client->wstagesize;
+	}
+	if (client->stats) {
+		bytes += sizeof(*client->stats);
+	}
+	if (client->wm) {
+		bytes += sizeof(*client->wm);
+	}
+	/* Queued data (the queues may be in use by other threads, so just use their counters) */
+	bytes += __atomic_load_n(&client->outbytes, __ATOMIC_RELAXED) + __atomic_load_n(&client->sendqbytes, __ATOMIC_RELAXED);
+	if (client->compress_ops && client->compress_ops->memory_usage) {
+		bytes += client->compress_ops->memory_usage(client->compress_ctx);
+	}
+#ifdef WS_IO_URING
+	if (client->uring) {
+		bytes += uring_memory_usage(client);
+	}
+#endif
+	return bytes;
+}
+
+void wss_client_trim(struct wss_client *client)
+{
+	if (client->rbuf && !client->rbuflen) {
+		free(client->rbuf);
+		client->rbuf = NULL;
+		client->rbufpos = 0;
+	}
+	if (client->spare) {
+		pool_release(client->spare, client->sparesize);
+		client->spare = NULL;
+	}
+	if (client->fragstate && !client->stashed && !client->rframe) {
+		free(client->fragstate);
+		client->fragstate = NULL;
+	}
+	if (client->pong && !client->pongpending) {
+		free(client->pong);
+		client->pong = NULL;
+	}
+}
+
+struct wss_clientset {
+	int fd;						/*!< epoll or kqueue fd */
+	int count;					/*!< Number of clients in set */
+	struct wss_client *pending;	/*!< Clients with data already buffered, that won't show up as readable */
+};
+
+struct wss_clientset *wss_clientset_new(void)
+{
+	struct wss_clientset *set = calloc(1, sizeof(*set));
+
+	if (!set) {
+		wss_log(WS_LOG_ERROR, "calloc failed\n");
+		return NULL;
+	}
+#if defined(WS_EPOLL)
+	set->fd = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(WS_KQUEUE)
+	set->fd = kqueue();
+#else
+	set->fd = -1;
+	errno = ENOSYS;
+#endif
+	if (set->fd < 0) {
+		wss_log(WS_LOG_ERROR, "Failed to create event queue: %s\n", strerror(errno));
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+void wss_clientset_destroy(struct wss_clientset *set)
+{
+	if (set->count) {
+		wss_log(WS_LOG_WARNING, "Destroying set that still contains %d client%s\n", set->count, set->count == 1 ? "" : "s");
+	}
+	close(set->fd);
+	free(set);
+}
+
+int wss_clientset_count(struct wss_clientset *set)
+{
+	return set->count;
+}
+
+/*! \brief Add a client to its set's list of clients with data already buffered, if it has any */
+static void set_check_pending(struct wss_clientset *set, struct wss_client *client)
+{
+	if (!client->setpending && (client->rbuflen || (client->pending_cb && client->pending_cb(client->data)))) {
+		client->setpending = 1;
+		client->setnext = set->pending;
+		set->pending = client;
+	}
+}
+
+int wss_clientset_add(struct wss_clientset *set, struct wss_client *client)
+{
+#if defined(WS_EPOLL)
+	struct epoll_event ev;
+#elif defined(WS_KQUEUE)
+	struct kevent kev;
+#endif
+
+	if (client->set) {
+		wss_log(WS_LOG_ERROR, "Client already belongs to a set\n");
+		return -1;
+	} else if (!client->nonblocking || client->rfd < 0) {
+		wss_log(WS_LOG_ERROR, "Only non-blocking clients with a file descriptor can be polled\n");
+		return -1;
+	} else if (client->uring) {
+		wss_log(WS_LOG_ERROR, "Clients using io_uring must be polled using wss_uring_poll\n");
+		return -1;
+	}
+#if defined(WS_EPOLL)
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	if (epoll_ctl(set->fd, EPOLL_CTL_ADD, client->rfd, &ev)) {
+#elif defined(WS_KQUEUE)
+	EV_SET(&kev, client->rfd, EVFILT_READ, EV_ADD, 0, 0, (void *) client);
+	if (kevent(set->fd, &kev, 1, NULL, 0, NULL)) {
+#else
+	if (1) {
+#endif
+		wss_log(WS_LOG_ERROR, "Failed to add fd %d to client set: %s\n", client->rfd, strerror(errno));
+		return -1;
+	}
+	client->set = set;
+	set->count++;
+	set_check_pending(set, client); /* In case something's already buffered */
+	return 0;
+}
+
+int wss_clientset_remove(struct wss_clientset *set, struct wss_client *client)
+{
+	struct wss_client **prev;
+#if defined(WS_KQUEUE)
+	struct kevent kev;
+#endif
+
+	if (client->set != set) {
+		return -1;
+	}
+#if defined(WS_EPOLL)
+	epoll_ctl(set->fd, EPOLL_CTL_DEL, client->rfd, NULL);
+#elif defined(WS_KQUEUE)
+	EV_SET(&kev, client->rfd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	kevent(set->fd, &kev, 1, NULL, 0, NULL);
+#endif
+	if (client->setpending) {
+		for (prev = &set->pending; *prev != client; prev = &(*prev)->setnext);
+		*prev = client->setnext;
+		client->setpending = 0;
+	}
+	client->set = NULL;
+	set->count--;
+	return 0;
+}
+
+/*! \brief Max number of readiness events retrieved at once */
+#define WS_SET_EVENTS 64
+
+/*! \brief Read from a client that may have a frame for us, and add it to the results if it does (or if it failed) */
+static int set_service(struct wss_clientset *set, struct wss_client *client, struct wss_ready *ready, int n)
+{
+	int res;
+
+	if (client->setready) {
+		return n; /* Its frame hasn't been handled yet, get it next time */
+	}
+	res = wss_read(client, 0, 1);
+	if (res) {
+		client->setready = 1;
+		ready[n].client = client;
+		ready[n].res = res;
+		n++;
+	}
+	if (res >= 0) {
+		set_check_pending(set, client);
+	}
+	return n;
+}
+
+int wss_poll(struct wss_clientset *set, struct wss_ready *ready, int max, int timeout)
+{
+#if defined(WS_EPOLL)
+	struct epoll_event events[WS_SET_EVENTS];
+#elif defined(WS_KQUEUE)
+	struct kevent events[WS_SET_EVENTS];
+	struct timespec ts;
+#endif
+	struct wss_client *client, *pending;
+	int i, res, n = 0;
+
+	/* Buffered data won't make the fd readable, so start with whatever already has some */
+	pending = set->pending;
+	set->pending = NULL;
+	while (pending) {
+		client = pending;
+		pending = client->setnext;
+		client->setpending = 0;
+		if (n < max) {
+			n = set_service(set, client, ready, n);
+		} else {
+			set_check_pending(set, client); /* No room, leave it for next time */
+		}
+	}
+
+	if (n < max) {
+		int wantevents = max - n > WS_SET_EVENTS ? WS_SET_EVENTS : max - n; /* Every event could become a result */
+#if defined(WS_EPOLL)
+		res = epoll_wait(set->fd, events, wantevents, n || set->pending ? 0 : timeout);
+#elif defined(WS_KQUEUE)
+		if (n || set->pending) {
+			timeout = 0;
+		}
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		res = kevent(set->fd, NULL, 0, events, wantevents, timeout < 0 ? NULL : &ts);
+#else
+		res = -1;
+		(void) wantevents;
+#endif
+		if (res < 0 && errno != EINTR) {
+			wss_log(WS_LOG_ERROR, "Failed to wait for events: %s\n", strerror(errno));
+			n = n ? n : -1;
+		}
+		for (i = 0; i < res; i++) {
+#if defined(WS_EPOLL)
+			client = events[i].data.ptr;
+#elif defined(WS_KQUEUE)
+			client = (struct wss_client *) events[i].udata;
+#endif
+			n = set_service(set, client, ready, n);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		ready[i].client->setready = 0;
+	}
+	return n;
+}
+
+#ifdef WS_IO_URING
+/* io_uring backend. This uses raw system calls, so there's no dependency on liburing. */
+
+#define UR_OP_RECV 1
+#define UR_OP_SEND 2
+#define UR_OP_MASK 7
+
+/*! \brief Per-client io_uring state. Outlives the client if a receive is still in flight when it's detached. */
+struct wss_uclient {
+	struct wss_uring *ring;
+	struct wss_client *client;	/*!< NULL once detached */
+	struct wss_uclient *next;	/*!< Next in ring's list of all clients */
+	struct wss_uclient *readynext;	/*!< Next in ring's list of clients with something to read */
+	int qhead;					/*!< First received buffer not yet consumed (-1 if none) */
+	int qtail;					/*!< Last received buffer */
+	unsigned int qoff;			/*!< Bytes of first buffer already consumed */
+	int err;					/*!< errno from receiving, if it failed */
+	int sends;					/*!< Sends in flight */
+	int senderr;				/*!< errno of first failed send */
+	size_t sent;				/*!< Bytes sent by sends in flight */
+	struct msghdr msg;			/*!< Message for a non-blocking send (kept here, since the send may outlive the call) */
+	int broken;					/*!< errno, if sends may still be in flight after waiting for them failed. All further I/O fails. */
+	unsigned int armed:1;		/*!< Multishot receive is active */
+	unsigned int eof:1;			/*!< Connection closed by peer */
+	unsigned int starved:1;		/*!< Receive stopped for lack of buffers */
+	unsigned int ready:1;		/*!< In ring's ready list */
+};
+
+struct wss_uring {
+	int fd;
+	/* Submission queue */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local;		/*!< Submission queue tail, including SQEs not yet published */
+	unsigned int to_submit;
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	/* Provided buffers for receives */
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	char *bufs;
+	unsigned int nbufs;
+	unsigned int bufsize;
+	unsigned short br_tail;
+	unsigned int nfree;			/*!< Buffers available to the kernel */
+	int *bnext;					/*!< Per buffer: next buffer in a client's receive queue */
+	unsigned int *blen;			/*!< Per buffer: number of bytes received */
+	int starved;				/*!< Number of clients whose receive stopped for lack of buffers */
+	struct wss_uclient *clients;
+	struct wss_uclient *readyhead;
+};
+
+static int uring_enter(struct wss_uring *ring, unsigned int min_complete, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int res;
+
+	/* Publish whatever has been prepared */
+	__atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+	if (!ring->to_submit && !min_complete) {
+		return 0;
+	}
+	memset(&arg, 0, sizeof(arg));
+	if (min_complete && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000LL;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	res = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, flags & IORING_ENTER_EXT_ARG ? (void *) &arg : NULL, sizeof(arg));
+	if (res >= 0) {
+		ring->to_submit -= (unsigned int) res > ring->to_submit ? ring->to_submit : (unsigned int) res;
+	} else if (errno == ETIME || errno == EINTR) {
+		res = 0; /* Timed out (or interrupted), but submissions were still consumed */
+		ring->to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	} else {
+		wss_log(WS_LOG_ERROR, "io_uring_enter failed: %s\n", strerror(errno));
+	}
+	return res;
+}
+
+/*! \brief Get a submission queue entry. It's submitted on the next call to uring_enter. */
+static struct io_uring_sqe *uring_sqe(struct wss_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		/* Full, make some room */
+		if (uring_enter(ring, 0, 0) < 0) {
+			return NULL;
+		}
+		if (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			wss_log(WS_LOG_ERROR, "io_uring submission queue is full\n");
+			return NULL;
+		}
+	}
+	idx = ring->sq_local & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sq_local++;
+	ring->to_submit++;
+	return sqe;
+}
+
+/*! \brief Give a receive buffer back to the kernel */
+static void uring_buf_return(struct wss_uring *ring, int bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (ring->nbufs - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) (ring->bufs + (size_t) bid * ring->bufsize);
+	buf->len = ring->bufsize;
+	buf->bid = (unsigned short) bid;
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+	ring->nfree++;
+}
+
+/*! \brief Start receiving into provided buffers, for as long as there are buffers */
+static int uring_arm(struct wss_uclient *uc)
+{
+	struct io_uring_sqe *sqe = uring_sqe(uc->ring);
+
+	if (!sqe) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = uc->client->rfd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uint64_t) (uintptr_t) uc | UR_OP_RECV;
+	uc->armed = 1;
+	if (uc->starved) {
+		uc->starved = 0;
+		uc->ring->starved--;
+	}
+	return 0;
+}
+
+static void uring_mark_ready(struct wss_uclient *uc)
+{
+	if (!uc->ready) {
+		uc->ready = 1;
+		uc->readynext = uc->ring->readyhead;
+		uc->ring->readyhead = uc;
+	}
+}
+
+static void uring_free_client(struct wss_uclient *uc)
+{
+	struct wss_uclient **prev;
+
+	for (prev = &uc->ring->clients; *prev != uc; prev = &(*prev)->next);
+	*prev = uc->next;
+	free(uc);
+}
+
+static void uring_complete(struct wss_uring *ring, struct io_uring_cqe *cqe)
+{
+	struct wss_uclient *uc = (struct wss_uclient *) (uintptr_t) (cqe->user_data & ~(uint64_t) UR_OP_MASK);
+
+	if (!cqe->user_data) {
+		return; /* Cancellation */
+	} else if ((cqe->user_data & UR_OP_MASK) == UR_OP_SEND) {
+		uc->sends--;
+		if (cqe->res < 0) {
+			if (!uc->senderr) {
+				uc->senderr = -cqe->res;
+			}
+		} else if (!uc->senderr) {
+			uc->sent += (size_t) cqe->res;
+		}
+		if (!uc->client && !uc->sends && !uc->armed) {
+			uring_free_client(uc); /* Detached while sends were still in flight */
+		}
+		return;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		int bid = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		ring->nfree--;
+		if (cqe->res > 0 && uc->client) {
+			/* Append to the client's receive queue */
+			ring->blen[bid] = (unsigned int) cqe->res;
+			ring->bnext[bid] = -1;
+			if (uc->qhead < 0) {
+				uc->qhead = bid;
+			} else {
+				ring->bnext[uc->qtail] = bid;
+			}
+			uc->qtail = bid;
+		} else {
+			uring_buf_return(ring, bid);
+		}
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		uc->armed = 0;
+		if (!uc->client) {
+			if (!uc->sends) {
+				uring_free_client(uc); /* Detached, and this was the last we'll hear of it */
+			}
+			return;
+		} else if (cqe->res == 0) {
+			uc->eof = 1;
+		} else if (cqe->res == -ENOBUFS) {
+			uc->starved = 1;
+			ring->starved++;
+		} else if (cqe->res < 0) {
+			uc->err = -cqe->res;
+		}
+	}
+	if (uc->client && (cqe->res >= 0 || uc->err)) {
+		uring_mark_ready(uc);
+	}
+}
+
+/*! \brief Process all available completions */
+static void uring_reap(struct wss_uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		uring_complete(ring, &ring->cqes[head & *ring->cq_mask]);
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*! \brief Restart receives that stopped for lack of buffers, if there are buffers now */
+static void uring_rearm(struct wss_uring *ring)
+{
+	struct wss_uclient *uc;
+
+	if (!ring->starved || !ring->nfree) {
+		return;
+	}
+	for (uc = ring->clients; uc && ring->starved; uc = uc->next) {
+		if (uc->starved && uc->client) {
+			uring_arm(uc);
+		}
+	}
+}
+
+/*! \brief Whether a client has something for wss_read */
+#define UC_READABLE(uc) ((uc)->qhead >= 0 || (uc)->eof || (uc)->err || (uc)->broken)
+
+static size_t uring_pending(struct wss_client *client)
+{
+	struct wss_uclient *uc = client->uring;
+	size_t pending = 0;
+	int bid;
+
+	uring_reap(uc->ring);
+	for (bid = uc->qhead; bid >= 0; bid = uc->ring->bnext[bid]) {
+		pending += uc->ring->blen[bid];
+	}
+	return pending - uc->qoff;
+}
+
+static size_t uring_memory_usage(struct wss_client *client)
+{
+	return sizeof(*client->uring); /* The provided buffers are shared by all of the ring's clients */
+}
+
+static ssize_t uring_read(struct wss_client *client, char *buf, size_t len)
+{
+	struct wss_uclient *uc = client->uring;
+	struct wss_uring *ring = uc->ring;
+	size_t copied = 0;
+
+	if (uc->broken) {
+		errno = uc->broken;
+		return -1;
+	}
+	for (;;) {
+		uring_reap(ring);
+		while (uc->qhead >= 0 && copied < len) {
+			int bid = uc->qhead;
+			size_t n = ring->blen[bid] - uc->qoff;
+			if (n > len - copied) {
+				n = len - copied;
+			}
+			memcpy(buf + copied, ring->bufs + (size_t) bid * ring->bufsize + uc->qoff, n);
+			copied += n;
+			uc->qoff += (unsigned int) n;
+			if (uc->qoff == ring->blen[bid]) {
+				uc->qhead = ring->bnext[bid];
+				uc->qoff = 0;
+				uring_buf_return(ring, bid);
+			}
+		}
+		if (copied) {
+			uring_rearm(ring);
+			return (ssize_t) copied;
+		} else if (uc->err) {
+			errno = uc->err;
+			return -1;
+		} else if (uc->eof) {
+			return 0;
+		}
+		if (!uc->armed && uring_arm(uc)) {
+			return -1;
+		}
+		if (client->nonblocking) {
+			uring_enter(ring, 0, 0);
+			errno = EAGAIN;
+			return -1;
+		} else if (uring_enter(ring, 1, -1) < 0) {
+			return -1;
+		}
+	}
+}
+
+static ssize_t uring_writev(struct wss_client *client, const struct iovec *iov, int iovcnt)
+{
+	struct wss_uclient *uc = client->uring;
+	struct wss_uring *ring = uc->ring;
+	int i, count = 0;
+
+	if (uc->broken) {
+		errno = uc->broken;
+		return -1;
+	}
+	uc->sent = 0;
+	uc->senderr = 0;
+	if (client->nonblocking) {
+		/* A short send doesn't break a chain of linked sends, so send everything as one message, just like writev */
+		struct io_uring_sqe *sqe = uring_sqe(ring);
+		if (!sqe) {
+			return -1;
+		}
+		memset(&uc->msg, 0, sizeof(uc->msg));
+		uc->msg.msg_iov = (struct iovec *) iov;
+		uc->msg.msg_iovlen = (size_t) iovcnt;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = client->wfd;
+		sqe->addr = (uint64_t) (uintptr_t) &uc->msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+		sqe->user_data = (uint64_t) (uintptr_t) uc | UR_OP_SEND;
+		count = 1;
+	} else {
+		/* Send each buffer in order, as a chain of linked sends. With MSG_WAITALL, a failure cancels the rest. */
+		int n = 0;
+		if (ring->sq_entries - (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < (unsigned int) iovcnt) {
+			uring_enter(ring, 0, 0); /* Make room, so the chain isn't split */
+		}
+		for (i = 0; i < iovcnt; i++) {
+			n += iov[i].iov_len ? 1 : 0;
+		}
+		if (n > (int) (ring->sq_entries - (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)))) {
+			n = (int) (ring->sq_entries - (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)));
+		}
+		for (i = 0; i < iovcnt && count < n; i++) {
+			struct io_uring_sqe *sqe;
+			if (!iov[i].iov_len) {
+				continue;
+			}
+			sqe = uring_sqe(ring);
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = client->wfd;
+			sqe->addr = (uint64_t) (uintptr_t) iov[i].iov_base;
+			sqe->len = (unsigned int) iov[i].iov_len;
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			sqe->flags = count < n - 1 ? IOSQE_IO_LINK : 0;
+			sqe->user_data = (uint64_t) (uintptr_t) uc | UR_OP_SEND;
+			count++;
+		}
+		if (!count) {
+			return 0;
+		}
+	}
+	uc->sends = count;
+	/* The caller may reuse these buffers as soon as we return, so wait for the sends to finish */
+	while (uc->sends) {
+		if (uring_enter(ring, 1, -1) < 0) {
+			/* The sends may still go out later, from buffers the caller is about to reuse,
+			 * so nothing more can be sent (or received) on this connection. */
+			uc->broken = errno ? errno : EIO;
+			wss_log(WS_LOG_ERROR, "Failed to wait for sends to complete, connection unusable: %s\n", strerror(uc->broken));
+			errno = uc->broken;
+			return -1;
+		}
+		uring_reap(ring);
+	}
+	if (uc->sent) {
+		return (ssize_t) uc->sent;
+	}
+	errno = uc->senderr;
+	return -1;
+}
+
+/*! \brief Wait for data from a client (blocking mode), as poll would. Returns 1 if readable, 0 on timeout, -1 on failure. */
+static int uring_poll(struct wss_client *client, int ms)
+{
+	struct wss_uclient *uc = client->uring;
+	uint64_t deadline = monotonic_ns() + (uint64_t) ms * 1000000ULL;
+
+	for (;;) {
+		uint64_t now;
+		uring_reap(uc->ring);
+		if (UC_READABLE(uc)) {
+			return 1;
+		} else if (!uc->armed && uring_arm(uc)) {
+			return -1;
+		}
+		now = monotonic_ns();
+		if (ms >= 0 && now >= deadline) {
+			return 0;
+		}
+		if (uring_enter(uc->ring, 1, ms < 0 ? -1 : (int) ((deadline - now + 999999) / 1000000)) < 0) {
+			return -1;
+		}
+	}
+}
+
+struct wss_uring *wss_uring_new(unsigned int entries, unsigned int nbufs, unsigned int bufsize)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct wss_uring *ring;
+	unsigned int i;
+
+	if (!nbufs || nbufs > 32768 || (nbufs & (nbufs - 1)) || !bufsize) {
+		wss_log(WS_LOG_ERROR, "Number of buffers must be a power of 2, up to 32768\n");
+		return NULL;
+	}
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		wss_log(WS_LOG_ERROR, "calloc failed\n");
+		return NULL;
+	}
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER;
+	ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		wss_log(WS_LOG_ERROR, "io_uring_setup failed: %s\n", strerror(errno));
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_len = ring->cq_len = ring->sq_len > ring->cq_len ? ring->sq_len : ring->cq_len;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = p.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ptr : mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	/* Provided buffers, plus the ring through which they're provided */
+	ring->nbufs = nbufs;
+	ring->bufsize = bufsize;
+	ring->br_len = nbufs * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = malloc((size_t) nbufs * bufsize);
+	ring->bnext = malloc(nbufs * sizeof(*ring->bnext));
+	ring->blen = malloc(nbufs * sizeof(*ring->blen));
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED || ring->br == MAP_FAILED || !ring->bufs || !ring->bnext || !ring->blen) {
+		wss_log(WS_LOG_ERROR, "Failed to allocate io_uring: %s\n", strerror(errno));
+		goto cleanup;
+	}
+
+	ring->sq_head = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local = *ring->sq_tail;
+	ring->cq_head = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) ring->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		wss_log(WS_LOG_ERROR, "Failed to register buffer ring: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	for (i = 0; i < nbufs; i++) {
+		uring_buf_return(ring, (int) i);
+	}
+	return ring;
+
+cleanup:
+	wss_uring_destroy(ring);
+	return NULL;
+}
+
+void wss_uring_destroy(struct wss_uring *ring)
+{
+	close(ring->fd);
+	while (ring->clients) {
+		struct wss_uclient *next = ring->clients->next;
+		if (ring->clients->client) {
+			wss_log(WS_LOG_WARNING, "Destroying io_uring still in use by a client\n");
+			ring->clients->client->uring = NULL;
+		}
+		free(ring->clients);
+		ring->clients = next;
+	}
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) {
+		munmap(ring->sq_ptr, ring->sq_len);
+	}
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->br && ring->br != MAP_FAILED) {
+		munmap(ring->br, ring->br_len);
+	}
+	free(ring->bufs);
+	free(ring->bnext);
+	free(ring->blen);
+	free(ring);
+}
+
+/*! \brief Stop using io_uring for a client */
+static void uring_detach(struct wss_client *client)
+{
+	struct wss_uclient *uc = client->uring;
+	struct wss_uring *ring = uc->ring;
+	struct wss_uclient **prev;
+
+	/* Give back anything not yet read */
+	while (uc->qhead >= 0) {
+		int bid = uc->qhead;
+		uc->qhead = ring->bnext[bid];
+		uring_buf_return(ring, bid);
+	}
+	if (uc->ready) {
+		for (prev = &ring->readyhead; *prev != uc; prev = &(*prev)->readynext);
+		*prev = uc->readynext;
+		uc->ready = 0;
+	}
+	if (uc->starved) {
+		uc->starved = 0;
+		ring->starved--;
+	}
+	uc->client = NULL;
+	client->uring = NULL;
+	if (uc->armed) {
+		/* The receive refers to this, so it can only be freed once the kernel is done with it */
+		struct io_uring_sqe *sqe = uring_sqe(ring);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uint64_t) (uintptr_t) uc | UR_OP_RECV;
+			sqe->user_data = 0;
+			uring_enter(ring, 0, 0);
+		}
+	} else if (!uc->sends) {
+		uring_free_client(uc);
+	}
+}
+
+int wss_set_io_uring(struct wss_client *client, struct wss_uring *ring)
+{
+	struct wss_uclient *uc;
+
+	if (client->uring) {
+		uring_detach(client);
+	}
+	if (!ring) {
+		return 0;
+	} else if (client->read_cb || client->write_cb || client->writev_cb || client->rfd < 0 || client->wfd < 0) {
+		wss_log(WS_LOG_ERROR, "io_uring can only be used with sockets, not I/O callbacks\n");
+		return -1;
+	} else if (client->set) {
+		wss_log(WS_LOG_ERROR, "Clients using io_uring can't be in a client set\n");
+		return -1;
+	}
+	uc = calloc(1, sizeof(*uc));
+	if (!uc) {
+		wss_log(WS_LOG_ERROR, "calloc failed\n");
+		return -1;
+	}
+	uc->ring = ring;
+	uc->client = client;
+	uc->qhead = uc->qtail = -1;
+	uc->next = ring->clients;
+	ring->clients = uc;
+	client->uring = uc;
+	return 0;
+}
+
+int wss_uring_poll(struct wss_uring *ring, struct wss_ready *ready, int max, int timeout)
+{
+	struct wss_uclient *uc, *next, *keep = NULL;
+	int n = 0;
+
+	uring_reap(ring);
+	uring_rearm(ring);
+	/* Make sure every client is receiving */
+	for (uc = ring->clients; uc; uc = uc->next) {
+		if (uc->client && !uc->armed && !uc->starved && !UC_READABLE(uc)) {
+			uring_arm(uc);
+		}
+	}
+	if (!ring->readyhead) {
+		if (uring_enter(ring, 1, timeout) < 0) {
+			return -1;
+		}
+		uring_reap(ring);
+	} else {
+		uring_enter(ring, 0, 0);
+	}
+
+	for (uc = ring->readyhead, ring->readyhead = NULL; uc; uc = next) {
+		struct wss_client *client = uc->client;
+		next = uc->readynext;
+		uc->ready = 0;
+		if (n < max) {
+			int res = wss_read(client, 0, 1);
+			if (res) {
+				ready[n].client = client;
+				ready[n].res = res;
+				n++;
+			}
+			if (res < 0 || !(client->rbuflen || UC_READABLE(uc))) {
+				continue;
+			}
+		}
+		/* Still more to read, keep it for next time */
+		uc->ready = 1;
+		uc->readynext = keep;
+		keep = uc;
+	}
+	/* Anything that became ready while reading goes on the list too */
+	while (keep) {
+		next = keep->readynext;
+		keep->ready = 0;
+		uring_mark_ready(keep);
+		keep = next;
+	}
+	return n;
+}
+
+#else
+
+struct wss_uring *wss_uring_new(unsigned int entries, unsigned int nbufs, unsigned int bufsize)
+{
+	(void) entries;
+	(void) nbufs;
+	(void) bufsize;
+	wss_log(WS_LOG_ERROR, "io_uring is not supported on this platform\n");
+	errno = ENOSYS;
+	return NULL;
+}
+
+void wss_uring_destroy(struct wss_uring *ring)
+{
+	(void) ring;
+}
+
+int wss_set_io_uring(struct wss_client *client, struct wss_uring *ring)
+{
+	(void) client;
+	return ring ? -1 : 0;
+}
+
+int wss_uring_poll(struct wss_uring *ring, struct wss_ready *ready, int max, int timeout)
+{
+	(void) ring;
+	(void) ready;
+	(void) max;
+	(void) timeout;
+	errno = ENOSYS;
+	return -1;
+}
+#endif /* WS_IO_URING */
+
+struct wss_frame *wss_client_frame(struct wss_client *client)
+{
+	return &client->frame;
+}
+
+int wss_frame_opcode(struct wss_frame *frame)
+{
 	return frame->opcode;
 }
 
-char *wss_frame_payload(struct wss_frame *frame)
+char *wss_frame_payload(struct wss_frame *frame)
+{
+	return frame->data;
+}
+
+unsigned long wss_frame_payload_length(struct wss_frame *frame)
+{
+	return frame->length;
+}
+
+size_t wss_outbound_bytes(struct wss_client *client)
+{
+	return __atomic_load_n(&client->outbytes, __ATOMIC_RELAXED) + __atomic_load_n(&client->sendqbytes, __ATOMIC_RELAXED);
+}
+
+int wss_backpressure(struct wss_client *client)
+{
+	return client->wm ? __atomic_load_n(&client->wm->above, __ATOMIC_RELAXED) : 0;
+}
+
+int wss_set_watermarks(struct wss_client *client, size_t high, size_t low, enum wss_backpressure_policy policy, void (*cb)(void *data, int above))
+{
+	struct wss_watermarks *wm = client->wm;
+
+	if (!high) {
+		if (wm) {
+			pthread_mutex_destroy(&wm->lock);
+			pthread_cond_destroy(&wm->cond);
+			free(wm);
+			client->wm = NULL;
+		}
+		return 0;
+	} else if (low > high) {
+		wss_log(WS_LOG_ERROR, "Low watermark (%lu) exceeds high watermark (%lu)\n", low, high);
+		return -1;
+	}
+	if (!wm) {
+		wm = calloc(1, sizeof(*wm));
+		if (!wm) {
+			wss_log(WS_LOG_ERROR, "calloc failed\n");
+			return -1;
+		}
+		pthread_mutex_init(&wm->lock, NULL);
+		pthread_cond_init(&wm->cond, NULL);
+		client->wm = wm;
+	}
+	wm->high = high;
+	wm->low = low;
+	wm->policy = policy;
+	wm->cb = cb;
+	return 0;
+}
+
+/*!
+ * \brief Note the outbound queue crossing a watermark, if it has
+ * \param client
+ * \param extra Number of bytes about to be queued
+ */
+static void watermark_check(struct wss_client *client, size_t extra)
+{
+	struct wss_watermarks *wm = client->wm;
+	size_t queued = wss_outbound_bytes(client) + extra;
+	int above = __atomic_load_n(&wm->above, __ATOMIC_RELAXED);
+
+	if (!above && queued > wm->high) {
+		if (__atomic_compare_exchange_n(&wm->above, &above, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			wss_debug(1, "Outbound queue above high watermark (%lu bytes queued)\n", queued);
+			if (wm->cb) {
+				wm->cb(client->data, 1);
+			}
+		}
+	} else if (above && queued <= wm->low) {
+		if (__atomic_compare_exchange_n(&wm->above, &above, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			wss_debug(1, "Outbound queue below low watermark (%lu bytes queued)\n", queued);
+			if (wm->cb) {
+				wm->cb(client->data, 0);
+			}
+			if (__atomic_load_n(&wm->waiters, __ATOMIC_RELAXED)) {
+				pthread_mutex_lock(&wm->lock);
+				pthread_cond_broadcast(&wm->cond);
+				pthread_mutex_unlock(&wm->lock);
+			}
+		}
+	}
+}
+
+/*! \brief Drop the oldest queued data messages until no more than target bytes are queued, if possible */
+static void drop_queued(struct wss_client *client, size_t target)
+{
+	struct wss_outbuf **prev = &client->outhead, *outbuf;
+	unsigned int dropped = 0;
+
+	while ((outbuf = *prev) && client->outbytes > target) {
+		if (outbuf->droppable && !outbuf->pos) {
+			*prev = outbuf->next;
+			__atomic_fetch_sub(&client->outbytes, outbuf->len, __ATOMIC_RELAXED);
+			free(outbuf);
+			dropped++;
+		} else {
+			prev = &outbuf->next;
+		}
+	}
+	/* The tail may have been dropped */
+	for (client->outtail = client->outhead; client->outtail && client->outtail->next; client->outtail = client->outtail->next);
+	if (dropped) {
+		wss_log(WS_LOG_WARNING, "Dropped %u queued message%s, %lu bytes still queued\n", dropped, dropped == 1 ? "" : "s", client->outbytes);
+	}
+}
+
+/*! \brief Discard queued data and close a connection whose outbound queue overflowed */
+static void overflow_close(struct wss_client *client)
+{
+	struct wss_outbuf *keep = client->outhead, *outbuf, *next;
+	uint16_t code = htons(WS_CLOSE_POLICY_VIOLATION);
+
+	wss_log(WS_LOG_WARNING, "Outbound queue exceeded %lu bytes, closing connection\n", client->wm->high);
+	__atomic_store_n(&client->overflow, WS_OVERFLOW_CLOSING, __ATOMIC_RELAXED);
+	/* Keep just enough to finish the frame that may be partially written */
+	while (keep && keep->midframe && keep->next) {
+		keep = keep->next;
+	}
+	for (outbuf = keep ? keep->next : NULL; outbuf; outbuf = next) {
+		next = outbuf->next;
+		__atomic_fetch_sub(&client->outbytes, outbuf->len, __ATOMIC_RELAXED);
+		free(outbuf);
+	}
+	if (keep) {
+		keep->next = NULL;
+		client->outtail = keep;
+	}
+	client->closecode = WS_CLOSE_POLICY_VIOLATION;
+	wss_frame_write(client, WS_OPCODE_CLOSE, (const char *) &code, 2, 1, 0, 0);
+	__atomic_store_n(&client->overflow, WS_OVERFLOW_CLOSED, __ATOMIC_RELAXED);
+}
+
+/*! \brief Wait for the outbound queue to drain to the low watermark, by writing it out ourselves */
+static int block_flush(struct wss_client *client)
+{
+	while (client->outbytes > client->wm->low) {
+		struct pollfd pfd;
+		int res = wss_flush(client);
+		if (res <= 0) {
+			return res;
+		}
+		pfd.fd = client->wfd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		/* If we have no fd (custom I/O callbacks), all we can do is retry periodically */
+		if (poll(&pfd, client->wfd >= 0 ? 1 : 0, client->wfd >= 0 ? -1 : 1) < 0 && errno != EINTR) {
+			wss_log(WS_LOG_ERROR, "poll failed: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*!
+ * \brief Queue the remaining data in an I/O vector for writing later. iov is zeroed.
+ * \param client
+ * \param iov
+ * \param iovcnt
+ * \param whole Whether the I/O vector is the entire frame currently being written
+ */
+static int queue_iov(struct wss_client *client, struct iovec *iov, int iovcnt, int whole)
+{
+	int overflow = __atomic_load_n(&client->overflow, __ATOMIC_RELAXED);
+	struct wss_watermarks *wm = overflow ? NULL : client->wm;
+	struct wss_outbuf *outbuf;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (wm && wm->policy == WS_BACKPRESSURE_DROP && client->outbytes + len > wm->high) {
+		watermark_check(client, len); /* Backed up, even though we won't let it go over */
+		drop_queued(client, wm->high > len ? wm->high - len : 0);
+	}
+	outbuf = malloc(sizeof(*outbuf) + len);
+	if (!outbuf) {
+		wss_log(WS_LOG_ERROR, "malloc failed\n");
+		return -1;
+	}
+	outbuf->next = NULL;
+	outbuf->len = len;
+	outbuf->pos = 0;
+	outbuf->midframe = client->wmidframe;
+	outbuf->droppable = whole && client->wdroppable && !client->wmidframe;
+	for (i = 0, len = 0; i < iovcnt; i++) {
+		memcpy(outbuf->data + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+		iov[i].iov_len = 0;
+	}
+	if (client->wpriority && client->outhead) {
+		/* Skip ahead to the end of the frame that may already be partially written */
+		struct wss_outbuf *prev = client->outhead;
+		while (prev->midframe && prev->next) {
+			prev = prev->next;
+		}
+		outbuf->next = prev->next;
+		prev->next = outbuf;
+		if (prev == client->outtail) {
+			client->outtail = outbuf;
+		}
+	} else {
+		if (client->outtail) {
+			client->outtail->next = outbuf;
+		} else {
+			client->outhead = outbuf;
+		}
+		client->outtail = outbuf;
+	}
+	__atomic_fetch_add(&client->outbytes, outbuf->len, __ATOMIC_RELAXED);
+	wss_debug(4, "Queued %lu bytes for writing (%lu bytes now queued)\n", outbuf->len, client->outbytes);
+	if (overflow == WS_OVERFLOW_REQUESTED && !client->wmidframe) {
+		/* Overflowed while queueing an earlier part of this frame, which is now complete */
+		overflow_close(client);
+	} else if (wm) {
+		watermark_check(client, 0);
+		if (client->outbytes > wm->high) {
+			if (wm->policy == WS_BACKPRESSURE_CLOSE) {
+				if (client->wmidframe) {
+					/* The CLOSE can't go in the middle of this frame, so send it once the rest of the frame is queued */
+					__atomic_store_n(&client->overflow, WS_OVERFLOW_REQUESTED, __ATOMIC_RELAXED);
+				} else {
+					overflow_close(client);
+				}
+			} else if (wm->policy == WS_BACKPRESSURE_BLOCK) {
+				return block_flush(client) < 0 ? -1 : 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/*! \brief Max number of queued buffers to write at once in wss_flush */
+#define WS_FLUSH_IOV 16
+
+int wss_flush(struct wss_client *client)
+{
+	while (client->outhead) {
+		struct iovec iov[WS_FLUSH_IOV];
+		struct wss_outbuf *outbuf;
+		ssize_t res;
+		int iovcnt = 0;
+
+		for (outbuf = client->outhead; outbuf && iovcnt < WS_FLUSH_IOV; outbuf = outbuf->next, iovcnt++) {
+			iov[iovcnt].iov_base = outbuf->data + outbuf->pos;
+			iov[iovcnt].iov_len = outbuf->len - outbuf->pos;
+		}
+		res = __writev_cb(client, iov, iovcnt);
+		if (res <= 0) {
+			if (res < 0 && WS_WOULDBLOCK()) {
+				return 1;
+			}
+			wss_log(WS_LOG_WARNING, "writev returned %d: %s\n", (int) res, strerror(errno));
+			return -1;
+		}
+		__atomic_fetch_sub(&client->outbytes, (size_t) res, __ATOMIC_RELAXED);
+		/* Free whatever has been completely written */
+		while (res > 0) {
+			outbuf = client->outhead;
+			if ((size_t) res < outbuf->len - outbuf->pos) {
+				outbuf->pos += (size_t) res;
+				break;
+			}
+			res -= (ssize_t) (outbuf->len - outbuf->pos);
+			client->outhead = outbuf->next;
+			if (!client->outhead) {
+				client->outtail = NULL;
+			}
+			free(outbuf);
+		}
+		if (client->wm) {
+			watermark_check(client, 0);
+		}
+	}
+	return 0;
+}
+
+int wss_want_write(struct wss_client *client)
+{
+	return client->outhead ? 1 : 0;
+}
+
+/*!
+ * \brief Write all the data in an I/O vector. iov is modified to keep track of progress (fully written elements are zeroed).
+ * \note In non-blocking mode, anything that can't be written immediately is queued.
+ */
+static int __full_writev(struct wss_client *client, struct iovec *iov, int iovcnt)
+{
+	if (__atomic_load_n(&client->overflow, __ATOMIC_RELAXED) == WS_OVERFLOW_CLOSED) {
+		return -1; /* Can't send anything now */
+	}
+	/* Skip anything empty up front */
+	while (iovcnt > 0 && !iov->iov_len) {
+		iov++;
+		iovcnt--;
+	}
+	if (client->outhead && iovcnt > 0) {
+		/* Data is already waiting to go out, so this must go out after it */
+		if (client->nonblocking) {
+			return queue_iov(client, iov, iovcnt, 1);
+		} else if (wss_flush(client)) { /* No longer non-blocking, so just send it all now */
+			return -1;
+		}
+	}
+	while (iovcnt > 0) {
+		ssize_t res = __writev_cb(client, iov, iovcnt);
+		if (res <= 0) {
+			if (res < 0 && client->nonblocking && WS_WOULDBLOCK()) {
+				return queue_iov(client, iov, iovcnt, 0);
+			}
+			wss_log(WS_LOG_WARNING, "writev returned %d: %s\n", (int) res, strerror(errno));
+			return -1;
+		}
+		/* Advance past whatever was written */
+		while (iovcnt > 0 && (size_t) res >= iov->iov_len) {
+			res -= (ssize_t) iov->iov_len;
+			iov->iov_len = 0; /* Mark as written */
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + res;
+			iov->iov_len -= (size_t) res;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Default size of the staging buffer used to mask outgoing payloads */
+#define WS_STAGING_SIZE 8192
+
+/*!
+ * \brief Write a frame
+ * \param client
+ * \param header, hlen Frame header
+ * \param buf, len Payload
+ * \param mask Masking key, if the payload needs to be masked
+ * \param inplace Whether buf may be masked in place (otherwise, it's copied to a staging buffer as it's masked)
+ */
+static int full_write(struct wss_client *client, const char *header, unsigned int hlen, const char *buf, size_t len, const char mask[4], int inplace)
+{
+	struct iovec iov[2];
+
+	iov[0].iov_base = (void *) header;
+	iov[0].iov_len = hlen;
+
+	if (mask) {
+		STAT_ADD(client, bytes_masked, len);
+	}
+	if (mask && inplace) {
+		/* Mask it where it is, then send it all at once */
+		wss_mask((char *) buf, buf, len, mask, 0);
+		mask = NULL;
+	}
+	if (!mask) {
+		/* Send the header and payload together */
+		iov[1].iov_base = (void *) buf;
+		iov[1].iov_len = len;
+		return __full_writev(client, iov, 2);
+	} else {
+		/* We need to mask the data we send to the server.
+		 * Can we do it without additional allocations? You bet! */
+		char stackbuf[WS_STAGING_SIZE];
+		char *masked = client->wstage ? client->wstage : stackbuf;
+		size_t chunksize = client->wstage ? client->wstagesize : sizeof(stackbuf);
+		size_t offset = 0;
+		int res, chunk = 1; /* The first chunk goes out along with the header */
+		/* Copy and send it in chunks */
+		do {
+			size_t sendbytes = len - offset > chunksize ? chunksize : len - offset;
+			/* Mask the data */
+			wss_mask(masked, buf + offset, sendbytes, mask, offset);
+			iov[chunk].iov_base = masked;
+			iov[chunk].iov_len = sendbytes;
+			/* Send it */
+			client->wmidframe = offset + sendbytes < len;
+			res = __full_writev(client, iov, chunk + 1);
+			client->wmidframe = 0;
+			client->wdroppable = 0; /* Only if the whole frame is in one piece */
+			if (res) {
+				return -1;
+			}
+			offset += sendbytes;
+			chunk = 0;
+		} while (offset < len);
+	}
+	return 0;
+}
+
+/*! \brief Seed a masking key generator */
+static uint64_t prng_seed(void)
+{
+	uint64_t seed = 0;
+
+	if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed) || !seed) {
+		/* Shouldn't happen, but masking keys only need to be unpredictable, not secret, so do something reasonable */
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		seed = ((uint64_t) ts.tv_sec << 32) ^ (uint64_t) ts.tv_nsec ^ ((uint64_t) getpid() << 16) ^ (uint64_t) (uintptr_t) &seed;
+		seed |= 1; /* xorshift state must be nonzero */
+	}
+	return seed;
+}
+
+/*!
+ * \brief Generate a masking key
+ * \param[in,out] state xorshift64* generator state, seeded on first use
+ * \param[out] mask
+ */
+static void gen_mask(uint64_t *state, char mask[4])
+{
+	uint64_t x = *state;
+	uint32_t key;
+
+	if (!x) {
+		x = prng_seed();
+	}
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	key = (uint32_t) ((x * 0x2545F4914F6CDD1DULL) >> 32); /* The high bits are the good ones */
+	memcpy(mask, &key, 4);
+}
+
+/*! \brief Key generator for frames not encoded for a particular client */
+static __thread uint64_t encode_prng = 0;
+
+/*!
+ * \brief Encode a frame header
+ * \param preamble Buffer for header, which must be at least 14 bytes
+ * \param opcode
+ * \param len Payload length
+ * \param fin Whether to set FIN
+ * \param mask Masking key, or NULL if none (server)
+ * \return Length of header
+ */
+static int frame_header(char preamble[14], int opcode, size_t len, int fin, int rsv1, const char mask[4])
+{
+	unsigned char payload_len;
+	int preamble_bytes = 2;
+
+	/* Zero allocation frame write */
+
+	memset(preamble, 0, 2); /* Only necessary to zero out the first 2 bytes. */
+	if (fin) {
+		preamble[0] |= BIT0;
+	}
+	if (rsv1) {
+		preamble[0] |= BIT1; /* Compressed message */
+	}
+	/* Set the 4-byte opcode (higher order bits of opcode will be 0s) */
+	preamble[0] |= opcode & 0xff;
+	/* No mask in client's direction, only server's */
+	if (mask) {
+		preamble[1] |= BIT0;
+	}
+	/* Payload length */
+	payload_len = len > 0xffff ? 127 : len > 125 ? 126 : len;
+	preamble[1] |= payload_len & 0x7f;
+	/* Extended payload */
+	if (payload_len == 126) {
+		uint16_t xlen = htons((uint16_t) len);
+		memcpy(preamble + 2, &xlen, 2);
+		preamble_bytes += 2;
+	} else if (payload_len == 127) {
+		uint64_t xlen = htobe64((uint64_t) len); /* Highest order bit is 0 */
+		memcpy(preamble + 2, &xlen, 8);
+		preamble_bytes += 8;
+	}
+	if (mask) {
+		/* Need a 4-byte mask */
+		memcpy(preamble + preamble_bytes, mask, 4);
+		preamble_bytes += 4;
+	}
+	return preamble_bytes;
+}
+
+/*! \brief Keep track of control frames sent, however they're sent */
+static void control_sent(struct wss_client *client, int opcode)
+{
+	if (opcode == WS_OPCODE_PING) {
+		__atomic_store_n(&client->pingsent, monotonic_ns(), __ATOMIC_RELAXED);
+	} else if (opcode == WS_OPCODE_CLOSE) {
+		client->closesent = 1;
+	}
+}
+
+static int wss_frame_write(struct wss_client *client, int opcode, const char *payload, size_t len, int fin, int rsv1, int inplace)
+{
+	char preamble[14]; /* At least 2, maximum of 10, +4 for mask if present */
+	char mask[4];
+	int preamble_bytes, res;
+
+	if (!WS_OPCODE_VALID(opcode)) {
+		wss_log(WS_LOG_ERROR, "Invalid frame opcode: %d\n", opcode);
+		return -1;
+	}
+
+	if (client->type == WS_CLIENT) {
+		gen_mask(&client->prng, mask);
+	}
+	preamble_bytes = frame_header(preamble, opcode, len, fin, rsv1, client->type == WS_CLIENT ? mask : NULL);
+	wss_debug(2, "Sending WebSocket %s frame (length %lu, excl. %d-byte header)\n", opcode_name(opcode), len, preamble_bytes);
+	STAT_ADD(client, frames_out[opcode & 0xf], 1);
+	STAT_ADD(client, bytes_out[opcode & 0xf], payload ? len : 0);
+	control_sent(client, opcode);
+	client->wdroppable = (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) && fin && !rsv1;
+	res = full_write(client, preamble, (unsigned int) preamble_bytes, payload, payload ? len : 0, client->type == WS_CLIENT ? mask : NULL, inplace);
+	client->wdroppable = 0;
+	return res;
+}
+
+int wss_write_begin(struct wss_client *client, int opcode)
+{
+	if (opcode != WS_OPCODE_TEXT && opcode != WS_OPCODE_BINARY) {
+		wss_log(WS_LOG_ERROR, "Only data frames may be fragmented\n");
+		return -1;
+	} else if (client->sendqueue) {
+		/* The fragments would go straight to the socket, possibly in between frames written by the drainer */
+		wss_log(WS_LOG_ERROR, "Fragmented messages can't be sent while the send queue is enabled\n");
+		return -1;
+	} else if (client->wfragmenting) {
+		wss_log(WS_LOG_ERROR, "Fragmented message already in progress\n");
+		return -1;
+	}
+	client->wopcode = opcode;
+	client->wfragmenting = 1;
+	client->wstarted = 0;
+	client->wrsv1 = 0;
+	return 0;
+}
+
+/*! \brief Send the next fragment of the message in progress */
+static int write_fragment(struct wss_client *client, const char *payload, size_t len, int fin, int inplace)
+{
+	int res;
+	if (client->wstarted) {
+		res = wss_frame_write(client, WS_OPCODE_CONTINUE, payload, len, fin, 0, inplace);
+	} else {
+		res = wss_frame_write(client, client->wopcode, payload, len, fin, client->wrsv1, inplace);
+	}
+	client->wstarted = 1;
+	return res;
+}
+
+int wss_write_chunk(struct wss_client *client, const char *payload, size_t len)
+{
+	if (!client->wfragmenting) {
+		wss_log(WS_LOG_ERROR, "No fragmented message in progress\n");
+		return -1;
+	} else if (!len) {
+		return 0; /* Nothing to send (don't send empty fragments) */
+	}
+	return write_fragment(client, payload, len, 0, 0);
+}
+
+int wss_write_end(struct wss_client *client, const char *payload, size_t len)
+{
+	if (!client->wfragmenting) {
+		wss_log(WS_LOG_ERROR, "No fragmented message in progress\n");
+		return -1;
+	}
+	client->wfragmenting = 0;
+	return write_fragment(client, payload, len, 1, 0);
+}
+
+void wss_set_max_fragment_size(struct wss_client *client, size_t size)
+{
+	client->maxfragment = size;
+}
+
+/*!
+ * \brief Send a message, fragmenting and compressing it as needed
+ * \param inplace Whether payload may be modified (masked in place)
+ */
+static int write_message(struct wss_client *client, int opcode, const char *payload, size_t len, int inplace)
+{
+	char *compressed = NULL;
+	int rsv1 = 0;
+	int res;
+
+	/* Writing is a lot easier than reading...
+	 * First, determine if we're going to send multiple frames or not,
+	 * since we need to set FIN accordingly. */
+	if (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) {
+		if (client->wfragmenting) {
+			/* Only control frames can be interleaved with fragments */
+			wss_log(WS_LOG_ERROR, "Can't send %s frame while a fragmented message is in progress\n", opcode_name(opcode));
+			return -1;
+		}
+		if (client->compress_ops && payload && len) {
+			size_t outlen;
+			res = client->compress_ops->compress(client->compress_ctx, payload, len, &compressed, &outlen);
+			if (res < 0) {
+				wss_log(WS_LOG_ERROR, "Failed to compress %lu-byte payload\n", len);
+				return -1;
+			} else if (!res) {
+				wss_debug(4, "Compressed %lu-byte payload to %lu bytes\n", len, outlen);
+				payload = compressed;
+				len = outlen;
+				rsv1 = 1;
+				inplace = 1; /* This buffer is ours */
+			}
+		}
+		if (client->maxfragment && payload && len > client->maxfragment) {
+			client->wopcode = opcode; /* Not wss_write_begin, since this may be the send queue drainer */
+			client->wfragmenting = 1;
+			client->wstarted = 0;
+			client->wrsv1 = (unsigned int) rsv1;
+			while (len > client->maxfragment) {
+				if (write_fragment(client, payload, client->maxfragment, 0, inplace)) {
+					client->wfragmenting = 0;
+					free(compressed);
+					return -1;
+				}
+				payload += client->maxfragment;
+				len -= client->maxfragment;
+			}
+			client->wfragmenting = 0;
+			res = write_fragment(client, payload, len, 1, inplace);
+			free(compressed);
+			return res;
+		}
+	}
+	res = wss_frame_write(client, opcode, payload, len, 1, rsv1, inplace);
+	free(compressed);
+	return res;
+}
+
+int wss_write(struct wss_client *client, int opcode, const char *payload, size_t len)
+{
+	if (client->sendqueue) {
+		return sendq_add(client, NULL, opcode, payload, len);
+	}
+	return write_message(client, opcode, payload, len, 0);
+}
+
+int wss_write_inplace(struct wss_client *client, int opcode, char *payload, size_t len)
+{
+	if (client->sendqueue) {
+		return sendq_add(client, NULL, opcode, payload, len); /* Copied anyways */
+	}
+	return write_message(client, opcode, payload, len, 1);
+}
+
+/*! \brief Send part of a file, as the rest of the frame being written, by copying it through a buffer */
+static int write_file_copy(struct wss_client *client, int fd, off_t offset, size_t len)
+{
+	char buf[WS_STAGING_SIZE];
+
+	while (len > 0) {
+		struct iovec iov;
+		int res;
+		ssize_t bytes = pread(fd, buf, len > sizeof(buf) ? sizeof(buf) : len, offset);
+		if (bytes <= 0) {
+			wss_log(WS_LOG_ERROR, "Failed to read file: %s\n", bytes ? strerror(errno) : "File too short");
+			return -1;
+		}
+		iov.iov_base = buf;
+		iov.iov_len = (size_t) bytes;
+		client->wmidframe = (size_t) bytes < len;
+		res = __full_writev(client, &iov, 1);
+		client->wmidframe = 0;
+		if (res) {
+			return -1;
+		}
+		offset += bytes;
+		len -= (size_t) bytes;
+	}
+	return 0;
+}
+
+#ifdef WS_SENDFILE
+/*! \brief Send part of a file, as the rest of the frame being written, without copying it to userspace */
+static int write_file_direct(struct wss_client *client, int fd, off_t offset, size_t len)
+{
+	while (len > 0 && !client->outhead) {
+		ssize_t res = sendfile(client->wfd, fd, &offset, len);
+		if (res > 0) {
+			len -= (size_t) res;
+			continue;
+		} else if (!res) {
+			wss_log(WS_LOG_ERROR, "Failed to read file: File too short\n");
+			return -1;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EINVAL || errno == ENOSYS) {
+			break; /* Not supported for these descriptors, just copy it */
+		} else if (WS_WOULDBLOCK()) {
+			struct pollfd pfd;
+			if (client->nonblocking) {
+				break; /* Copy the rest into the outbound queue */
+			}
+			pfd.fd = client->wfd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+				wss_log(WS_LOG_ERROR, "poll failed: %s\n", strerror(errno));
+				return -1;
+			}
+			continue;
+		}
+		wss_log(WS_LOG_WARNING, "sendfile failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return write_file_copy(client, fd, offset, len);
+}
+#endif
+
+int wss_write_file(struct wss_client *client, int fd, off_t offset, size_t len)
+{
+	char preamble[14];
+	struct iovec iov;
+	int res, preamble_bytes;
+
+	if (client->wfragmenting) {
+		wss_log(WS_LOG_ERROR, "Can't send BINARY frame while a fragmented message is in progress\n");
+		return -1;
+	} else if (client->type == WS_CLIENT || client->sendqueue || client->compress_ops || (client->maxfragment && len > client->maxfragment)) {
+		/* The payload has to be masked, compressed, fragmented, or queued, so just read it all into memory */
+		char *buf = malloc(len ? len : 1);
+		size_t total = 0;
+		if (!buf) {
+			wss_log(WS_LOG_ERROR, "Failed to allocate %lu bytes\n", len);
+			return -1;
+		}
+		while (total < len) {
+			ssize_t bytes = pread(fd, buf + total, len - total, offset + (off_t) total);
+			if (bytes <= 0) {
+				wss_log(WS_LOG_ERROR, "Failed to read file: %s\n", bytes ? strerror(errno) : "File too short");
+				free(buf);
+				return -1;
+			}
+			total += (size_t) bytes;
+		}
+		res = wss_write_inplace(client, WS_OPCODE_BINARY, buf, len);
+		free(buf);
+		return res;
+	}
+
+	preamble_bytes = frame_header(preamble, WS_OPCODE_BINARY, len, 1, 0, NULL);
+	wss_debug(2, "Sending WebSocket %s frame from file (length %lu, excl. %d-byte header)\n", opcode_name(WS_OPCODE_BINARY), len, preamble_bytes);
+	STAT_ADD(client, frames_out[WS_OPCODE_BINARY], 1);
+	STAT_ADD(client, bytes_out[WS_OPCODE_BINARY], len);
+	iov.iov_base = preamble;
+	iov.iov_len = (size_t) preamble_bytes;
+	client->wmidframe = len > 0;
+	res = __full_writev(client, &iov, 1);
+	client->wmidframe = 0;
+	if (res) {
+		return -1;
+	}
+#ifdef WS_SENDFILE
+	if (client->wfd >= 0 && !client->write_cb && !client->writev_cb && !client->uring) {
+		/* Since the payload isn't masked, it can go straight from the file to the socket (or kTLS) */
+		return write_file_direct(client, fd, offset, len);
+	}
+#endif
+	return write_file_copy(client, fd, offset, len);
+}
+
+int wss_set_mask_chunk_size(struct wss_client *client, size_t size)
+{
+	char *buf = NULL;
+
+	if (size) {
+		buf = malloc(size);
+		if (!buf) {
+			wss_log(WS_LOG_ERROR, "Failed to allocate %lu-byte staging buffer\n", size);
+			return -1;
+		}
+	}
+	free(client->wstage);
+	client->wstage = buf;
+	client->wstagesize = size;
+	return 0;
+}
+
+/*! \brief Max number of messages to send in a single writev in wss_write_batch */
+#define WS_BATCH_SIZE 32
+
+/*! \brief Account for messages in a batch, once they have been written */
+static void batch_sent(struct wss_client *client, const struct wss_msg *msgs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		STAT_ADD(client, frames_out[msgs[i].opcode & 0xf], 1);
+		STAT_ADD(client, bytes_out[msgs[i].opcode & 0xf], msgs[i].payload ? msgs[i].len : 0);
+		control_sent(client, msgs[i].opcode);
+	}
+}
+
+/*! \brief wss_write_batch for clients, where payloads have to be masked into a staging buffer anyway */
+static int write_batch_staged(struct wss_client *client, const struct wss_msg *msgs, int n)
+{
+	char stackbuf[WS_STAGING_SIZE];
+	char *staging = client->wstage ? client->wstage : stackbuf;
+	size_t stagingsize = client->wstage ? client->wstagesize : sizeof(stackbuf);
+	struct iovec iov;
+	size_t used = 0;
+	int i, staged = 0, sent = 0;
+
+#define FLUSH_STAGING() \
+	if (used) { \
+		iov.iov_base = staging; \
+		iov.iov_len = used; \
+		if (__full_writev(client, &iov, 1)) { \
+			return sent ? sent : -1; \
+		} \
+		batch_sent(client, msgs + sent, staged); \
+		sent += staged; \
+		used = 0; \
+		staged = 0; \
+	}
+
+	for (i = 0; i < n; i++) {
+		char preamble[14], mask[4];
+		size_t len = msgs[i].payload ? msgs[i].len : 0;
+		int preamble_bytes;
+
+		gen_mask(&client->prng, mask);
+		preamble_bytes = frame_header(preamble, msgs[i].opcode, len, 1, 0, mask);
+		if (preamble_bytes + len > stagingsize) {
+			/* Won't fit, send what we have so far and then this one by itself */
+			FLUSH_STAGING();
+			if (full_write(client, preamble, (unsigned int) preamble_bytes, msgs[i].payload, len, mask, 0)) {
+				return sent ? sent : -1;
+			}
+			batch_sent(client, msgs + i, 1);
+			sent++;
+			continue;
+		} else if (used + preamble_bytes + len > stagingsize) {
+			FLUSH_STAGING();
+		}
+		memcpy(staging + used, preamble, (size_t) preamble_bytes);
+		wss_mask(staging + used + preamble_bytes, msgs[i].payload, len, mask, 0);
+		STAT_ADD(client, bytes_masked, len);
+		used += preamble_bytes + len;
+		staged++;
+	}
+	FLUSH_STAGING();
+#undef FLUSH_STAGING
+	return sent;
+}
+
+/*! \brief Check that every message in a batch can be sent, before sending any of them */
+static int batch_check(struct wss_client *client, const struct wss_msg *msgs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!WS_OPCODE_VALID(msgs[i].opcode)) {
+			wss_log(WS_LOG_ERROR, "Invalid frame opcode: %d\n", msgs[i].opcode);
+			return -1;
+		} else if (client->wfragmenting && (msgs[i].opcode == WS_OPCODE_TEXT || msgs[i].opcode == WS_OPCODE_BINARY)) {
+			/* Only control frames can be interleaved with fragments */
+			wss_log(WS_LOG_ERROR, "Can't send %s frame while a fragmented message is in progress\n", opcode_name(msgs[i].opcode));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Write a batch of messages directly, bypassing the send queue */
+static int write_batch(struct wss_client *client, const struct wss_msg *msgs, int n)
+{
+	char preambles[WS_BATCH_SIZE][14];
+	struct iovec iov[2 * WS_BATCH_SIZE];
+	int i, sent = 0;
+
+	if (batch_check(client, msgs, n)) {
+		return -1;
+	}
+
+	wss_debug(2, "Sending batch of %d WebSocket frames\n", n);
+	if (client->type == WS_CLIENT) {
+		return write_batch_staged(client, msgs, n);
+	}
+
+	while (sent < n) {
+		int count = n - sent > WS_BATCH_SIZE ? WS_BATCH_SIZE : n - sent;
+		for (i = 0; i < count; i++) {
+			const struct wss_msg *msg = &msgs[sent + i];
+			size_t len = msg->payload ? msg->len : 0;
+			iov[2 * i].iov_base = preambles[i];
+			iov[2 * i].iov_len = (size_t) frame_header(preambles[i], msg->opcode, len, 1, 0, NULL);
+			iov[2 * i + 1].iov_base = (void *) msg->payload;
+			iov[2 * i + 1].iov_len = len;
+		}
+		if (__full_writev(client, iov, 2 * count)) {
+			/* Count the frames that went out completely */
+			for (i = 0; i < count && !iov[2 * i].iov_len && !iov[2 * i + 1].iov_len; i++);
+			batch_sent(client, msgs + sent, i);
+			sent += i;
+			return sent ? sent : -1;
+		}
+		batch_sent(client, msgs + sent, count);
+		sent += count;
+	}
+	return sent;
+}
+
+int wss_write_batch(struct wss_client *client, const struct wss_msg *msgs, int n)
+{
+	int i, notify = 0;
+
+	if (!client->sendqueue) {
+		return write_batch(client, msgs, n);
+	} else if (batch_check(client, msgs, n)) {
+		return -1;
+	}
+	/* Queue them all before draining, so they still go out together */
+	for (i = 0; i < n; i++) {
+		int res = sendq_push(client, NULL, msgs[i].opcode, msgs[i].payload, msgs[i].len);
+		if (res < 0) {
+			break;
+		}
+		notify |= res;
+	}
+	if (i && sendq_kick(client, notify)) {
+		return -1;
+	}
+	return i ? i : -1;
+}
+
+struct wss_encoded_frame {
+	int refcount;
+	enum websocket_type type;	/*!< Type of connection for which this frame was encoded */
+	int opcode;
+	unsigned int compressed:1;	/*!< Payload is compressed (RSV1 set) */
+	size_t hlen;				/*!< Length of header */
+	size_t len;					/*!< Total length of encoded frame (header and payload) */
+	char data[];				/*!< Encoded frame */
+};
+
+static struct wss_encoded_frame *encode_frame(enum websocket_type type, int opcode, const char *payload, size_t len, int rsv1)
+{
+	struct wss_encoded_frame *frame;
+	char preamble[14], mask[4];
+	int preamble_bytes;
+
+	if (!WS_OPCODE_VALID(opcode)) {
+		wss_log(WS_LOG_ERROR, "Invalid frame opcode: %d\n", opcode);
+		return NULL;
+	}
+	if (!payload) {
+		len = 0;
+	}
+
+	if (type == WS_CLIENT) {
+		gen_mask(&encode_prng, mask);
+	}
+	preamble_bytes = frame_header(preamble, opcode, len, 1, rsv1, type == WS_CLIENT ? mask : NULL);
+
+	/* Header and payload in a single allocation */
+	frame = malloc(sizeof(*frame) + (size_t) preamble_bytes + len);
+	if (!frame) {
+		wss_log(WS_LOG_ERROR, "malloc failed\n");
+		return NULL;
+	}
+	frame->refcount = 1;
+	frame->type = type;
+	frame->opcode = opcode;
+	frame->compressed = rsv1 ? 1 : 0;
+	frame->hlen = (size_t) preamble_bytes;
+	frame->len = (size_t) preamble_bytes + len;
+	memcpy(frame->data, preamble, (size_t) preamble_bytes);
+	if (type == WS_CLIENT) {
+		wss_mask(frame->data + preamble_bytes, payload, len, mask, 0);
+	} else if (len) {
+		memcpy(frame->data + preamble_bytes, payload, len);
+	}
+	return frame;
+}
+
+struct wss_encoded_frame *wss_encode_frame(enum websocket_type type, int opcode, const char *payload, size_t len)
+{
+	return encode_frame(type, opcode, payload, len, 0);
+}
+
+struct wss_encoded_frame *wss_encode_compressed_frame(enum websocket_type type, int opcode, const char *payload, size_t len, const struct wss_compression_ops *ops, void *ctx)
+{
+	struct wss_encoded_frame *frame;
+	char *compressed;
+	size_t outlen;
+	int res;
+
+	if ((opcode != WS_OPCODE_TEXT && opcode != WS_OPCODE_BINARY) || !payload || !len) {
+		return encode_frame(type, opcode, payload, len, 0); /* Nothing to compress */
+	}
+	res = ops->compress(ctx, payload, len, &compressed, &outlen);
+	if (res < 0) {
+		wss_log(WS_LOG_ERROR, "Failed to compress %lu-byte payload\n", len);
+		return NULL;
+	} else if (res > 0) {
+		return encode_frame(type, opcode, payload, len, 0);
+	}
+	wss_debug(4, "Compressed %lu-byte payload to %lu bytes\n", len, outlen);
+	frame = encode_frame(type, opcode, compressed, outlen, 1);
+	free(compressed);
+	return frame;
+}
+
+struct wss_encoded_frame *wss_encoded_frame_ref(struct wss_encoded_frame *frame)
+{
+	__atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+	return frame;
+}
+
+void wss_encoded_frame_unref(struct wss_encoded_frame *frame)
+{
+	if (!__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL)) {
+		free(frame);
+	}
+}
+
+static int write_encoded(struct wss_client *client, struct wss_encoded_frame *frame)
+{
+	struct iovec iov;
+	int res;
+
+	if (frame->type != client->type) {
+		wss_log(WS_LOG_ERROR, "Frame was encoded for a %s connection\n", frame->type == WS_CLIENT ? "client" : "server");
+		return -1;
+	} else if (frame->compressed && !client->compress_ops) {
+		wss_log(WS_LOG_ERROR, "Frame is compressed, but compression is not enabled for this connection\n");
+		return -1;
+	}
+
+	wss_debug(2, "Sending encoded WebSocket %s frame (%lu bytes)\n", opcode_name(frame->opcode), frame->len);
+	STAT_ADD(client, frames_out[frame->opcode], 1);
+	STAT_ADD(client, bytes_out[frame->opcode], frame->len - frame->hlen);
+	control_sent(client, frame->opcode);
+	iov.iov_base = frame->data;
+	iov.iov_len = frame->len;
+	client->wdroppable = (frame->opcode == WS_OPCODE_TEXT || frame->opcode == WS_OPCODE_BINARY) && !frame->compressed;
+	res = __full_writev(client, &iov, 1);
+	client->wdroppable = 0;
+	return res;
+}
+
+int wss_write_encoded(struct wss_client *client, struct wss_encoded_frame *frame)
+{
+	if (client->sendqueue) {
+		return sendq_add(client, frame, frame->opcode, NULL, 0);
+	}
+	return write_encoded(client, frame);
+}
+
+/*! \brief Drop the oldest data messages taken off the send queue, until what's left fits under the high watermark */
+static struct wss_sendmsg *sendq_drop(struct wss_client *client, struct wss_sendmsg *list)
+{
+	struct wss_sendmsg **prev = &list, *msg;
+	size_t queued = client->outbytes;
+	unsigned int dropped = 0;
+
+	for (msg = list; msg; msg = msg->next) {
+		queued += SENDMSG_BYTES(msg);
+	}
+	while ((msg = *prev) && queued > client->wm->high) {
+		if ((msg->opcode == WS_OPCODE_TEXT || msg->opcode == WS_OPCODE_BINARY) && (!msg->encoded || !msg->encoded->compressed)) {
+			*prev = msg->next;
+			queued -= SENDMSG_BYTES(msg);
+			msg->next = NULL;
+			sendq_free(msg);
+			dropped++;
+		} else {
+			prev = &msg->next;
+		}
+	}
+	if (dropped) {
+		wss_log(WS_LOG_WARNING, "Dropped %u queued message%s\n", dropped, dropped == 1 ? "" : "s");
+	}
+	return list;
+}
+
+/*!
+ * \brief Send messages taken off the send queue
+ * \param client
+ * \param head Messages, most recent first. Freed by this function.
+ */
+static int sendq_write(struct wss_client *client, struct wss_sendmsg *head)
+{
+	struct wss_msg msgs[WS_BATCH_SIZE];
+	struct wss_sendmsg *list = NULL, *pongs = NULL, *msg, *start;
+	int n, res = 0;
+
+	/* Put them back in the order they were queued, with PONGs first */
+	while (head) {
+		msg = head;
+		head = head->next;
+		if (msg->opcode == WS_OPCODE_PONG && !msg->encoded) {
+			msg->next = pongs;
+			pongs = msg;
+		} else {
+			msg->next = list;
+			list = msg;
+		}
+	}
+	if (pongs) {
+		for (msg = pongs; msg->next; msg = msg->next);
+		msg->next = list;
+		list = pongs;
+	}
+	if (client->wm && client->wm->policy == WS_BACKPRESSURE_DROP) {
+		list = sendq_drop(client, list);
+	}
+
+	for (msg = list; msg && !res;) {
+		if (msg->encoded) {
+			res = write_encoded(client, msg->encoded);
+			msg = msg->next;
+			continue;
+		}
+		/* Messages that need no compression or fragmentation go out together, in one writev */
+		for (start = msg, n = 0; msg && n < WS_BATCH_SIZE && !msg->encoded && !client->compress_ops && (!client->maxfragment || msg->len <= client->maxfragment); msg = msg->next, n++) {
+			msgs[n].opcode = msg->opcode;
+			msgs[n].payload = msg->data;
+			msgs[n].len = msg->len;
+		}
+		if (n) {
+			res = write_batch(client, msgs, n) == n ? 0 : -1;
+		} else {
+			res = write_message(client, start->opcode, start->data, start->len, 1);
+			msg = start->next;
+		}
+	}
+	sendq_free(list);
+	return res;
+}
+
+void wss_set_send_queue(struct wss_client *client, int enable, void (*notify)(void *data))
+{
+	client->notify_cb = notify;
+	if (!enable && client->sendqueue) {
+		wss_drain(client);
+	}
+	client->sendqueue = enable ? 1 : 0;
+}
+
+int wss_drain(struct wss_client *client)
+{
+	struct wss_sendmsg *list;
+	int res = 0;
+
+	do {
+		if (__atomic_exchange_n(&client->draining, 1, __ATOMIC_SEQ_CST)) {
+			return 0; /* Another thread is already draining, and will pick up anything we would have */
+		}
+		if (__atomic_load_n(&client->overflow, __ATOMIC_RELAXED) == WS_OVERFLOW_REQUESTED) {
+			overflow_close(client);
+		}
+		while ((list = __atomic_exchange_n(&client->sendq, NULL, __ATOMIC_SEQ_CST))) {
+			size_t bytes = 0;
+			struct wss_sendmsg *msg;
+			for (msg = list; msg; msg = msg->next) {
+				bytes += SENDMSG_BYTES(msg);
+			}
+			if (__atomic_load_n(&client->sendqerr, __ATOMIC_RELAXED) || __atomic_load_n(&client->overflow, __ATOMIC_RELAXED)) {
+				sendq_free(list); /* Can't send anything after a failure */
+				res = -1;
+			} else if (sendq_write(client, list)) {
+				__atomic_store_n(&client->sendqerr, 1, __ATOMIC_RELAXED);
+				res = -1;
+			}
+			__atomic_fetch_sub(&client->sendqbytes, bytes, __ATOMIC_RELAXED);
+			if (client->wm) {
+				watermark_check(client, 0);
+			}
+		}
+		__atomic_store_n(&client->draining, 0, __ATOMIC_SEQ_CST);
+		/* Something may have been queued just before we stopped draining */
+	} while (__atomic_load_n(&client->sendq, __ATOMIC_SEQ_CST));
+	return res;
+}
+
+/*! \brief Wait for the drainer to bring the send queue back down to the low watermark */
+static void sendq_wait(struct wss_client *client)
+{
+	struct wss_watermarks *wm = client->wm;
+
+	__atomic_fetch_add(&wm->waiters, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&wm->lock);
+	while (__atomic_load_n(&wm->above, __ATOMIC_RELAXED) && !__atomic_load_n(&client->sendqerr, __ATOMIC_RELAXED)) {
+		struct timespec ts;
+		/* Wake up periodically, in case the drainer simply went away, or nothing is left for it to do */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&wm->cond, &wm->lock, &ts);
+		if (!client->notify_cb) {
+			pthread_mutex_unlock(&wm->lock);
+			wss_drain(client);
+			pthread_mutex_lock(&wm->lock);
+		}
+	}
+	pthread_mutex_unlock(&wm->lock);
+	__atomic_fetch_sub(&wm->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief Add a message to the send queue, without sending it
+ * \retval 1 if the drainer needs to be notified, 0 if not, -1 on failure
+ */
+static int sendq_push(struct wss_client *client, struct wss_encoded_frame *encoded, int opcode, const char *payload, size_t len)
+{
+	struct wss_watermarks *wm = client->wm;
+	struct wss_sendmsg *msg, *head;
+	int notify;
+
+	if (!WS_OPCODE_VALID(opcode)) {
+		wss_log(WS_LOG_ERROR, "Invalid frame opcode: %d\n", opcode);
+		return -1;
+	} else if (__atomic_load_n(&client->sendqerr, __ATOMIC_RELAXED) || __atomic_load_n(&client->overflow, __ATOMIC_RELAXED)) {
+		return -1;
+	}
+	if (!payload) {
+		len = 0;
+	}
+	msg = malloc(sizeof(*msg) + len);
+	if (!msg) {
+		wss_log(WS_LOG_ERROR, "malloc failed\n");
+		return -1;
+	}
+	msg->encoded = encoded ? wss_encoded_frame_ref(encoded) : NULL;
+	msg->opcode = opcode;
+	msg->len = len;
+	if (len) {
+		memcpy(msg->data, payload, len);
+	}
+
+	__atomic_fetch_add(&client->sendqbytes, SENDMSG_BYTES(msg), __ATOMIC_RELAXED);
+	head = __atomic_load_n(&client->sendq, __ATOMIC_RELAXED);
+	do {
+		msg->next = head;
+	} while (!__atomic_compare_exchange_n(&client->sendq, &head, msg, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	notify = !head;
+
+	if (wm) {
+		watermark_check(client, 0);
+		if (wm->policy == WS_BACKPRESSURE_CLOSE && wss_outbound_bytes(client) > wm->high) {
+			int expected = WS_OVERFLOW_NONE;
+			/* Only the drainer can write, so leave the rest to it */
+			notify |= __atomic_compare_exchange_n(&client->overflow, &expected, WS_OVERFLOW_REQUESTED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+	return notify;
+}
+
+/*! \brief Send what's been pushed onto the send queue (or notify the drainer) */
+static int sendq_kick(struct wss_client *client, int notify)
 {
-	return frame->data;
+	struct wss_watermarks *wm = client->wm;
+	int res = 0;
+
+	if (!client->notify_cb) {
+		res = wss_drain(client); /* Send it ourselves, unless someone else already is */
+	} else if (notify) {
+		client->notify_cb(client->data);
+	}
+	if (wm && wm->policy == WS_BACKPRESSURE_BLOCK && __atomic_load_n(&wm->above, __ATOMIC_RELAXED)) {
+		sendq_wait(client);
+	}
+	return res;
 }
 
-unsigned long wss_frame_payload_length(struct wss_frame *frame)
+/*! \brief Add a message to the send queue, and send it (or notify the drainer) */
+static int sendq_add(struct wss_client *client, struct wss_encoded_frame *encoded, int opcode, const char *payload, size_t len)
 {
-	return frame->length;
+	int notify = sendq_push(client, encoded, opcode, payload, len);
+	if (notify < 0) {
+		return -1;
+	}
+	return sendq_kick(client, notify);
 }
 
-static int __full_write(struct wss_client *client, const char *buf, unsigned int len)
+/* permessage-deflate parameters, as bits, to detect duplicates */
+#define DEFLATE_PARAM_SERVER_NCT	(1 << 0)
+#define DEFLATE_PARAM_CLIENT_NCT	(1 << 1)
+#define DEFLATE_PARAM_SERVER_BITS	(1 << 2)
+#define DEFLATE_PARAM_CLIENT_BITS	(1 << 3)
+
+#define DEFLATE_TOKEN "permessage-deflate"
+#define STRLEN(s) (sizeof(s) - 1)
+
+/*!
+ * \brief Parse the parameters of a single permessage-deflate offer or response (RFC 7692 7.1)
+ * \param s Start of the extension (the extension name)
+ * \param end End of the extension (the next comma, or end of string)
+ * \param[out] params Parameters specified. Window bits are 0 if not specified, or -1 for a client_max_window_bits with no value.
+ * \return Bitmask of the parameters that were present, -1 if this is not a valid permessage-deflate extension
+ */
+static int parse_deflate_params(const char *s, const char *end, struct wss_deflate_params *params)
 {
-	while (len > 0) {
-		ssize_t res;
-		res = __write_cb(client, buf, len);
-		if (res > 0) {
-			buf += res;
-			len -= res;
+	int present = 0;
+
+	memset(params, 0, sizeof(*params));
+	while (s < end && (*s == ' ' || *s == '\t')) {
+		s++;
+	}
+	if ((size_t) (end - s) < STRLEN(DEFLATE_TOKEN) || strncasecmp(s, DEFLATE_TOKEN, STRLEN(DEFLATE_TOKEN))) {
+		return -1;
+	}
+	s += STRLEN(DEFLATE_TOKEN);
+
+	for (;;) {
+		const char *name;
+		size_t namelen;
+		int bit, value = -1;
+
+		while (s < end && (*s == ' ' || *s == '\t')) {
+			s++;
+		}
+		if (s == end) {
+			break;
+		} else if (*s++ != ';') {
+			return -1; /* Not permessage-deflate, or garbage after it */
+		}
+		while (s < end && (*s == ' ' || *s == '\t')) {
+			s++;
+		}
+		name = s;
+		while (s < end && *s != '=' && *s != ';' && *s != ' ' && *s != '\t') {
+			s++;
+		}
+		namelen = (size_t) (s - name);
+		while (s < end && (*s == ' ' || *s == '\t')) {
+			s++;
+		}
+		if (s < end && *s == '=') {
+			int quoted;
+			s++;
+			while (s < end && (*s == ' ' || *s == '\t')) {
+				s++;
+			}
+			quoted = s < end && *s == '"';
+			if (quoted) {
+				s++;
+			}
+			/* The only parameter values allowed are window sizes, 1 or 2 digits */
+			value = 0;
+			if (s == end || *s < '0' || *s > '9') {
+				return -1;
+			}
+			while (s < end && *s >= '0' && *s <= '9') {
+				value = value * 10 + (*s++ - '0');
+				if (value > 15) {
+					return -1;
+				}
+			}
+			if (quoted && (s == end || *s++ != '"')) {
+				return -1;
+			}
+			if (value < 8) {
+				return -1;
+			}
+		}
+
+#define PARAM_IS(n) (namelen == STRLEN(n) && !strncasecmp(name, n, namelen))
+		if (PARAM_IS("server_no_context_takeover")) {
+			bit = DEFLATE_PARAM_SERVER_NCT;
+			params->server_no_context_takeover = 1;
+		} else if (PARAM_IS("client_no_context_takeover")) {
+			bit = DEFLATE_PARAM_CLIENT_NCT;
+			params->client_no_context_takeover = 1;
+		} else if (PARAM_IS("server_max_window_bits")) {
+			bit = DEFLATE_PARAM_SERVER_BITS;
+			if (value < 0) {
+				return -1; /* Value is mandatory */
+			}
+			params->server_max_window_bits = value;
+		} else if (PARAM_IS("client_max_window_bits")) {
+			bit = DEFLATE_PARAM_CLIENT_BITS;
+			params->client_max_window_bits = value; /* Value is optional in offers */
 		} else {
-			wss_log(WS_LOG_WARNING, "write returned %d: %s\n", (int) res, strerror(errno));
+			wss_debug(3, "Unknown permessage-deflate parameter '%.*s'\n", (int) namelen, name);
+			return -1;
+		}
+#undef PARAM_IS
+		if (bit != DEFLATE_PARAM_SERVER_BITS && bit != DEFLATE_PARAM_CLIENT_BITS && value >= 0) {
+			return -1; /* Boolean parameters don't take values */
+		} else if (present & bit) {
+			return -1; /* Duplicate parameter */
+		}
+		present |= bit;
+	}
+	return present;
+}
+
+/*! \brief Window bits to use, given the value from the parameters (0 for default) */
+#define WINDOW_BITS(x) ((x) > 0 ? (x) : 15)
+
+int wss_deflate_negotiate(const char *offers, const struct wss_deflate_params *local, struct wss_deflate_params *agreed, char *buf, size_t len)
+{
+	struct wss_deflate_params defaults;
+	const char *s = offers;
+
+	if (!local) {
+		memset(&defaults, 0, sizeof(defaults));
+		local = &defaults;
+	}
+
+	/* Offers are in order of the client's preference, so accept the first one we can */
+	while (*s) {
+		struct wss_deflate_params offer;
+		const char *end = strchr(s, ',');
+		int present, res;
+
+		if (!end) {
+			end = s + strlen(s);
+		}
+		present = parse_deflate_params(s, end, &offer);
+		s = *end ? end + 1 : end;
+		if (present < 0) {
+			continue;
+		}
+		if (offer.server_max_window_bits == 8 || offer.client_max_window_bits == 8) {
+			/* zlib can't produce raw deflate streams with a 256-byte window, so decline rather than risk mismatched windows */
+			wss_debug(3, "Declining offer with a window size of 8 bits\n");
+			continue;
+		}
+
+		agreed->server_no_context_takeover = offer.server_no_context_takeover || local->server_no_context_takeover;
+		agreed->client_no_context_takeover = offer.client_no_context_takeover || local->client_no_context_takeover;
+		agreed->server_max_window_bits = WINDOW_BITS(local->server_max_window_bits);
+		if (offer.server_max_window_bits && offer.server_max_window_bits < agreed->server_max_window_bits) {
+			agreed->server_max_window_bits = offer.server_max_window_bits;
+		}
+		agreed->client_max_window_bits = 15;
+		if (present & DEFLATE_PARAM_CLIENT_BITS) {
+			/* We can only limit the client's window if it indicated support for that */
+			agreed->client_max_window_bits = WINDOW_BITS(local->client_max_window_bits);
+			if (offer.client_max_window_bits > 0 && offer.client_max_window_bits < agreed->client_max_window_bits) {
+				agreed->client_max_window_bits = offer.client_max_window_bits;
+			}
+		}
+
+		res = snprintf(buf, len, DEFLATE_TOKEN "%s%s",
+			agreed->server_no_context_takeover ? "; server_no_context_takeover" : "",
+			agreed->client_no_context_takeover ? "; client_no_context_takeover" : "");
+		if (res >= 0 && (size_t) res < len && agreed->server_max_window_bits < 15) {
+			res += snprintf(buf + res, len - (size_t) res, "; server_max_window_bits=%d", agreed->server_max_window_bits);
+		}
+		if (res >= 0 && (size_t) res < len && agreed->client_max_window_bits < 15) {
+			res += snprintf(buf + res, len - (size_t) res, "; client_max_window_bits=%d", agreed->client_max_window_bits);
+		}
+		if (res < 0 || (size_t) res >= len) {
+			wss_log(WS_LOG_ERROR, "Buffer too small for extension response\n");
 			return -1;
 		}
+		return 1;
 	}
 	return 0;
 }
 
-static int full_write(struct wss_client *client, const char *buf, unsigned int len, const char mask[4])
+int wss_deflate_offer(const struct wss_deflate_params *params, char *buf, size_t len)
 {
-	if (client->type == WS_SERVER || !mask) {
-		return __full_write(client, buf, len);
+	int res;
+
+	if (!params) {
+		/* Offer the default parameters, and allow the server to limit our window size */
+		res = snprintf(buf, len, DEFLATE_TOKEN "; client_max_window_bits");
 	} else {
-		/* We need to mask the data we send to the server.
-		 * Can we do it without additional allocations? You bet! */
-		char masked[8192]; /* This MUST be a multiple of 4, so that i % 4 is correct each round */
-		const char *pos = buf;
-		unsigned int left = len;
-		/* Copy and send it in chunks */
-		while (left > 0) {
-			int res;
-			unsigned int i, sendbytes = left > sizeof(masked) ? sizeof(masked) : left;
-			/* Mask the data */
-			for (i = 0; i < sendbytes; i++) {
-				masked[i] = pos[i] ^ mask[i % 4];
+		char serverbits[48] = "", clientbits[16] = "";
+		if (params->server_max_window_bits && params->server_max_window_bits < 15) {
+			snprintf(serverbits, sizeof(serverbits), "; server_max_window_bits=%d", params->server_max_window_bits);
+		}
+		if (params->client_max_window_bits && params->client_max_window_bits < 15) {
+			snprintf(clientbits, sizeof(clientbits), "=%d", params->client_max_window_bits);
+		}
+		res = snprintf(buf, len, DEFLATE_TOKEN "%s%s%s; client_max_window_bits%s",
+			params->server_no_context_takeover ? "; server_no_context_takeover" : "",
+			params->client_no_context_takeover ? "; client_no_context_takeover" : "",
+			serverbits, clientbits);
+	}
+	if (res < 0 || (size_t) res >= len) {
+		wss_log(WS_LOG_ERROR, "Buffer too small for extension offer\n");
+		return -1;
+	}
+	return res;
+}
+
+int wss_deflate_accept(const char *response, struct wss_deflate_params *agreed)
+{
+	if (strchr(response, ',') || parse_deflate_params(response, response + strlen(response), agreed) < 0) {
+		wss_log(WS_LOG_ERROR, "Invalid permessage-deflate response: %s\n", response);
+		return -1;
+	} else if (agreed->client_max_window_bits < 0) {
+		wss_log(WS_LOG_ERROR, "Server must specify a value for client_max_window_bits\n");
+		return -1;
+	} else if (agreed->client_max_window_bits == 8) {
+		wss_log(WS_LOG_ERROR, "Unsupported client_max_window_bits=8\n");
+		return -1;
+	}
+	agreed->server_max_window_bits = WINDOW_BITS(agreed->server_max_window_bits);
+	agreed->client_max_window_bits = WINDOW_BITS(agreed->client_max_window_bits);
+	return 0;
+}
+
+/* Opening handshake (RFC 6455 4) */
+
+/*! \brief GUID appended to Sec-WebSocket-Key to compute Sec-WebSocket-Accept */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_generic(uint32_t state[5], const unsigned char *data, size_t nblocks)
+{
+	while (nblocks--) {
+		uint32_t w[80];
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		int i;
+
+		for (i = 0; i < 16; i++) {
+			w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 | (uint32_t) data[4 * i + 2] << 8 | data[4 * i + 3];
+		}
+		for (i = 16; i < 80; i++) {
+			w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		}
+		for (i = 0; i < 80; i++) {
+			uint32_t f, k, t;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
 			}
-			/* Send it */
-			res = __full_write(client, masked, sendbytes);
-			if (res < 0) {
-				return res;
+			t = ROL32(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = ROL32(b, 30);
+			b = a;
+			a = t;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		data += 64;
+	}
+}
+
+#ifdef WS_MASK_X86
+/*! \brief 4 rounds of SHA-1, also advancing the message schedule */
+#define SHA1_ROUNDS4(ea, eb, m0, m1, m2, m3, f) \
+	ea = _mm_sha1nexte_epu32(ea, m0); \
+	eb = abcd; \
+	m1 = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+	m3 = _mm_sha1msg1_epu32(m3, m0); \
+	m2 = _mm_xor_si128(m2, m0);
+
+static __attribute__((target("sha,ssse3,sse4.1"))) void sha1_shani(uint32_t state[5], const unsigned char *data, size_t nblocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, e0, e1, m0, m1, m2, m3, abcd_save, e0_save;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+	e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+
+	while (nblocks--) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		/* Rounds 0-15 consume the message block, after which the schedule is extended 4 words at a time */
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), bswap);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), bswap);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), bswap);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), bswap);
+		SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 0);
+		SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 0);
+		SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+		SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 1);
+		SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 1);
+		SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 1);
+		SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+		SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+		SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 2);
+		SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 2);
+		SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 2);
+		SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+		SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 3);
+		SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 3);
+		SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 3);
+		SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 3);
+		SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		data += 64;
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+#undef SHA1_ROUNDS4
+#endif
+
+static void (*sha1_impl)(uint32_t state[5], const unsigned char *data, size_t nblocks) = sha1_generic;
+
+/*! \brief Use the SHA extensions, if this CPU has them */
+static void __attribute__((constructor)) sha1_init(void)
+{
+#ifdef WS_MASK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+		sha1_impl = sha1_shani;
+	}
+#endif
+}
+
+/*! \brief SHA-1 digest of the concatenation of two strings */
+static void sha1(const char *a, size_t alen, const char *b, size_t blen, unsigned char digest[20])
+{
+	uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	unsigned char block[128];
+	const char *parts[2] = { a, b };
+	size_t lens[2] = { alen, blen };
+	uint64_t bits = (uint64_t) (alen + blen) * 8;
+	size_t used = 0, nblocks;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		const unsigned char *p = (const unsigned char *) parts[i];
+		size_t n = lens[i];
+		while (n > 0) {
+			size_t take;
+			if (!used && n >= 64) {
+				/* Hash whole blocks where they are */
+				nblocks = n / 64;
+				sha1_impl(state, p, nblocks);
+				p += nblocks * 64;
+				n -= nblocks * 64;
+				continue;
 			}
-			pos += sendbytes;
-			left -= sendbytes;
+			take = 64 - used < n ? 64 - used : n;
+			memcpy(block + used, p, take);
+			used += take;
+			p += take;
+			n -= take;
+			if (used == 64) {
+				sha1_impl(state, block, 1);
+				used = 0;
+			}
+		}
+	}
+	/* Padding, and the length in bits */
+	block[used++] = 0x80;
+	nblocks = used > 56 ? 2 : 1;
+	memset(block + used, 0, nblocks * 64 - used);
+	for (i = 0; i < 8; i++) {
+		block[nblocks * 64 - 1 - (size_t) i] = (unsigned char) (bits >> (8 * i));
+	}
+	sha1_impl(state, block, nblocks);
+	for (i = 0; i < 20; i++) {
+		digest[i] = (unsigned char) (state[i / 4] >> (24 - 8 * (i % 4)));
+	}
+}
+
+static void base64_encode(const unsigned char *in, size_t len, char *out)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		*out++ = table[in[i] >> 2];
+		*out++ = table[((in[i] & 0x3) << 4) | (in[i + 1] >> 4)];
+		*out++ = table[((in[i + 1] & 0xf) << 2) | (in[i + 2] >> 6)];
+		*out++ = table[in[i + 2] & 0x3f];
+	}
+	if (i < len) {
+		*out++ = table[in[i] >> 2];
+		if (i + 1 < len) {
+			*out++ = table[((in[i] & 0x3) << 4) | (in[i + 1] >> 4)];
+			*out++ = table[(in[i + 1] & 0xf) << 2];
+		} else {
+			*out++ = table[(in[i] & 0x3) << 4];
+			*out++ = '=';
 		}
+		*out++ = '=';
+	}
+	*out = '\0';
+}
+
+void wss_handshake_accept(const char *key, size_t keylen, char accept[29])
+{
+	unsigned char digest[20];
+
+	sha1(key, keylen, WS_GUID, sizeof(WS_GUID) - 1, digest);
+	base64_encode(digest, sizeof(digest), accept);
+}
+
+int wss_handshake_key(char key[25])
+{
+	unsigned char nonce[16];
+
+	if (getrandom(nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+		wss_log(WS_LOG_ERROR, "getrandom failed: %s\n", strerror(errno));
+		return -1;
 	}
+	base64_encode(nonce, sizeof(nonce), key);
 	return 0;
 }
 
-static int wss_frame_write(struct wss_client *client, int opcode, const char *payload, size_t len, int fin)
+/*! \brief Whether a comma separated list (e.g. of the Connection header) contains a token, case-insensitively */
+static int has_token(const struct wss_str *list, const char *token)
 {
-	char preamble[14]; /* At least 2, maximum of 10, +4 for mask if present */
-	const char *mask = NULL;
-	unsigned char payload_len;
-	int preamble_bytes = 2;
-	int res = 0;
+	size_t toklen = strlen(token);
+	const char *s = list->s, *end = list->s + list->len;
 
-	if (!WS_OPCODE_VALID(opcode)) {
-		wss_log(WS_LOG_ERROR, "Invalid frame opcode: %d\n", opcode);
+	while (s && s < end) {
+		const char *next = memchr(s, ',', (size_t) (end - s));
+		const char *e = next ? next : end;
+		while (s < e && (*s == ' ' || *s == '\t')) {
+			s++;
+		}
+		while (e > s && (e[-1] == ' ' || e[-1] == '\t')) {
+			e--;
+		}
+		if ((size_t) (e - s) == toklen && !strncasecmp(s, token, toklen)) {
+			return 1;
+		}
+		s = next ? next + 1 : end;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Find the end of a line of an HTTP request or response
+ * \param line Start of the line
+ * \param end Start of the blank line ending the headers
+ * \return The CR ending the line (there is always one, since the line before the blank line ends in CRLF)
+ */
+static const char *http_eol(const char *line, const char *end)
+{
+	return memmem(line, (size_t) (end - line), "\r\n", 2);
+}
+
+/*!
+ * \brief Parse the header on a line of an HTTP request or response
+ * \param line Start of the line
+ * \param end Start of the blank line ending the headers
+ * \param[out] name, value Header name and value (excluding surrounding whitespace)
+ * \return Start of the next line, or NULL if the line is malformed
+ */
+static const char *http_header(const char *line, const char *end, struct wss_str *name, struct wss_str *value)
+{
+	const char *eol = http_eol(line, end);
+	const char *colon = memchr(line, ':', (size_t) (eol - line));
+
+	if (!colon || colon == line) {
+		return NULL;
+	}
+	name->s = line;
+	name->len = (size_t) (colon - line);
+	for (colon++; colon < eol && (*colon == ' ' || *colon == '\t'); colon++);
+	value->s = colon;
+	value->len = (size_t) (eol - colon);
+	while (value->len && (value->s[value->len - 1] == ' ' || value->s[value->len - 1] == '\t')) {
+		value->len--;
+	}
+	return eol + 2;
+}
+
+#define HEADER_IS(name, literal) ((name).len == sizeof(literal) - 1 && !strncasecmp((name).s, literal, sizeof(literal) - 1))
+
+/*!
+ * \brief Find the end of an HTTP request or response
+ * \return Start of the blank line ending the headers, or NULL if it hasn't been received yet
+ */
+static const char *http_end(const char *buf, size_t len)
+{
+	const char *end = memmem(buf, len, "\r\n\r\n", 4);
+	return end ? end + 2 : NULL;
+}
+
+int wss_handshake_parse(const char *buf, size_t len, struct wss_handshake *hs)
+{
+	const char *end, *eol, *line, *sp;
+	struct wss_str upgrade = { NULL, 0 }, connection = { NULL, 0 };
+	size_t i;
+
+	memset(hs, 0, sizeof(*hs));
+	end = http_end(buf, len);
+	if (!end) {
+		return 0;
+	}
+	hs->length = (size_t) (end + 2 - buf);
+
+	/* Request line: GET /path HTTP/1.1 */
+	hs->status = 400;
+	eol = http_eol(buf, end);
+	if (eol - buf < 4 || memcmp(buf, "GET ", 4)) {
+		wss_debug(1, "Handshake request is not a GET request\n");
+		return -1;
+	}
+	sp = memchr(buf + 4, ' ', (size_t) (eol - buf - 4));
+	if (!sp || sp == buf + 4 || eol - sp != 9 || memcmp(sp, " HTTP/1.", 8) || sp[8] < '1' || sp[8] > '9') {
+		wss_debug(1, "Invalid handshake request line\n");
 		return -1;
 	}
+	hs->path.s = buf + 4;
+	hs->path.len = (size_t) (sp - buf - 4);
 
-	/* Zero allocation frame write */
+	for (line = eol + 2; line < end; ) {
+		struct wss_str name, value;
+		line = http_header(line, end, &name, &value);
+		if (!line) {
+			wss_debug(1, "Malformed handshake request header\n");
+			return -1;
+		}
+		if (HEADER_IS(name, "Host")) {
+			hs->host = value;
+		} else if (HEADER_IS(name, "Upgrade")) {
+			upgrade = value;
+		} else if (HEADER_IS(name, "Connection")) {
+			connection = value;
+		} else if (HEADER_IS(name, "Sec-WebSocket-Key")) {
+			hs->key = value;
+		} else if (HEADER_IS(name, "Sec-WebSocket-Version")) {
+			hs->version = 0;
+			for (i = 0; i < value.len && i < 3 && value.s[i] >= '0' && value.s[i] <= '9'; i++) {
+				hs->version = hs->version * 10 + (value.s[i] - '0');
+			}
+			if (i != value.len) {
+				hs->version = -1; /* Not a version we'd understand */
+			}
+		} else if (HEADER_IS(name, "Sec-WebSocket-Protocol")) {
+			hs->protocols = value;
+		} else if (HEADER_IS(name, "Sec-WebSocket-Extensions")) {
+			if (hs->nextensions < WS_HANDSHAKE_MAX_EXTENSIONS) {
+				hs->extensions[hs->nextensions++] = value;
+			}
+		} else if (HEADER_IS(name, "Origin")) {
+			hs->origin = value;
+		}
+	}
 
-	memset(&preamble, 0, 2); /* Only necessary to zero out the first 2 bytes. */
-	if (fin) {
-		preamble[0] |= BIT0;
+	if (!hs->host.s || !hs->host.len) {
+		wss_debug(1, "Handshake request has no Host header\n");
+		return -1;
+	} else if (!upgrade.s || !has_token(&upgrade, "websocket") || !connection.s || !has_token(&connection, "upgrade")) {
+		wss_debug(1, "Request is not a WebSocket upgrade\n");
+		return -1;
+	} else if (hs->key.len != 24 || hs->key.s[22] != '=' || hs->key.s[23] != '=') {
+		wss_debug(1, "Invalid Sec-WebSocket-Key: %.*s\n", (int) hs->key.len, hs->key.s ? hs->key.s : "");
+		return -1;
 	}
-	/* Set the 4-byte opcode (higher order bits of opcode will be 0s) */
-	preamble[0] |= opcode & 0xff;
-	/* No mask in client's direction, only server's */
-	if (client->type == WS_CLIENT) {
-		preamble[1] |= BIT0;
+	for (i = 0; i < 22; i++) {
+		char c = hs->key.s[i];
+		if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '+' || c == '/')) {
+			wss_debug(1, "Invalid Sec-WebSocket-Key: %.*s\n", (int) hs->key.len, hs->key.s);
+			return -1;
+		}
 	}
-	/* Payload length */
-	payload_len = len > 0xffff ? 127 : len > 125 ? 126 : len;
-	preamble[1] |= payload_len & 0x7f;
-	/* Extended payload */
-	if (payload_len == 126) {
-		unsigned short int *xlen = (unsigned short int *) (preamble + 2);
-		*xlen = htons(len);
-		preamble_bytes += 2;
-	} else if (payload_len == 127) {
-		unsigned int *xlen = (unsigned int *) (preamble + 2);
-		*xlen++ = 0; /* Highest order bit is 0 */
-		*xlen = htonl(len);
-		preamble_bytes += 8;
+	if (hs->version != 13) {
+		wss_debug(1, "Unsupported WebSocket version %d\n", hs->version);
+		hs->status = 426;
+		return -1;
 	}
-	if (!res && client->type == WS_CLIENT) {
-		/* Need a 4-byte mask */
-		srand(time(NULL));
-		mask = preamble + preamble_bytes;
-		preamble[preamble_bytes++] = rand() % 127;
-		preamble[preamble_bytes++] = rand() % 127;
-		preamble[preamble_bytes++] = rand() % 127;
-		preamble[preamble_bytes++] = rand() % 127;
+	hs->status = 0;
+	return 1;
+}
+
+int wss_handshake_response(struct wss_handshake *hs, const char *protocol, const struct wss_deflate_params *local, char *buf, size_t len)
+{
+	char accept[29], extensions[256];
+	int res;
+
+	if (hs->status) {
+		/* Reject it */
+		res = snprintf(buf, len, "HTTP/1.1 %d %s\r\n%sContent-Length: 0\r\nConnection: close\r\n\r\n", hs->status,
+			hs->status == 426 ? "Upgrade Required" : "Bad Request",
+			hs->status == 426 ? "Sec-WebSocket-Version: 13\r\n" : "");
+	} else {
+		hs->deflate = 0;
+		if (local && hs->nextensions) {
+			char offers[2048];
+			size_t used = 0;
+			int i;
+			/* Multiple headers are equivalent to a single comma separated one */
+			for (i = 0; i < hs->nextensions; i++) {
+				if (used + hs->extensions[i].len + 2 >= sizeof(offers)) {
+					break;
+				}
+				if (used) {
+					offers[used++] = ',';
+				}
+				memcpy(offers + used, hs->extensions[i].s, hs->extensions[i].len);
+				used += hs->extensions[i].len;
+			}
+			offers[used] = '\0';
+			res = wss_deflate_negotiate(offers, local, &hs->agreed, extensions, sizeof(extensions));
+			if (res < 0) {
+				return -1;
+			}
+			hs->deflate = res;
+		}
+		wss_handshake_accept(hs->key.s, hs->key.len, accept);
+		res = snprintf(buf, len, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s%s%s%s%s\r\n",
+			accept,
+			protocol ? "Sec-WebSocket-Protocol: " : "", protocol ? protocol : "", protocol ? "\r\n" : "",
+			hs->deflate ? "Sec-WebSocket-Extensions: " : "", hs->deflate ? extensions : "", hs->deflate ? "\r\n" : "");
 	}
-	wss_debug(2, "Sending WebSocket %s frame (length %lu, excl. %d-byte header)\n", opcode_name(opcode), len, preamble_bytes);
-	res |= full_write(client, preamble, preamble_bytes, NULL);
-	if (!res && payload) {
-		res |= full_write(client, payload, len, mask);
+	if (res < 0 || (size_t) res >= len) {
+		wss_log(WS_LOG_ERROR, "Buffer too small for handshake response\n");
+		return -1;
 	}
 	return res;
 }
 
-int wss_write(struct wss_client *client, int opcode, const char *payload, size_t len)
+/*! \brief Minimum size of the receive buffer for data received along with the handshake */
+#define WS_HANDSHAKE_RBUF_SIZE 4096
+
+struct wss_client *wss_handshake_client_new(const struct wss_handshake *hs, const char *buf, size_t len, void *data, int rfd, int wfd)
 {
-	/* Writing is a lot easier than reading...
-	 * First, determine if we're going to send multiple frames or not,
-	 * since we need to set FIN accordingly. */
-	return wss_frame_write(client, opcode, payload, len, 1);
+	struct wss_client *client = wss_client_new(data, rfd, wfd);
+	size_t extra = len > hs->length ? len - hs->length : 0;
+
+	if (!client) {
+		return NULL;
+	}
+	wss_set_client_type(client, WS_SERVER);
+	if (extra) {
+		/* The client didn't wait for our response before sending frames */
+		if (wss_set_read_buffer(client, extra > WS_HANDSHAKE_RBUF_SIZE ? extra : WS_HANDSHAKE_RBUF_SIZE) || rbuf_alloc(client)) {
+			wss_client_destroy(client);
+			return NULL;
+		}
+		memcpy(client->rbuf, buf + hs->length, extra);
+		client->rbuflen = extra;
+	}
+	return client;
+}
+
+int wss_handshake_check_response(const char *buf, size_t len, const char *key, size_t *length)
+{
+	const char *end, *eol, *line;
+	struct wss_str upgrade = { NULL, 0 }, connection = { NULL, 0 }, accept = { NULL, 0 };
+	char expected[29];
+
+	end = http_end(buf, len);
+	if (!end) {
+		return 0;
+	}
+	*length = (size_t) (end + 2 - buf);
+	eol = http_eol(buf, end);
+	if (eol - buf < 12 || memcmp(buf, "HTTP/1.1 101", 12) || (eol - buf > 12 && buf[12] != ' ')) {
+		wss_log(WS_LOG_WARNING, "Upgrade refused: %.*s\n", (int) (eol - buf), buf);
+		return -1;
+	}
+	for (line = eol + 2; line < end; ) {
+		struct wss_str name, value;
+		line = http_header(line, end, &name, &value);
+		if (!line) {
+			wss_log(WS_LOG_WARNING, "Malformed handshake response header\n");
+			return -1;
+		} else if (HEADER_IS(name, "Upgrade")) {
+			upgrade = value;
+		} else if (HEADER_IS(name, "Connection")) {
+			connection = value;
+		} else if (HEADER_IS(name, "Sec-WebSocket-Accept")) {
+			accept = value;
+		}
+	}
+	wss_handshake_accept(key, strlen(key), expected);
+	if (!upgrade.s || !has_token(&upgrade, "websocket") || !connection.s || !has_token(&connection, "upgrade")) {
+		wss_log(WS_LOG_WARNING, "Handshake response is not a WebSocket upgrade\n");
+		return -1;
+	} else if (accept.len != 28 || memcmp(accept.s, expected, 28)) {
+		wss_log(WS_LOG_WARNING, "Incorrect Sec-WebSocket-Accept: %.*s\n", (int) accept.len, accept.s ? accept.s : "");
+		return -1;
+	}
+	return 1;
 }
+#undef HEADER_IS
 
 int wss_error_code(struct wss_client *client)
 {
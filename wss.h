@@ -18,6 +18,10 @@
 
 struct wss_client;
 struct wss_frame;
+struct wss_encoded_frame;
+struct wss_clientset;
+struct wss_uring;
+struct iovec;
 
 #ifndef WS_MAX_PAYLOAD_LENGTH /* Allow applications to override this */
 	/* Max 25 MB */
@@ -38,7 +42,7 @@ struct wss_frame;
 #define WS_OPCODE_PING		0x9
 #define WS_OPCODE_PONG		0xA
 
-#define WS_OPCODE_VALID(x) (x <= WS_OPCODE_TEXT || (x >= WS_OPCODE_CLOSE && x <= WS_OPCODE_PONG))
+#define WS_OPCODE_VALID(x) ((x) <= WS_OPCODE_BINARY || ((x) >= WS_OPCODE_CLOSE && (x) <= WS_OPCODE_PONG))
 
 /* Close status codes */
 #define WS_CLOSE_NORMAL				1000
@@ -55,6 +59,98 @@ struct wss_frame;
 #define WS_CLOSE_UNEXPECTED			1011
 #define WS_CLOSE_RESERVED_TLS		1015 /* Do not send */
 
+/*! \brief A message to be sent using wss_write_batch */
+struct wss_msg {
+	int opcode;				/*!< Frame opcode */
+	const char *payload;	/*!< Optional payload (NULL if none) */
+	size_t len;				/*!< Length in octets of the payload */
+};
+
+/*! \brief Compression extension implementation, see wss_set_compression */
+struct wss_compression_ops {
+	/*!
+	 * \brief Compress the payload of a data message being sent
+	 * \param ctx Context provided to wss_set_compression
+	 * \param in, inlen Uncompressed payload
+	 * \param[out] out Compressed payload, allocated using malloc (freed by the library)
+	 * \param[out] outlen Length of compressed payload
+	 * \retval 0 on success, 1 to send the message uncompressed, -1 on failure
+	 */
+	int (*compress)(void *ctx, const char *in, size_t inlen, char **out, size_t *outlen);
+	/*!
+	 * \brief Decompress the payload of a data message received
+	 * \param ctx Context provided to wss_set_compression
+	 * \param in, inlen Compressed payload
+	 * \param[out] out Decompressed payload, allocated using malloc, with room for at least one more byte (for a NUL terminator)
+	 * \param[out] outlen Length of decompressed payload
+	 * \param maxlen Maximum allowed length of the decompressed payload
+	 * \retval 0 on success, 1 if the decompressed payload would be longer than maxlen, -1 on failure
+	 */
+	int (*decompress)(void *ctx, const char *in, size_t inlen, char **out, size_t *outlen, size_t maxlen);
+	/*! \brief Optional callback to free ctx when the client is destroyed */
+	void (*destroy)(void *ctx);
+	/*! \brief Optional callback to get the number of bytes of memory used by ctx, for wss_client_memory_usage */
+	size_t (*memory_usage)(void *ctx);
+};
+
+/*! \brief permessage-deflate extension parameters (RFC 7692) */
+struct wss_deflate_params {
+	int server_no_context_takeover;		/*!< Server resets its compression context after each message */
+	int client_no_context_takeover;		/*!< Client resets its compression context after each message */
+	int server_max_window_bits;			/*!< LZ77 window size (9-15) used by the server for compression. 0 for the default (15). */
+	int client_max_window_bits;			/*!< LZ77 window size (9-15) used by the client for compression. 0 for the default (15). */
+};
+
+/*! \brief A string within a buffer (not NUL terminated) */
+struct wss_str {
+	const char *s;		/*!< Start of string, or NULL if absent */
+	size_t len;
+};
+
+/*! \brief Max number of Sec-WebSocket-Extensions headers recorded by wss_handshake_parse */
+#define WS_HANDSHAKE_MAX_EXTENSIONS 4
+
+/*! \brief An opening handshake request, parsed in place using wss_handshake_parse */
+struct wss_handshake {
+	struct wss_str path;			/*!< Request target, e.g. /chat */
+	struct wss_str host;			/*!< Host header */
+	struct wss_str origin;			/*!< Origin header, if any */
+	struct wss_str key;				/*!< Sec-WebSocket-Key header */
+	struct wss_str protocols;		/*!< Sec-WebSocket-Protocol header (subprotocols, comma separated), if any */
+	struct wss_str extensions[WS_HANDSHAKE_MAX_EXTENSIONS];	/*!< Sec-WebSocket-Extensions headers, if any */
+	int nextensions;
+	int version;					/*!< Sec-WebSocket-Version */
+	size_t length;					/*!< Length of the request, including the blank line that ends it */
+	int status;						/*!< If the request is invalid, the HTTP status code with which to reject it */
+	int deflate;					/*!< Set by wss_handshake_response, if permessage-deflate was negotiated */
+	struct wss_deflate_params agreed;	/*!< permessage-deflate parameters, if deflate is set */
+};
+
+/*! \brief Performance counters, see wss_client_stats */
+struct wss_stats {
+	unsigned long long frames_in[16];	/*!< Frames received, by opcode (continuation frames are counted under WS_OPCODE_CONTINUE) */
+	unsigned long long frames_out[16];	/*!< Frames sent, by opcode */
+	unsigned long long bytes_in[16];	/*!< Payload bytes received, by opcode (before decompression) */
+	unsigned long long bytes_out[16];	/*!< Payload bytes sent, by opcode (after compression) */
+	unsigned long long reads;			/*!< Number of read calls (system calls or read callbacks) */
+	unsigned long long writes;			/*!< Number of write calls (system calls or write callbacks) */
+	unsigned long long partial_reads;	/*!< Reads that returned less data than requested */
+	unsigned long long eagains;			/*!< Reads or writes that failed because they would have blocked */
+	unsigned long long fragments;		/*!< Continuation frames reassembled */
+	unsigned long long reallocs;		/*!< Reassembly buffer reallocations */
+	unsigned long long bytes_masked;	/*!< Bytes masked or unmasked, in either direction */
+	unsigned long long polls;			/*!< Number of times wss_read waited in poll */
+	unsigned long long poll_ns;			/*!< Total time spent waiting in poll, in nanoseconds */
+};
+
+/*! \brief What to do when a client's outbound queue exceeds its high watermark, see wss_set_watermarks */
+enum wss_backpressure_policy {
+	WS_BACKPRESSURE_NONE = 0,	/*!< Just report it (using the callback or wss_backpressure) */
+	WS_BACKPRESSURE_BLOCK,		/*!< Writes block until the queue has drained to the low watermark */
+	WS_BACKPRESSURE_DROP,		/*!< Drop the oldest queued data messages (unfragmented and uncompressed only) to stay under the high watermark */
+	WS_BACKPRESSURE_CLOSE,		/*!< Discard everything queued, send a CLOSE with WS_CLOSE_POLICY_VIOLATION, and fail subsequent writes */
+};
+
 enum websocket_type {
 	WS_SERVER = 0,
 	WS_CLIENT,
@@ -85,6 +181,28 @@ void wss_client_destroy(struct wss_client *client);
  */
 struct wss_client *wss_client_new(void *data, int rfd, int wfd);
 
+/*! \brief Get the custom user data of a client, as provided to wss_client_new (e.g. for clients returned by wss_poll) */
+void *wss_client_data(struct wss_client *client);
+
+/*!
+ * \brief Get the number of bytes of memory currently used by a client
+ * \param client
+ * \return Size of the client itself, plus all buffers and state allocated for it
+ *         (receive buffer, payloads, queued outbound data, and any compression context that reports its usage)
+ * \note Buffers shared with other clients, such as pre-encoded frames and pooled compression streams, are not included.
+ */
+size_t wss_client_memory_usage(struct wss_client *client);
+
+/*!
+ * \brief Release memory that an idle client doesn't currently need
+ * \param client
+ * \note This frees the receive buffer (if empty), any payload buffer retained for reuse, and state kept from
+ *       previous fragmented messages and PINGs. Each is reallocated when next needed, so this is intended for
+ *       servers with many mostly idle connections, e.g. after wss_read has returned with nothing buffered.
+ *       It must not be called concurrently with wss_read.
+ */
+void wss_client_trim(struct wss_client *client);
+
 /*!
  * \brief Set the type of a WebSocket connection
  * \param client
@@ -105,15 +223,489 @@ void wss_set_client_type(struct wss_client *client, enum websocket_type type);
  */
 void wss_set_io_callbacks(struct wss_client *client, ssize_t (*read_cb)(void *data, char *buf, size_t len), ssize_t (*write_cb)(void *data, const char *buf, size_t len));
 
+/*!
+ * \brief Set a custom vectored I/O callback for writing to a client
+ * \param client
+ * \param writev_cb A callback for writing multiple buffers to the client at once.
+ *                  Interface is the same as writev, except the custom user data is provided instead of a file descriptor.
+ *                  Set to NULL to use writev directly with the wfd (if no write callback is set),
+ *                  or to use the write callback (if set).
+ * \note Frame headers and payloads are written together in a single call, so this allows them to be sent
+ *       in a single TLS record. If only a write callback is set, small frames are copied into a single buffer
+ *       and written in one call to the write callback.
+ */
+void wss_set_writev_callback(struct wss_client *client, ssize_t (*writev_cb)(void *data, const struct iovec *iov, int iovcnt));
+
+/*!
+ * \brief Enable buffered reads for a client
+ * \param client
+ * \param size Size of the receive buffer (e.g. 16384). 0 to disable buffering (the default).
+ * \retval 0 on success, -1 on failure
+ * \note When enabled, each read from the client reads as much data as is available (up to size bytes),
+ *       and frame headers and small payloads are then parsed out of the buffer, rather than
+ *       requiring a read call for each part of the frame. Any data left over after a frame is
+ *       retained for the next call to wss_read. The buffer itself is allocated on the first read.
+ */
+int wss_set_read_buffer(struct wss_client *client, size_t size);
+
+/*!
+ * \brief Get the number of bytes already received from the client but not yet processed
+ * \note If you are polling the client file descriptor yourself, you should call wss_read
+ *       (with ready set to 1) while this is nonzero, since the file descriptor itself
+ *       will not be readable if the data has already been buffered.
+ */
+size_t wss_read_pending(struct wss_client *client);
+
+/*!
+ * \brief Set a callback that reports data buffered by the application's own I/O layer (e.g. decrypted TLS data)
+ * \param client
+ * \param pending_cb Callback returning the number of bytes that read_cb can return without reading from the file descriptor
+ * \note This allows wss_read (in blocking mode) to wait for activity even when a read callback is set,
+ *       and wss_poll to find clients with data ready that won't make the file descriptor readable.
+ *       wss_read_pending includes these bytes.
+ */
+void wss_set_pending_callback(struct wss_client *client, size_t (*pending_cb)(void *data));
+
+/*!
+ * \brief Set custom allocation callbacks for frame payloads received from a client
+ * \param client
+ * \param realloc_cb A callback to allocate memory for a payload. Interface is the same as realloc,
+ *                   except the custom user data is provided as well. ptr is NULL for a new payload,
+ *                   or the existing payload if a fragmented message is being reassembled.
+ *                   Set to NULL to use realloc (the default).
+ * \param free_cb A callback to free a payload allocated using realloc_cb, called by wss_frame_destroy.
+ *                Set to NULL to use free (the default).
+ * \note Payloads are read and unmasked directly into the memory returned by realloc_cb.
+ */
+void wss_set_payload_allocator(struct wss_client *client, void *(*realloc_cb)(void *data, void *ptr, size_t size), void (*free_cb)(void *data, void *ptr));
+
+/*!
+ * \brief Receive all frame payloads for a client directly into an application-provided buffer
+ * \param client
+ * \param buf Buffer into which payloads will be read. Set to NULL to revert to allocating payloads.
+ * \param size Size of buf. Since payloads are NUL terminated, the maximum payload length is size - 1.
+ *             Larger payloads will fail with WS_CLOSE_LARGE_PAYLOAD.
+ * \note The buffer is reused for each frame, and is never freed by the library (wss_frame_destroy is a no-op).
+ *       This takes precedence over wss_set_payload_allocator.
+ */
+void wss_set_payload_buffer(struct wss_client *client, char *buf, size_t size);
+
+/*!
+ * \brief Retain a client's payload buffer between frames, rather than freeing it in wss_frame_destroy
+ * \param client
+ * \param reuse 1 to reuse payload buffers, 0 to free them after each frame (the default)
+ * \note The largest buffer is kept, and a new one at least twice as large is allocated when a larger
+ *       payload is received, so that steady state traffic does not require any allocations.
+ *       Payloads may still be "stolen" and freed using free().
+ */
+void wss_set_payload_reuse(struct wss_client *client, int reuse);
+
+/*!
+ * \brief Enable a process-wide pool of payload buffers, shared across all clients
+ * \param max_retained Maximum number of bytes of free buffers to retain in the pool. 0 to disable (the default).
+ * \note Buffers are pooled in power-of-2 size classes, up to 1 MB (larger payloads are always freed).
+ *       This only applies to clients using the default allocator.
+ *       Lowering the limit frees retained buffers as needed.
+ */
+void wss_set_payload_pool(size_t max_retained);
+
+/*!
+ * \brief Set the expected size of fragmented messages received from a client
+ * \param client
+ * \param size Expected total payload length of a fragmented message, allocated up front when the
+ *             first fragment is received. 0 for no hint (the default).
+ * \note Regardless of this setting, reassembly buffers that are too small grow geometrically.
+ */
+void wss_set_message_size_hint(struct wss_client *client, size_t size);
+
+/*!
+ * \brief Get counters for reassembly of fragmented messages
+ * \param client
+ * \param[out] fragments Number of continuation frames reassembled
+ * \param[out] reallocs Number of times a reassembly buffer had to be reallocated
+ */
+void wss_reassembly_counters(struct wss_client *client, unsigned long *fragments, unsigned long *reallocs);
+
+/*!
+ * \brief Stream data frame payloads to the application as they are received, rather than buffering entire messages
+ * \param client
+ * \param stream_cb A callback that will be called with each chunk of payload data, once unmasked:
+ *                  - data: Custom user data
+ *                  - opcode: Opcode of the message (WS_OPCODE_TEXT or WS_OPCODE_BINARY, even for continuation frames)
+ *                  - buf, len: Chunk of the payload. This is only valid for the duration of the callback.
+ *                  - offset: Offset of the chunk within the message
+ *                  - final_fragment: 1 if the chunk is part of the final frame of the message
+ *                  - final_chunk: 1 if the chunk is the last one in its frame. The message is complete if both are 1.
+ *                  The callback should return 0 to continue, or nonzero to abort reading (wss_read will fail).
+ *                  Set to NULL to buffer payloads (the default).
+ * \note When streaming, wss_read returns 1 once an entire data message has been delivered. The frame's
+ *       payload will be NULL, and its length will be the length of the entire message.
+ *       Streamed messages are not subject to WS_MAX_PAYLOAD_LENGTH. Control frames are always buffered.
+ */
+void wss_set_stream_callback(struct wss_client *client, int (*stream_cb)(void *data, int opcode, const char *buf, size_t len, unsigned long offset, int final_fragment, int final_chunk));
+
+/*!
+ * \brief Enable compression of data messages (e.g. permessage-deflate), once negotiated during the handshake
+ * \param client
+ * \param ops Compression implementation (e.g. from wss_deflate_enable), which must remain valid for the lifetime of the client.
+ *            Set to NULL to disable compression (the default).
+ * \param ctx Context passed to the compression callbacks
+ * \note When enabled, frames received with RSV1 set are decompressed once the entire message has been received
+ *       (compressed messages are never streamed). Messages sent using wss_write are compressed; fragments sent
+ *       using wss_write_begin and batches sent using wss_write_batch are not.
+ */
+void wss_set_compression(struct wss_client *client, const struct wss_compression_ops *ops, void *ctx);
+
+/*!
+ * \brief Get a client's compression context
+ * \param client
+ * \param ops The compression implementation expected
+ * \return The ctx passed to wss_set_compression, if compression is enabled using ops, or NULL otherwise
+ */
+void *wss_compression_context(struct wss_client *client, const struct wss_compression_ops *ops);
+
+/*!
+ * \brief Negotiate permessage-deflate on the server, given the extensions offered by a client
+ * \param offers Value of the client's Sec-WebSocket-Extensions header(s), e.g. "permessage-deflate; client_max_window_bits"
+ * \param local Parameters the server requires (e.g. server_no_context_takeover to avoid retaining compression state), or NULL for defaults
+ * \param[out] agreed Parameters both sides must use, on success
+ * \param[out] buf Buffer for the value of the Sec-WebSocket-Extensions response header
+ * \param len Size of buf
+ * \retval 1 if an offer was accepted, 0 if no acceptable offer was made (do not enable compression), -1 on failure
+ */
+int wss_deflate_negotiate(const char *offers, const struct wss_deflate_params *local, struct wss_deflate_params *agreed, char *buf, size_t len);
+
+/*!
+ * \brief Generate a permessage-deflate offer for a client's Sec-WebSocket-Extensions request header
+ * \param params Parameters to request, or NULL for defaults
+ * \param[out] buf
+ * \param len Size of buf
+ * \retval -1 on failure, length of offer on success
+ */
+int wss_deflate_offer(const struct wss_deflate_params *params, char *buf, size_t len);
+
+/*!
+ * \brief Parse a server's permessage-deflate response, on the client
+ * \param response Value of the server's Sec-WebSocket-Extensions response header
+ * \param[out] agreed Parameters both sides must use
+ * \retval 0 on success, -1 if the response is invalid (the client must fail the connection)
+ */
+int wss_deflate_accept(const char *response, struct wss_deflate_params *agreed);
+
+/*!
+ * \brief Parse a WebSocket opening handshake (HTTP upgrade request), on the server
+ * \param buf Data received so far on the connection
+ * \param len Length of buf
+ * \param[out] hs Parsed request. Strings point into buf, so buf must remain valid while they are used.
+ * \retval 1 if a complete, valid request was received
+ * \retval 0 if the request is incomplete (call again once more data has been received)
+ * \retval -1 if the request is invalid. Reply using wss_handshake_response (which uses hs->status), and close the connection.
+ * \note This does not allocate memory or modify buf. Requests must fit in buf, and the caller should limit its size.
+ */
+int wss_handshake_parse(const char *buf, size_t len, struct wss_handshake *hs);
+
+/*!
+ * \brief Compute the Sec-WebSocket-Accept value for a Sec-WebSocket-Key
+ * \param key Key, which need not be NUL terminated
+ * \param keylen Length of key
+ * \param[out] accept Accept value (NUL terminated)
+ * \note SHA-1 is computed using the SHA extensions (SHA-NI) if the CPU supports them.
+ */
+void wss_handshake_accept(const char *key, size_t keylen, char accept[29]);
+
+/*!
+ * \brief Generate the server's response to an opening handshake
+ * \param hs Request parsed by wss_handshake_parse. On failure to parse, an error response is generated.
+ * \param protocol Subprotocol to accept (one of those in hs->protocols), or NULL for none
+ * \param local permessage-deflate parameters the server requires, to accept permessage-deflate if offered, or NULL to not negotiate compression.
+ *              On success, hs->deflate and hs->agreed are set, and compression should then be enabled, e.g. using wss_deflate_enable.
+ * \param[out] buf Buffer for the response
+ * \param len Size of buf (256 bytes is enough, unless a long subprotocol is used)
+ * \retval -1 on failure, length of response on success
+ */
+int wss_handshake_response(struct wss_handshake *hs, const char *protocol, const struct wss_deflate_params *local, char *buf, size_t len);
+
+/*!
+ * \brief Create a server client for a connection that has completed the opening handshake
+ * \param hs Request parsed by wss_handshake_parse
+ * \param buf, len The same buffer passed to wss_handshake_parse. Anything the client sent after the handshake is already frame data,
+ *                 so it is copied into the new client's receive buffer.
+ * \param data, rfd, wfd As for wss_client_new
+ * \return NULL on failure, client on success
+ */
+struct wss_client *wss_handshake_client_new(const struct wss_handshake *hs, const char *buf, size_t len, void *data, int rfd, int wfd);
+
+/*!
+ * \brief Generate a random Sec-WebSocket-Key, for a client's opening handshake
+ * \param[out] key Key (NUL terminated)
+ * \retval 0 on success, -1 on failure
+ */
+int wss_handshake_key(char key[25]);
+
+/*!
+ * \brief Check a server's response to a client's opening handshake
+ * \param buf Data received so far on the connection
+ * \param len Length of buf
+ * \param key The Sec-WebSocket-Key that was sent
+ * \param[out] length Length of the response, including the blank line that ends it. Anything after it is frame data.
+ * \retval 1 if the server accepted the upgrade, 0 if the response is incomplete, -1 if the upgrade was refused or the response is invalid
+ */
+int wss_handshake_check_response(const char *buf, size_t len, const char *key, size_t *length);
+
+/*!
+ * \brief Receive data message payloads directly into application memory, unmasking them while they are copied there
+ * \param client
+ * \param dest_cb A callback that will be called when each data frame is received, to provide a destination for its payload:
+ *                - data: Custom user data
+ *                - opcode: Opcode of the message (WS_OPCODE_TEXT or WS_OPCODE_BINARY, even for continuation frames)
+ *                - offset: Offset of this frame's payload within the message
+ *                - len: Length of this frame's payload
+ *                - iov, iovcnt: [out] Scatter list of buffers for the payload, with a total size of at least len.
+ *                  This must remain valid until the frame has been received.
+ *                The callback should return 0 to continue, or nonzero to abort reading (wss_read will fail).
+ *                Set to NULL to disable (the default).
+ * \note The payload is read into the receive buffer (see wss_set_read_buffer) or a small staging buffer, and then
+ *       unmasked into the destination in a single pass, rather than being unmasked in place and then copied by the application.
+ * \note As with wss_set_stream_callback, wss_read returns 1 once an entire data message has been received,
+ *       with a NULL payload, and messages are not subject to WS_MAX_PAYLOAD_LENGTH. This takes precedence over a stream callback.
+ */
+void wss_set_payload_destination(struct wss_client *client, int (*dest_cb)(void *data, int opcode, unsigned long offset, unsigned long len, const struct iovec **iov, int *iovcnt));
+
+/*!
+ * \brief Validate that TEXT messages (and close reasons) received from a client are valid UTF-8, as required by RFC 6455
+ * \param client
+ * \param validate 1 to validate, 0 to trust the client (the default)
+ * \note Validation is done as each chunk of payload is received and unmasked, so invalid messages are rejected as soon as possible
+ *       (including before streamed data is delivered). wss_read fails with WS_CLOSE_DATA_INCONSISTENT on invalid data.
+ */
+void wss_set_utf8_validation(struct wss_client *client, int validate);
+
+/*!
+ * \brief Answer PINGs and CLOSEs received from a client automatically, inside wss_read
+ * \param client
+ * \param enable 1 to handle control frames automatically, 0 to return them all to the application (the default)
+ * \note When enabled, PINGs are answered with a PONG and are not returned by wss_read.
+ *       If several PINGs have already been received, only the most recent is answered (RFC 6455 5.5.3).
+ *       PONGs are sent ahead of any data queued in non-blocking mode, at the next frame boundary.
+ *       CLOSE frames are still returned, but are first echoed with the same status code, unless a CLOSE was already sent.
+ * \note Since wss_read may now write to the client, writes from other threads must be serialized with it.
+ */
+void wss_set_auto_control(struct wss_client *client, int enable);
+
+/*!
+ * \brief Serialize writes to a client internally, using a lock-free send queue
+ * \param client
+ * \param enable 1 to queue writes, 0 to write directly (the default)
+ * \param notify Optional callback, invoked with the client's custom data when the queue becomes non-empty.
+ *               The application should then arrange for one of its threads to call wss_drain.
+ *               If NULL, the thread that queues a message sends it (along with anything else queued), unless another thread already is.
+ * \note When enabled, wss_write, wss_write_inplace, wss_write_encoded, wss_write_batch and wss_close may be called from any number of threads
+ *       without locking. Messages are copied onto the queue, and the return value only indicates whether queuing succeeded
+ *       (or that a previous write failed). The drainer sends everything queued in batches, PONGs first.
+ *       Fragmented messages can't be sent using wss_write_begin while the queue is enabled (use wss_set_max_fragment_size).
+ * \note Only enable or disable this while no other threads are writing.
+ * \note In non-blocking mode, wss_flush, like wss_drain, must only be called from one thread at a time.
+ */
+void wss_set_send_queue(struct wss_client *client, int enable, void (*notify)(void *data));
+
+/*!
+ * \brief Send everything in a client's send queue
+ * \param client
+ * \retval 0 on success (or if another thread is already draining the queue), -1 on failure
+ * \note Once sending fails, everything queued (including subsequent writes) is discarded.
+ */
+int wss_drain(struct wss_client *client);
+
+/*!
+ * \brief Get the estimated round trip time to a client, based on how long PINGs sent to it took to be answered
+ * \param client
+ * \return Smoothed round trip time, in microseconds
+ * \retval 0 if no PING has been answered yet
+ */
+unsigned long wss_rtt(struct wss_client *client);
+
+/*!
+ * \brief Enable or disable performance counters for a client
+ * \param client
+ * \param enable 1 to enable, 0 to disable (the default)
+ * \retval 0 on success, -1 on failure
+ * \note Counters for all clients with counters enabled are also added to the global counters (see wss_global_stats).
+ *       Disabling counters for a client discards its counters, but not its contribution to the global counters.
+ */
+int wss_enable_stats(struct wss_client *client, int enable);
+
+/*!
+ * \brief Get a snapshot of a client's performance counters
+ * \param client
+ * \param[out] stats
+ * \retval 0 on success, -1 if counters are not enabled for this client
+ * \note This may be called from any thread. Counters are individually consistent, but may not be consistent with each other.
+ */
+int wss_client_stats(struct wss_client *client, struct wss_stats *stats);
+
+/*!
+ * \brief Get a snapshot of the performance counters aggregated across all clients with counters enabled
+ * \param[out] stats
+ */
+void wss_global_stats(struct wss_stats *stats);
+
 /*!
  * \brief Read a WebSocket frame from the client
  * \param client
  * \param pollms Maximum time (in ms) to wait for activity (for a frame to begin being received)
  * \param ready 1 if you are sure that data is already pending from the client, 0 otherwise
  * \retval 0 on no frames received, -1 on failure, 1 if frame(s) successfully received and parsed
+ * \note Fragmented messages are reassembled and returned as a single frame. Control frames received
+ *       in the middle of a fragmented message are returned as they arrive, before the rest of the message.
+ *       PINGs are not returned if wss_set_auto_control is enabled.
  */
 int wss_read(struct wss_client *client, int pollms, int ready);
 
+/*!
+ * \brief Enable or disable non-blocking mode for a client, for use with event loops (e.g. epoll, kqueue)
+ * \param client
+ * \param nonblocking 1 to enable non-blocking mode, 0 to disable (the default)
+ * \note The application is responsible for making the file descriptors non-blocking (or, if using I/O callbacks,
+ *       for returning -1 with errno set to EAGAIN when no data is available).
+ * \note In non-blocking mode, wss_read never waits for activity, and returns 0 if a frame has not yet been
+ *       completely received. The partially received frame is saved, and subsequent calls to wss_read resume
+ *       parsing it, including partially received payloads. If using edge-triggered notifications, wss_read should be called repeatedly until it returns 0.
+ * \note In non-blocking mode, data that cannot be written immediately is queued, and writes return success.
+ *       Use wss_want_write to check for queued data, and wss_flush to send it when the connection is writable.
+ */
+void wss_set_nonblocking(struct wss_client *client, int nonblocking);
+
+/*!
+ * \brief Whether data is queued for writing to a client (non-blocking mode only)
+ * \retval 1 if data is queued, and the application should wait for the connection to become writable and call wss_flush
+ * \retval 0 if nothing is queued
+ */
+int wss_want_write(struct wss_client *client);
+
+/*!
+ * \brief Write as much data queued for a client as possible (non-blocking mode only)
+ * \retval 0 if all queued data was written
+ * \retval 1 if data is still queued (wait for the connection to become writable and try again)
+ * \retval -1 on failure
+ */
+int wss_flush(struct wss_client *client);
+
+/*! \brief A client returned by wss_poll */
+struct wss_ready {
+	struct wss_client *client;
+	int res;	/*!< What wss_read returned: 1 if a frame is ready (see wss_client_frame), -1 on failure */
+};
+
+/*!
+ * \brief Create a set of clients that can be polled together, using epoll (or kqueue)
+ * \return NULL on failure, set on success
+ */
+struct wss_clientset *wss_clientset_new(void);
+
+/*!
+ * \brief Destroy a client set
+ * \note All clients should be removed (or destroyed) first. Clients are not destroyed along with the set.
+ */
+void wss_clientset_destroy(struct wss_clientset *set);
+
+/*!
+ * \brief Add a client to a set
+ * \param set
+ * \param client A client in non-blocking mode, with a file descriptor for reading (even if using I/O callbacks)
+ * \retval 0 on success, -1 on failure
+ * \note A client can only belong to one set at a time. Destroying a client removes it from its set.
+ */
+int wss_clientset_add(struct wss_clientset *set, struct wss_client *client);
+
+/*!
+ * \brief Remove a client from a set
+ * \retval 0 on success, -1 if the client isn't in this set
+ */
+int wss_clientset_remove(struct wss_clientset *set, struct wss_client *client);
+
+/*! \brief Number of clients in a set */
+int wss_clientset_count(struct wss_clientset *set);
+
+/*!
+ * \brief Wait for any clients in a set to have complete frames available
+ * \param set
+ * \param[out] ready Clients with a frame ready, or that failed
+ * \param max Size of ready
+ * \param timeout Maximum time to wait, in ms (-1 to wait indefinitely)
+ * \return Number of entries in ready (0 on timeout), or -1 on failure
+ * \note This calls wss_read on clients with data available, so the application must not call wss_read on clients in a set.
+ *       Each client's frame must be handled before wss_poll is called again. If more frames were already received from
+ *       a client (e.g. in its receive buffer, or as reported by its pending callback), they are returned by subsequent calls.
+ *       Clients that failed (res is -1) should be removed from the set.
+ */
+int wss_poll(struct wss_clientset *set, struct wss_ready *ready, int max, int timeout);
+
+/*!
+ * \brief Create an io_uring instance, for performing client I/O (Linux only)
+ * \param entries Size of the submission queue
+ * \param nbufs Number of receive buffers shared by all clients using the ring (a power of 2, up to 32768)
+ * \param bufsize Size of each receive buffer
+ * \return NULL on failure (including if io_uring is not supported), ring on success
+ * \note A ring, and the clients using it, must only be used by one thread at a time.
+ *       Receive buffers are provided to the kernel in a ring, and are only consumed by clients that have data waiting.
+ */
+struct wss_uring *wss_uring_new(unsigned int entries, unsigned int nbufs, unsigned int bufsize);
+
+/*!
+ * \brief Destroy an io_uring instance
+ * \note All clients should stop using the ring (or be destroyed) first
+ */
+void wss_uring_destroy(struct wss_uring *ring);
+
+/*!
+ * \brief Use io_uring for a client's I/O, rather than read and writev system calls
+ * \param client A client with socket file descriptors, and no I/O callbacks
+ * \param ring Ring to use, or NULL to stop using io_uring
+ * \retval 0 on success, -1 on failure
+ * \note Data is received using a multishot receive into the ring's shared buffers, so there is no system call per read.
+ *       In blocking mode, writes are submitted as linked sends, e.g. for a frame header and its payload.
+ *       Clients using io_uring can't belong to a client set; use wss_uring_poll instead.
+ *       If waiting for a send to complete fails (io_uring_enter fails), the write fails, and all further reads and writes
+ *       on the client fail with the same errno, since the send may still be in progress.
+ */
+int wss_set_io_uring(struct wss_client *client, struct wss_uring *ring);
+
+/*!
+ * \brief Wait for any non-blocking clients using a ring to have complete frames available
+ * \param ring
+ * \param[out] ready Clients with a frame ready, or that failed
+ * \param max Size of ready
+ * \param timeout Maximum time to wait, in ms (-1 to wait indefinitely)
+ * \return Number of entries in ready (0 on timeout), or -1 on failure
+ * \note This is the io_uring equivalent of wss_poll, and the same rules apply.
+ */
+int wss_uring_poll(struct wss_uring *ring, struct wss_ready *ready, int max, int timeout);
+
+/*!
+ * \brief Limit the amount of data that may be queued for writing to a client (in non-blocking mode, or in the send queue)
+ * \param client
+ * \param high High watermark, in bytes. 0 to remove limits (the default).
+ * \param low Low watermark, in bytes. Once above the high watermark, the connection is considered backed up until at most this much is queued.
+ * \param policy What to do when the high watermark is exceeded
+ * \param cb Optional callback, invoked with the client's custom data and 1 when the queue rises above the high watermark,
+ *           and 0 when it falls back to the low watermark. This may be called from whichever thread is writing.
+ * \retval 0 on success, -1 on failure
+ * \note With WS_BACKPRESSURE_BLOCK, a non-blocking writer waits for the connection to become writable and flushes the queue itself.
+ *       Send queue producers instead wait for the drainer. Don't use this policy if the thread that would flush the queue can block in a write.
+ * \note With the send queue, messages not yet taken by the drainer are dropped by the drainer (WS_BACKPRESSURE_DROP).
+ */
+int wss_set_watermarks(struct wss_client *client, size_t high, size_t low, enum wss_backpressure_policy policy, void (*cb)(void *data, int above));
+
+/*!
+ * \brief Whether a client's outbound queue is backed up
+ * \retval 1 if the queue has exceeded the high watermark, and has not yet fallen back to the low watermark
+ * \retval 0 otherwise (including if no watermarks are set)
+ */
+int wss_backpressure(struct wss_client *client);
+
+/*! \brief Number of bytes queued for writing to a client (non-blocking queue and send queue). This may be called from any thread. */
+size_t wss_outbound_bytes(struct wss_client *client);
+
 /*!
  * \brief Retrieves the current frame for a client
  * \note This function only returns a valid frame if wss_frame_read returned 1
@@ -130,7 +722,8 @@ int wss_frame_opcode(struct wss_frame *frame);
 /*!
  * \brief Get the payload of a frame
  * \return payload. If present, wss_frame_destroy should be called before receiving further frames, to avoid a memory leak.
- *                  Alternately, you can "steal" the reference to the payload and free it yourself later using free().
+ *                  Alternately, you can "steal" the reference to the payload and free it yourself later using free()
+ *                  (or your own free function, if you have set one using wss_set_payload_allocator).
  * \return NULL, if no payload
  * \note Payloads include a NUL terminating character at the end for convenience of use of text payloads.
  *       This is NOT included in the payload length and should not be considered to be part of the payload.
@@ -150,6 +743,133 @@ unsigned long wss_frame_payload_length(struct wss_frame *frame);
  */
 int wss_write(struct wss_client *client, int opcode, const char *payload, size_t len);
 
+/*!
+ * \brief Write websocket data from a buffer that may be modified
+ * \param client
+ * \param opcode Frame opcode
+ * \param payload Optional payload (NULL if none). On client connections, this is masked in place,
+ *                so its contents are undefined afterwards.
+ * \param len Length in octets of the payload
+ * \retval 0 on success, -1 on failure
+ * \note This is the same as wss_write, but on client connections, the payload can be masked and sent in a single write,
+ *       rather than being copied through a staging buffer in chunks.
+ */
+int wss_write_inplace(struct wss_client *client, int opcode, char *payload, size_t len);
+
+/*!
+ * \brief Write a binary message whose payload is read from a file
+ * \param client
+ * \param fd File descriptor of a file (or anything else that supports pread)
+ * \param offset Offset in the file at which the payload begins
+ * \param len Length in octets of the payload
+ * \retval 0 on success, -1 on failure
+ * \note On server connections using file descriptors for I/O, the payload is sent using sendfile (on Linux),
+ *       so it is never copied into userspace. This also works if the socket uses kernel TLS.
+ *       Otherwise (I/O callbacks, or if sendfile isn't supported), the payload is copied through a small buffer.
+ *       If the payload must be masked (client connections), compressed, fragmented, or added to the send queue,
+ *       the entire payload is read into memory and sent using wss_write_inplace.
+ *       In non-blocking mode, whatever can't be sent immediately is read into the outbound queue.
+ */
+int wss_write_file(struct wss_client *client, int fd, off_t offset, size_t len);
+
+/*!
+ * \brief Set the size of the staging buffer used to mask payloads sent on client connections
+ * \param client
+ * \param size Size of staging buffer, which is the maximum amount of payload sent per write call. 0 for the default (8 KB, on the stack).
+ * \retval 0 on success, -1 on failure
+ */
+int wss_set_mask_chunk_size(struct wss_client *client, size_t size);
+
+/*!
+ * \brief Begin sending a message in multiple fragments, as the data becomes available
+ * \param client
+ * \param opcode WS_OPCODE_TEXT or WS_OPCODE_BINARY
+ * \retval 0 on success, -1 on failure (including if the send queue is enabled)
+ * \note Nothing is sent until the first call to wss_write_chunk or wss_write_end.
+ *       While a fragmented message is in progress, control frames (e.g. PONG) may still be sent using wss_write,
+ *       but other data messages may not.
+ */
+int wss_write_begin(struct wss_client *client, int opcode);
+
+/*!
+ * \brief Send a fragment of a message started using wss_write_begin
+ * \param client
+ * \param payload Payload data for this fragment
+ * \param len Length in octets of the payload. Empty fragments are not sent.
+ * \retval 0 on success, -1 on failure
+ */
+int wss_write_chunk(struct wss_client *client, const char *payload, size_t len);
+
+/*!
+ * \brief Send the final fragment of a message started using wss_write_begin
+ * \param client
+ * \param payload Optional payload data for the final fragment (NULL if none)
+ * \param len Length in octets of the payload
+ * \retval 0 on success, -1 on failure
+ */
+int wss_write_end(struct wss_client *client, const char *payload, size_t len);
+
+/*!
+ * \brief Automatically fragment large data messages sent using wss_write
+ * \param client
+ * \param size Maximum payload length of each frame. 0 to never fragment (the default).
+ */
+void wss_set_max_fragment_size(struct wss_client *client, size_t size);
+
+/*!
+ * \brief Write multiple WebSocket messages at once, using as few write calls as possible
+ * \param client
+ * \param msgs Messages to send, each of which is sent as a single frame
+ * \param n Number of messages
+ * \return Number of messages completely written (n on success). If less than n, an error occured.
+ * \retval -1 on failure, if no messages could be written
+ * \note If the send queue is enabled, the messages are queued (and compressed, if enabled) like those sent using wss_write,
+ *       and the return value is the number of messages queued.
+ */
+int wss_write_batch(struct wss_client *client, const struct wss_msg *msgs, int n);
+
+/*!
+ * \brief Encode a frame once, so that it can be sent to many connections using wss_write_encoded
+ * \param type The type of connections to which this frame will be sent (WS_SERVER or WS_CLIENT).
+ *             Frames encoded for WS_CLIENT connections are masked once, using the same key for all recipients.
+ * \param opcode Frame opcode
+ * \param payload Optional payload (NULL if none). This is copied, so it does not need to remain valid.
+ * \param len Length in octets of the payload
+ * \return NULL on failure
+ * \return Encoded frame, with a reference count of 1, on success. Release using wss_encoded_frame_unref.
+ */
+struct wss_encoded_frame *wss_encode_frame(enum websocket_type type, int opcode, const char *payload, size_t len);
+
+/*!
+ * \brief Compress and encode a data frame once, so that it can be sent to many connections using wss_write_encoded
+ * \param type The type of connections to which this frame will be sent
+ * \param opcode Frame opcode. Control frames are never compressed.
+ * \param payload Optional payload (NULL if none)
+ * \param len Length in octets of the payload
+ * \param ops Compression implementation
+ * \param ctx Compression context for ops. Since the frame will be sent to many connections, this must not retain
+ *            any state between messages (e.g. for permessage-deflate, there must be no context takeover).
+ * \return NULL on failure
+ * \return Encoded frame, with a reference count of 1, on success. Release using wss_encoded_frame_unref.
+ * \note The frame may be encoded uncompressed, if compression would not reduce its size.
+ * \note Only send compressed frames to connections that can decompress them (see wss_deflate_can_share for permessage-deflate).
+ */
+struct wss_encoded_frame *wss_encode_compressed_frame(enum websocket_type type, int opcode, const char *payload, size_t len, const struct wss_compression_ops *ops, void *ctx);
+
+/*! \brief Add a reference to an encoded frame. Encoded frames are immutable and may be shared between threads. */
+struct wss_encoded_frame *wss_encoded_frame_ref(struct wss_encoded_frame *frame);
+
+/*! \brief Release a reference to an encoded frame, freeing it when the last reference is released */
+void wss_encoded_frame_unref(struct wss_encoded_frame *frame);
+
+/*!
+ * \brief Write a frame previously encoded using wss_encode_frame
+ * \param client
+ * \param frame An encoded frame. The connection type must match the type for which the frame was encoded.
+ * \retval 0 on success, -1 on failure
+ */
+int wss_write_encoded(struct wss_client *client, struct wss_encoded_frame *frame);
+
 /*!
  * \brief Get the status code associated with an error which occured when reading a frame
  * \retval 0 if no error
@@ -171,3 +891,20 @@ int wss_close(struct wss_client *client, int code);
  * \retval -1 if not a close frame, RFC 6455 close code on success
  */
 int wss_close_code(struct wss_frame *frame);
+
+/*!
+ * \brief Mask or unmask data using a WebSocket masking key
+ * \param dst Destination buffer (may be the same as src, to mask in place)
+ * \param src Source data
+ * \param len Number of bytes to mask
+ * \param key 4-byte masking key
+ * \param offset Offset of src within the payload, so that data may be processed in arbitrary chunks
+ * \note The library does this itself as needed, but this may be useful for applications that deal with raw frames
+ */
+void wss_mask(char *dst, const char *src, size_t len, const char key[4], size_t offset);
+
+/*!
+ * \brief Check whether data is valid UTF-8
+ * \retval 1 if valid, 0 if not
+ */
+int wss_utf8_valid(const char *buf, size_t len);
@@ -0,0 +1,448 @@
+/*
+ * libwss -- WebSocket Server Library
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the Mozilla Public License Version 2.
+ */
+
+/*! \file
+ *
+ * \brief permessage-deflate (RFC 7692) compression using zlib
+ *
+ * \author Naveen Albert <bbs@phreaknet.org>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "wss.h"
+#include "wss_deflate.h"
+
+/*! \brief A zlib stream for compressing or decompressing */
+struct zstream {
+	struct zstream *next;
+	z_stream strm;
+	unsigned int inflate:1;	/*!< Decompressor (rather than compressor) */
+	int bits;				/*!< Window bits */
+	int level;				/*!< Compression level (compressors only) */
+	size_t bytes;			/*!< Memory allocated by zlib for this stream */
+};
+
+/* Idle streams, shared by all connections with no context takeover */
+static struct {
+	pthread_mutex_t lock;
+	struct zstream *idle;
+	int count;
+	int max;
+} zpool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.max = 16,
+};
+
+struct wss_deflate {
+	int level;
+	int deflate_bits;			/*!< Window bits for messages we send */
+	int inflate_bits;			/*!< Window bits for messages we receive */
+	unsigned int deflate_nct:1;	/*!< Reset compression context after each message sent */
+	unsigned int inflate_nct:1;	/*!< Reset decompression context after each message received */
+	struct zstream *deflater;	/*!< Compressor, if retained between messages */
+	struct zstream *inflater;	/*!< Decompressor, if retained between messages */
+};
+
+/* Each message is compressed as if terminated by an empty stored block, and the trailing 4 bytes are removed (RFC 7692 7.2.1) */
+static const char deflate_tail[4] = { 0x00, 0x00, (char) 0xff, (char) 0xff };
+
+static void zstream_free(struct zstream *z)
+{
+	if (z->inflate) {
+		inflateEnd(&z->strm);
+	} else {
+		deflateEnd(&z->strm);
+	}
+	free(z);
+}
+
+/*! \brief Size of the header zstream_zalloc prepends to each allocation, to record its size (and keep the alignment malloc provides) */
+#define ZALLOC_HEADER 16
+
+/*! \brief zlib allocator, which keeps track of how much memory each stream uses */
+static voidpf zstream_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	struct zstream *z = opaque;
+	size_t len = (size_t) items * size;
+	char *buf = malloc(ZALLOC_HEADER + len);
+
+	if (!buf) {
+		return Z_NULL;
+	}
+	memcpy(buf, &len, sizeof(len));
+	z->bytes += len;
+	return buf + ZALLOC_HEADER;
+}
+
+static void zstream_zfree(voidpf opaque, voidpf address)
+{
+	struct zstream *z = opaque;
+	char *buf = (char *) address - ZALLOC_HEADER;
+	size_t len;
+
+	memcpy(&len, buf, sizeof(len));
+	z->bytes -= len;
+	free(buf);
+}
+
+static struct zstream *zstream_new(int inflate, int bits, int level)
+{
+	int res;
+	struct zstream *z = calloc(1, sizeof(*z));
+
+	if (!z) {
+		return NULL;
+	}
+	z->strm.zalloc = zstream_zalloc;
+	z->strm.zfree = zstream_zfree;
+	z->strm.opaque = z;
+	/* Negative window bits for raw deflate data, with no zlib header or trailer */
+	if (inflate) {
+		res = inflateInit2(&z->strm, -bits);
+	} else {
+		res = deflateInit2(&z->strm, level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY);
+	}
+	if (res != Z_OK) {
+		free(z);
+		return NULL;
+	}
+	z->inflate = inflate ? 1 : 0;
+	z->bits = bits;
+	z->level = level;
+	return z;
+}
+
+/*! \brief Get an idle stream from the pool, or create one */
+static struct zstream *zpool_get(int inflate, int bits, int level)
+{
+	struct zstream *z, *prev = NULL;
+
+	pthread_mutex_lock(&zpool.lock);
+	for (z = zpool.idle; z; prev = z, z = z->next) {
+		if (z->inflate == (inflate ? 1 : 0) && z->bits == bits && (inflate || z->level == level)) {
+			if (prev) {
+				prev->next = z->next;
+			} else {
+				zpool.idle = z->next;
+			}
+			zpool.count--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&zpool.lock);
+	return z ? z : zstream_new(inflate, bits, level);
+}
+
+/*! \brief Reset a stream and return it to the pool, or free it */
+static void zpool_put(struct zstream *z)
+{
+	if (z->inflate) {
+		inflateReset(&z->strm);
+	} else {
+		deflateReset(&z->strm);
+	}
+	pthread_mutex_lock(&zpool.lock);
+	if (zpool.count < zpool.max) {
+		z->next = zpool.idle;
+		zpool.idle = z;
+		zpool.count++;
+		z = NULL;
+	}
+	pthread_mutex_unlock(&zpool.lock);
+	if (z) {
+		zstream_free(z);
+	}
+}
+
+void wss_deflate_set_pool_size(int max)
+{
+	struct zstream *z = NULL;
+
+	pthread_mutex_lock(&zpool.lock);
+	zpool.max = max;
+	while (zpool.count > max) {
+		struct zstream *next = zpool.idle->next;
+		zpool.idle->next = z;
+		z = zpool.idle;
+		zpool.idle = next;
+		zpool.count--;
+	}
+	pthread_mutex_unlock(&zpool.lock);
+	/* Free outside of the lock */
+	while (z) {
+		struct zstream *next = z->next;
+		zstream_free(z);
+		z = next;
+	}
+}
+
+/*! \brief Get the stream to use for a message, allocating it if needed */
+static struct zstream *stream_get(struct wss_deflate *d, int inflate)
+{
+	struct zstream **zp = inflate ? &d->inflater : &d->deflater;
+
+	if (!*zp) {
+		struct zstream *z = zpool_get(inflate, inflate ? d->inflate_bits : d->deflate_bits, d->level);
+		if (!z || (inflate ? d->inflate_nct : d->deflate_nct)) {
+			return z; /* Only used for this message */
+		}
+		*zp = z; /* Context takeover, retain it for the lifetime of the connection */
+	}
+	return *zp;
+}
+
+/*! \brief Done with a stream, after a message */
+static void stream_put(struct wss_deflate *d, struct zstream *z)
+{
+	if (z != d->inflater && z != d->deflater) {
+		zpool_put(z);
+	}
+}
+
+static int deflate_compress(void *ctx, const char *in, size_t inlen, char **out, size_t *outlen)
+{
+	struct wss_deflate *d = ctx;
+	struct zstream *z;
+	size_t size;
+	char *buf;
+
+	if (inlen > UINT_MAX / 2) {
+		return 1; /* Larger than zlib can take in one go. Since nothing was consumed, it's safe to send this uncompressed. */
+	}
+	z = stream_get(d, 0);
+	if (!z) {
+		return -1;
+	}
+	size = deflateBound(&z->strm, (uLong) inlen) + 8; /* Allow for the sync flush */
+	buf = malloc(size);
+	if (!buf) {
+		stream_put(d, z);
+		return -1;
+	}
+	z->strm.next_in = (Bytef *) in;
+	z->strm.avail_in = (uInt) inlen;
+	z->strm.next_out = (Bytef *) buf;
+	z->strm.avail_out = (uInt) size;
+	for (;;) {
+		char *newbuf;
+		size_t len;
+		int res = deflate(&z->strm, Z_SYNC_FLUSH);
+		if (res != Z_OK && res != Z_BUF_ERROR) {
+			free(buf);
+			stream_put(d, z);
+			return -1;
+		}
+		if (z->strm.avail_out) {
+			break; /* All input consumed and flushed */
+		}
+		/* Shouldn't happen given deflateBound, but just in case */
+		newbuf = realloc(buf, 2 * size);
+		if (!newbuf) {
+			free(buf);
+			stream_put(d, z);
+			return -1;
+		}
+		buf = newbuf;
+		len = size - z->strm.avail_out;
+		z->strm.next_out = (Bytef *) buf + len;
+		z->strm.avail_out = (uInt) (2 * size - len);
+		size *= 2;
+	}
+	*outlen = size - z->strm.avail_out;
+	if (*outlen >= sizeof(deflate_tail) && !memcmp(buf + *outlen - sizeof(deflate_tail), deflate_tail, sizeof(deflate_tail))) {
+		*outlen -= sizeof(deflate_tail);
+	}
+	stream_put(d, z);
+	if (d->deflate_nct && *outlen >= inlen) {
+		/* Incompressible. Since the context isn't retained, the peer won't miss this message. */
+		free(buf);
+		return 1;
+	}
+	*out = buf;
+	return 0;
+}
+
+static int deflate_decompress(void *ctx, const char *in, size_t inlen, char **out, size_t *outlen, size_t maxlen)
+{
+	struct wss_deflate *d = ctx;
+	struct zstream *z;
+	size_t size;
+	char *buf;
+	int i, ended = 0;
+
+	z = stream_get(d, 1);
+	if (!z) {
+		return -1;
+	}
+	/* Guess a compression ratio, and grow as needed */
+	size = inlen < 64 ? 256 : 4 * inlen;
+	if (size > maxlen + 1) {
+		size = maxlen + 1;
+	}
+	buf = malloc(size + 1); /* Room for a NUL terminator */
+	if (!buf) {
+		stream_put(d, z);
+		return -1;
+	}
+	z->strm.next_out = (Bytef *) buf;
+	z->strm.avail_out = (uInt) size;
+	for (i = 0; i < 2 && !ended; i++) {
+		/* Decompress the payload, then the tail that the sender removed */
+		z->strm.next_in = (Bytef *) (i ? deflate_tail : in);
+		z->strm.avail_in = (uInt) (i ? sizeof(deflate_tail) : inlen);
+		for (;;) {
+			char *newbuf;
+			size_t len;
+			int res = inflate(&z->strm, Z_SYNC_FLUSH);
+			if (res == Z_STREAM_END) {
+				/* Sender finished the deflate stream (BFINAL). Nothing after that is valid. */
+				ended = 1;
+				break;
+			} else if (res != Z_OK && res != Z_BUF_ERROR) {
+				goto fail;
+			} else if (!z->strm.avail_in && z->strm.avail_out) {
+				break;
+			} else if (z->strm.avail_out) {
+				goto fail; /* No progress possible */
+			}
+			/* Out of room */
+			if (size > maxlen) {
+				free(buf);
+				stream_put(d, z);
+				return 1;
+			}
+			len = size;
+			size = 2 * size > maxlen + 1 ? maxlen + 1 : 2 * size;
+			newbuf = realloc(buf, size + 1);
+			if (!newbuf) {
+				goto fail;
+			}
+			buf = newbuf;
+			z->strm.next_out = (Bytef *) buf + len;
+			z->strm.avail_out = (uInt) (size - len);
+		}
+	}
+	*outlen = size - z->strm.avail_out;
+	if (*outlen > maxlen) {
+		free(buf);
+		stream_put(d, z);
+		return 1;
+	}
+	if (ended) {
+		inflateReset(&z->strm);
+	}
+	stream_put(d, z);
+	*out = buf;
+	return 0;
+
+fail:
+	free(buf);
+	stream_put(d, z);
+	return -1;
+}
+
+static void deflate_destroy(void *ctx)
+{
+	struct wss_deflate *d = ctx;
+
+	if (d->deflater) {
+		zstream_free(d->deflater);
+	}
+	if (d->inflater) {
+		zstream_free(d->inflater);
+	}
+	free(d);
+}
+
+/*! \brief Memory used by a connection, not counting streams borrowed from the pool (which only happens during a message) */
+static size_t deflate_memory_usage(void *ctx)
+{
+	struct wss_deflate *d = ctx;
+	size_t bytes = sizeof(*d);
+
+	if (d->deflater) {
+		bytes += sizeof(*d->deflater) + d->deflater->bytes;
+	}
+	if (d->inflater) {
+		bytes += sizeof(*d->inflater) + d->inflater->bytes;
+	}
+	return bytes;
+}
+
+static const struct wss_compression_ops deflate_ops = {
+	.compress = deflate_compress,
+	.decompress = deflate_decompress,
+	.destroy = deflate_destroy,
+	.memory_usage = deflate_memory_usage,
+};
+
+struct wss_encoded_frame *wss_deflate_encode_frame(enum websocket_type type, int opcode, const char *payload, size_t len, int window_bits, int level)
+{
+	struct wss_deflate d;
+
+	if (window_bits < 9 || window_bits > 15) {
+		return NULL;
+	}
+	/* A temporary context, with no context takeover, so a pooled stream is used and reset afterwards */
+	memset(&d, 0, sizeof(d));
+	d.level = level;
+	d.deflate_bits = window_bits;
+	d.deflate_nct = 1;
+	return wss_encode_compressed_frame(type, opcode, payload, len, &deflate_ops, &d);
+}
+
+int wss_deflate_can_share(struct wss_client *client, int window_bits)
+{
+	struct wss_deflate *d = wss_compression_context(client, &deflate_ops);
+	/* With context takeover, the recipient's decompressor would then hold history our compressor for it doesn't know about */
+	return d && d->deflate_nct && d->deflate_bits >= window_bits;
+}
+
+/*! \brief Window bits to use, given the value from the parameters (0 for default) */
+#define WINDOW_BITS(x) ((x) > 0 ? (x) : 15)
+
+int wss_deflate_enable(struct wss_client *client, enum websocket_type type, const struct wss_deflate_params *params, int level)
+{
+	struct wss_deflate *d;
+
+	if (level < -1 || level > 9) {
+		return -1;
+	}
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		return -1;
+	}
+	d->level = level;
+	if (type == WS_SERVER) {
+		d->deflate_bits = WINDOW_BITS(params->server_max_window_bits);
+		d->inflate_bits = WINDOW_BITS(params->client_max_window_bits);
+		d->deflate_nct = params->server_no_context_takeover ? 1 : 0;
+		d->inflate_nct = params->client_no_context_takeover ? 1 : 0;
+	} else {
+		d->deflate_bits = WINDOW_BITS(params->client_max_window_bits);
+		d->inflate_bits = WINDOW_BITS(params->server_max_window_bits);
+		d->deflate_nct = params->client_no_context_takeover ? 1 : 0;
+		d->inflate_nct = params->server_no_context_takeover ? 1 : 0;
+	}
+	if (d->deflate_bits < 9 || d->deflate_bits > 15 || d->inflate_bits < 8 || d->inflate_bits > 15) {
+		free(d);
+		return -1;
+	}
+	wss_set_compression(client, &deflate_ops, d);
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * libwss -- WebSocket Server Library
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <bbs@phreaknet.org>
+ *
+ * This program is free software, distributed under the terms of
+ * the Mozilla Public License Version 2.
+ */
+
+/*! \file
+ *
+ * \brief permessage-deflate (RFC 7692) compression using zlib
+ *
+ * \note This is built separately from libwss (make deflate), so that the core library has no dependencies.
+ *       Include wss.h before this header, and link with -lwss_deflate -lwss -lz.
+ */
+
+/*!
+ * \brief Enable permessage-deflate compression for a client, once negotiated
+ * \param client
+ * \param type Type of the connection (same as set using wss_set_client_type)
+ * \param params Parameters agreed on using wss_deflate_negotiate (servers) or wss_deflate_accept (clients)
+ * \param level zlib compression level (0-9), or -1 for the default
+ * \retval 0 on success, -1 on failure
+ * \note zlib streams are only allocated when a message is first compressed or decompressed.
+ *       Directions with no context takeover borrow streams from a process-wide pool for each message,
+ *       rather than each connection retaining its own (a compressor uses about 256 KB with the default window size).
+ */
+int wss_deflate_enable(struct wss_client *client, enum websocket_type type, const struct wss_deflate_params *params, int level);
+
+/*!
+ * \brief Set the number of idle zlib streams retained for connections with no context takeover
+ * \param max Maximum number of idle streams to retain (default is 16). 0 frees all idle streams.
+ */
+void wss_deflate_set_pool_size(int max);
+
+/*!
+ * \brief Compress and encode a data frame once, for broadcasting to many connections using wss_write_encoded
+ * \param type The type of connections to which this frame will be sent
+ * \param opcode Frame opcode
+ * \param payload Optional payload (NULL if none)
+ * \param len Length in octets of the payload
+ * \param window_bits Window size to compress with (9-15). This must not exceed the window size negotiated with any recipient.
+ * \param level zlib compression level (0-9), or -1 for the default
+ * \return NULL on failure, encoded frame on success
+ * \note The payload is compressed from a fresh context, so the frame can only be sent to connections
+ *       for which wss_deflate_can_share returns 1. Compress separately for others, e.g. using wss_write.
+ */
+struct wss_encoded_frame *wss_deflate_encode_frame(enum websocket_type type, int opcode, const char *payload, size_t len, int window_bits, int level);
+
+/*!
+ * \brief Whether a frame encoded using wss_deflate_encode_frame can be sent to a client
+ * \param client
+ * \param window_bits Window size the frame was compressed with
+ * \retval 1 if the client negotiated permessage-deflate with no context takeover for messages we send,
+ *           and a window at least as large as window_bits
+ * \retval 0 otherwise
+ */
+int wss_deflate_can_share(struct wss_client *client, int window_bits);